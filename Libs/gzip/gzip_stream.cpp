@@ -0,0 +1,85 @@
+#include "gzip_stream.h"
+
+#include <stdexcept>
+#include <string>
+
+#include <zlib.h>
+
+using namespace std;
+
+
+namespace Gzip {
+    // windowBits 15 + 16 makes zlib write gzip header and trailer instead of zlib ones
+    static const int GZIP_WINDOW_BITS = 15 + 16;
+    static const int MEMORY_LEVEL = 8;
+
+    OutputBuffer::OutputBuffer(ostream& sink, int level): sink_(sink), stream_(make_unique<z_stream_s>()) {
+        if (deflateInit2(stream_.get(), level, Z_DEFLATED, GZIP_WINDOW_BITS, MEMORY_LEVEL,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw runtime_error("Can't initialize gzip compression: " + string(stream_->msg ? stream_->msg : ""));
+        }
+        setp(input_.data(), input_.data() + input_.size());
+    }
+
+    OutputBuffer::~OutputBuffer() {
+        try {
+            Finish();
+        } catch (...) {
+        }
+        deflateEnd(stream_.get());
+    }
+
+    void OutputBuffer::Deflate(int flush) {
+        stream_->next_in = reinterpret_cast<Bytef*>(pbase());
+        stream_->avail_in = static_cast<uInt>(pptr() - pbase());
+        do {
+            stream_->next_out = reinterpret_cast<Bytef*>(output_.data());
+            stream_->avail_out = static_cast<uInt>(output_.size());
+            int status = deflate(stream_.get(), flush);
+            if (status == Z_STREAM_ERROR) {
+                throw runtime_error("Gzip compression failed");
+            }
+            sink_.write(output_.data(), output_.size() - stream_->avail_out);
+        } while (stream_->avail_out == 0);
+        setp(input_.data(), input_.data() + input_.size());
+    }
+
+    OutputBuffer::int_type OutputBuffer::overflow(int_type ch) {
+        if (finished_) {
+            return traits_type::eof();
+        }
+        Deflate(Z_NO_FLUSH);
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    int OutputBuffer::sync() {
+        if (finished_) {
+            return 0;
+        }
+        Deflate(Z_SYNC_FLUSH);
+        sink_.flush();
+        return sink_ ? 0 : -1;
+    }
+
+    void OutputBuffer::Finish() {
+        if (finished_) {
+            return;
+        }
+        Deflate(Z_FINISH);
+        finished_ = true;
+        setp(nullptr, nullptr);
+        sink_.flush();
+    }
+
+    OStream::OStream(ostream& sink, int level): ostream(nullptr), buffer_(sink, level) {
+        rdbuf(&buffer_);
+    }
+
+    void OStream::Finish() {
+        buffer_.Finish();
+    }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <ostream>
+#include <streambuf>
+
+
+struct z_stream_s;
+
+
+// Streaming gzip compression on top of zlib (link with -lz)
+namespace Gzip {
+    class OutputBuffer : public std::streambuf {
+    private:
+        static const size_t BUFFER_SIZE = 1 << 16;
+
+        std::ostream& sink_;
+        std::unique_ptr<z_stream_s> stream_;
+        std::array<char, BUFFER_SIZE> input_{};
+        std::array<char, BUFFER_SIZE> output_{};
+        bool finished_ = false;
+
+        void Deflate(int flush);
+
+    protected:
+        int_type overflow(int_type ch) override;
+        int sync() override;
+
+    public:
+        explicit OutputBuffer(std::ostream& sink, int level = -1);
+        // level 0..9, -1 - zlib default
+        ~OutputBuffer() override;
+
+        void Finish();
+        // Compresses buffered data and writes gzip trailer, no writes are allowed after it
+    };
+
+    class OStream : public std::ostream {
+    private:
+        OutputBuffer buffer_;
+    public:
+        explicit OStream(std::ostream& sink, int level = -1);
+
+        void Finish();
+    };
+}
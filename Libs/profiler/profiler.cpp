@@ -0,0 +1,142 @@
+#include "profiler.h"
+
+#include <cstdlib>
+#include <iomanip>
+#include <new>
+
+using namespace std;
+
+
+namespace {
+    thread_local uint64_t thread_bytes_allocated = 0;
+    thread_local uint64_t thread_allocations = 0;
+}
+
+
+#ifdef FAMILY_TREE_PROFILING
+// Global allocation hooks, they exist only in profiling builds. Every new goes through CountedMalloc and
+// every delete through free, so replaced forms stay paired
+namespace {
+    void *CountedMalloc(size_t size) {
+        thread_bytes_allocated += size;
+        ++thread_allocations;
+        if (void *ptr = malloc(size ? size : 1)) {
+            return ptr;
+        }
+        throw bad_alloc();
+    }
+}
+
+void *operator new(size_t size) {
+    return CountedMalloc(size);
+}
+
+void *operator new[](size_t size) {
+    return CountedMalloc(size);
+}
+
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept {
+    free(ptr);
+}
+#endif
+
+
+namespace Profiling {
+    bool IsEnabled() {
+#ifdef FAMILY_TREE_PROFILING
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    uint64_t ThreadBytesAllocated() {
+        return thread_bytes_allocated;
+    }
+
+    uint64_t ThreadAllocations() {
+        return thread_allocations;
+    }
+
+    void OperationStats::AddCall(uint64_t ns, uint64_t nodes, uint64_t bytes, uint64_t n_allocations) {
+        ++calls;
+        total_ns += ns;
+        max_ns = max(max_ns, ns);
+        nodes_visited += nodes;
+        bytes_allocated += bytes;
+        allocations += n_allocations;
+        size_t bucket = 0;
+        for (uint64_t us = ns / 1000; us > 0 && bucket + 1 < N_LATENCY_BUCKETS; us >>= 1) {
+            ++bucket;
+        }
+        ++latency_histogram[bucket];
+    }
+
+    Registry &Registry::Instance() {
+        static Registry registry;
+        return registry;
+    }
+
+    void Registry::Record(const string &operation, uint64_t ns, uint64_t nodes,
+                          uint64_t bytes, uint64_t n_allocations) {
+        lock_guard guard(mutex_);
+        stats_[operation].AddCall(ns, nodes, bytes, n_allocations);
+    }
+
+    map<string, OperationStats> Registry::GetStats() const {
+        lock_guard guard(mutex_);
+        return stats_;
+    }
+
+    void Registry::Reset() {
+        lock_guard guard(mutex_);
+        stats_.clear();
+    }
+
+    void Registry::Print(ostream &output) const {
+        auto stats = GetStats();
+        if (stats.empty()) {
+            output << "No operations recorded\n";
+            return;
+        }
+        for (const auto &[operation, op_stats] : stats) {
+            output << operation << ": calls=" << op_stats.calls
+                   << " total_ms=" << fixed << setprecision(3) << op_stats.total_ns / 1e6
+                   << " avg_us=" << op_stats.total_ns / 1e3 / op_stats.calls
+                   << " max_us=" << op_stats.max_ns / 1e3 << defaultfloat
+                   << " nodes_visited=" << op_stats.nodes_visited
+                   << " bytes_allocated=" << op_stats.bytes_allocated
+                   << " allocations=" << op_stats.allocations << "\n";
+            output << "  latency_us:";
+            for (size_t bucket = 0; bucket < OperationStats::N_LATENCY_BUCKETS; ++bucket) {
+                if (op_stats.latency_histogram[bucket]) {
+                    output << " <" << (uint64_t(1) << bucket) << ":" << op_stats.latency_histogram[bucket];
+                }
+            }
+            output << "\n";
+        }
+    }
+
+    ScopedOperation::ScopedOperation(const char *operation)
+            : operation_(operation), start_(chrono::steady_clock::now()),
+              start_bytes_(thread_bytes_allocated), start_allocations_(thread_allocations) {}
+
+    ScopedOperation::~ScopedOperation() {
+        auto ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start_).count();
+        uint64_t bytes = thread_bytes_allocated - start_bytes_;
+        uint64_t n_allocations = thread_allocations - start_allocations_;
+        Registry::Instance().Record(operation_, ns, nodes_visited_, bytes, n_allocations);
+    }
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+
+// Opt-in instrumentation: build with -DFAMILY_TREE_PROFILING to enable.
+// When the switch is off PROFILE_* macros expand to nothing and cost nothing.
+namespace Profiling {
+    bool IsEnabled();
+
+    uint64_t ThreadBytesAllocated();
+    uint64_t ThreadAllocations();
+    // Counters of current thread, non-zero only if operator new is hooked (profiling enabled)
+
+    struct OperationStats {
+        static const size_t N_LATENCY_BUCKETS = 24;
+        // Bucket i counts calls that took [2^(i-1), 2^i) microseconds, bucket 0 - less than 1 microsecond
+
+        uint64_t calls = 0;
+        uint64_t total_ns = 0;
+        uint64_t max_ns = 0;
+        uint64_t nodes_visited = 0;
+        uint64_t bytes_allocated = 0;
+        uint64_t allocations = 0;
+        std::array<uint64_t, N_LATENCY_BUCKETS> latency_histogram{};
+
+        void AddCall(uint64_t ns, uint64_t nodes, uint64_t bytes, uint64_t n_allocations);
+    };
+
+    class Registry {
+    private:
+        mutable std::mutex mutex_;
+        std::map<std::string, OperationStats> stats_;
+    public:
+        static Registry &Instance();
+
+        void Record(const std::string &operation, uint64_t ns, uint64_t nodes,
+                    uint64_t bytes, uint64_t n_allocations);
+        std::map<std::string, OperationStats> GetStats() const;
+        void Reset();
+        void Print(std::ostream &output) const;
+    };
+
+    class ScopedOperation {
+    private:
+        const char *operation_;
+        std::chrono::steady_clock::time_point start_;
+        uint64_t start_bytes_, start_allocations_;
+        uint64_t nodes_visited_ = 0;
+    public:
+        explicit ScopedOperation(const char *operation);
+        ScopedOperation(const ScopedOperation &) = delete;
+        ScopedOperation &operator =(const ScopedOperation &) = delete;
+        ~ScopedOperation();
+
+        void AddNodesVisited(uint64_t n_nodes) { nodes_visited_ += n_nodes; }
+    };
+}
+
+
+#ifdef FAMILY_TREE_PROFILING
+#define PROFILE_OPERATION(name) Profiling::ScopedOperation profile_operation_(name)
+#define PROFILE_NODES_VISITED(n) profile_operation_.AddNodesVisited(n)
+#else
+#define PROFILE_OPERATION(name)
+#define PROFILE_NODES_VISITED(n)
+#endif
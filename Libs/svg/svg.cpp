@@ -1,6 +1,11 @@
 #include "svg.h"
 
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <limits>
 #include <sstream>
+#include <stdexcept>
 
 using namespace std;
 
@@ -30,7 +35,47 @@ namespace Svg {
         return out;
     }
 
-    void GraphicalObject::RenderFeatures(ostream& out) const {
+    StringWriter& StringWriter::operator <<(double value) {
+        char chars[32];
+        auto result = to_chars(begin(chars), end(chars), value, chars_format::general, 6);
+        buffer_.append(chars, result.ptr);
+        return *this;
+    }
+
+    StringWriter& StringWriter::operator <<(int value) {
+        char chars[16];
+        auto result = to_chars(begin(chars), end(chars), value);
+        buffer_.append(chars, result.ptr);
+        return *this;
+    }
+
+    StringWriter& StringWriter::operator <<(uint32_t value) {
+        char chars[16];
+        auto result = to_chars(begin(chars), end(chars), value);
+        buffer_.append(chars, result.ptr);
+        return *this;
+    }
+
+    StringWriter& StringWriter::operator <<(const Color& col) {
+        if (holds_alternative<Rgb>(col)) {
+            Rgb rgb = get<Rgb>(col);
+            *this << "rgb(" << rgb.red << ',' << rgb.green << ',' << rgb.blue << ')';
+        }
+        else if (holds_alternative<Rgba>(col)) {
+            Rgba rgba = get<Rgba>(col);
+            *this << "rgba(" << rgba.red << ',' << rgba.green << ',' << rgba.blue << ',' << rgba.alpha << ')';
+        }
+        else if (holds_alternative<string>(col)) {
+            *this << string_view(get<string>(col));
+        }
+        else {
+            *this << "none";
+        }
+        return *this;
+    }
+
+    template<typename Out>
+    void GraphicalObject::RenderFeatures(Out& out) const {
         out << "fill=\"" << fill_color_ << "\" ";
         out << "stroke=\"" << stroke_color_ << "\" ";
         out << "stroke-width=\"" << stroke_width_ << "\" ";
@@ -41,6 +86,16 @@ namespace Svg {
     }
 
     void Circle::Render(ostream& out) const {
+        RenderImpl(out);
+    }
+
+    void Circle::Render(string& out) const {
+        StringWriter writer(out);
+        RenderImpl(writer);
+    }
+
+    template<typename Out>
+    void Circle::RenderImpl(Out& out) const {
         out << "<circle ";
         RenderFeatures(out);
         out << "cx=\"" << cx_ << "\" ";
@@ -50,6 +105,16 @@ namespace Svg {
     }
 
     void Polyline::Render(ostream& out) const {
+        RenderImpl(out);
+    }
+
+    void Polyline::Render(string& out) const {
+        StringWriter writer(out);
+        RenderImpl(writer);
+    }
+
+    template<typename Out>
+    void Polyline::RenderImpl(Out& out) const {
         out << "<polyline ";
         RenderFeatures(out);
         out << "points=\"";
@@ -60,7 +125,65 @@ namespace Svg {
         out << "/>";
     }
 
+    Path& Path::LineTo(Point p) {
+        // Relative tolerance keeps segments computed with rounding errors mergeable
+        static const double COLLINEAR_EPSILON = 1e-9;
+        size_t n_commands = commands_.size();
+        if (n_commands >= 2 && !commands_.back().move) {
+            Point from = commands_[n_commands - 2].point, to = commands_.back().point;
+            double last_dx = to.x - from.x, last_dy = to.y - from.y;
+            double dx = p.x - to.x, dy = p.y - to.y;
+            double cross = last_dx * dy - last_dy * dx;
+            double dot = last_dx * dx + last_dy * dy;
+            double scale = (abs(last_dx) + abs(last_dy)) * (abs(dx) + abs(dy));
+            if (dot > 0 && abs(cross) <= COLLINEAR_EPSILON * scale) {
+                commands_.back().point = p;
+                return *this;
+            }
+        }
+        commands_.push_back({p, false});
+        return *this;
+    }
+
+    size_t Path::GetSegmentCount() const {
+        return count_if(begin(commands_), end(commands_), [](const Command& command) { return !command.move; });
+    }
+
+    void Path::Render(ostream& out) const {
+        RenderImpl(out);
+    }
+
+    void Path::Render(string& out) const {
+        StringWriter writer(out);
+        RenderImpl(writer);
+    }
+
+    template<typename Out>
+    void Path::RenderImpl(Out& out) const {
+        out << "<path ";
+        RenderFeatures(out);
+        out << "d=\"";
+        for (size_t i = 0; i < commands_.size(); ++i) {
+            if (i) {
+                out << ' ';
+            }
+            out << (commands_[i].move ? 'M' : 'L') << commands_[i].point.x << ',' << commands_[i].point.y;
+        }
+        out << "\" ";
+        out << "/>";
+    }
+
     void Text::Render(ostream& out) const {
+        RenderImpl(out);
+    }
+
+    void Text::Render(string& out) const {
+        StringWriter writer(out);
+        RenderImpl(writer);
+    }
+
+    template<typename Out>
+    void Text::RenderImpl(Out& out) const {
         out << "<text ";
         RenderFeatures(out);
         out << "x=\"" << x_ << "\" ";
@@ -77,7 +200,17 @@ namespace Svg {
         out << "</text>";
     }
 
-    void Rect::Render(ostream &out) const {
+    void Rect::Render(ostream& out) const {
+        RenderImpl(out);
+    }
+
+    void Rect::Render(string& out) const {
+        StringWriter writer(out);
+        RenderImpl(writer);
+    }
+
+    template<typename Out>
+    void Rect::RenderImpl(Out& out) const {
         out << "<rect ";
         RenderFeatures(out);
         out << "x=\"" << x_ << "\" ";
@@ -87,17 +220,104 @@ namespace Svg {
         out << "/>";
     }
 
+    static void RenderChild(ostream& out, const GraphicalObject& object) {
+        object.Render(out);
+    }
+
+    static void RenderChild(StringWriter& out, const GraphicalObject& object) {
+        object.Render(out.GetBuffer());
+    }
+
+    void Group::Render(ostream& out) const {
+        RenderImpl(out);
+    }
+
+    void Group::Render(string& out) const {
+        StringWriter writer(out);
+        RenderImpl(writer);
+    }
+
+    template<typename Out>
+    void Group::RenderImpl(Out& out) const {
+        out << "<g ";
+        if (class_name_)
+            out << "class=\"" << *class_name_ << "\" ";
+        RenderFeatures(out);
+        out << ">";
+        for (const auto& ptr : objects_) {
+            RenderChild(out, *ptr);
+        }
+        out << "</g>";
+    }
+
+    BoxGrid::BoxGrid(double cell_size): cell_size_(cell_size) {
+        if (!(cell_size > 0)) {
+            throw invalid_argument("Grid cell size should be positive");
+        }
+    }
+
+    template<typename CellConsumer>
+    void BoxGrid::ForEachCell(const Box& box, CellConsumer consume) const {
+        auto cell = [this](double coordinate) {
+            // Cell keys pack two 32-bit indices, converting a quotient out of their range is undefined
+            double index = floor(coordinate / cell_size_);
+            if (!(index >= numeric_limits<int32_t>::min() && index <= numeric_limits<int32_t>::max())) {
+                throw out_of_range("Box coordinate " + to_string(coordinate) + " is out of grid range");
+            }
+            return static_cast<int64_t>(index);
+        };
+        for (int64_t row = cell(box.top); row <= cell(box.bottom); ++row) {
+            for (int64_t column = cell(box.left); column <= cell(box.right); ++column) {
+                consume((static_cast<uint64_t>(static_cast<uint32_t>(row)) << 32) | static_cast<uint32_t>(column));
+            }
+        }
+    }
+
+    bool BoxGrid::Overlaps(const Box& box) const {
+        bool overlaps = false;
+        ForEachCell(box, [&](uint64_t cell_key) {
+            if (overlaps) {
+                return;
+            }
+            auto cell_it = cells_.find(cell_key);
+            if (cell_it == cells_.end()) {
+                return;
+            }
+            for (size_t box_i : cell_it->second) {
+                if (boxes_[box_i].Intersects(box)) {
+                    overlaps = true;
+                    return;
+                }
+            }
+        });
+        return overlaps;
+    }
+
+    void BoxGrid::Insert(const Box& box) {
+        ForEachCell(box, [&](uint64_t cell_key) {
+            cells_[cell_key].push_back(boxes_.size());
+        });
+        boxes_.push_back(box);
+    }
+
+    bool BoxGrid::TryInsert(const Box& box) {
+        if (Overlaps(box)) {
+            return false;
+        }
+        Insert(box);
+        return true;
+    }
+
     void Document::Merge(Document&& other) {
         move(begin(other.objects_), end(other.objects_), back_inserter(objects_));
     }
 
     void Document::Render(ostream& out) const {
-        out << R"(<?xml version="1.0" encoding="UTF-8" ?>)";
-        out << R"(<svg xmlns="http://www.w3.org/2000/svg" version="1.1">)";
+        out << PROLOGUE;
         for (const auto& ptr : objects_) {
             ptr->Render(out);
         }
-        out << R"(</svg>)";
+        out << EPILOGUE;
     }
 
     string Document::AsString() const {
@@ -105,4 +325,84 @@ namespace Svg {
         Render(ss);
         return ss.str();
     }
+
+    FlatDocument::StyleId FlatDocument::AddStyle(const Style& style) {
+        string rule;
+        StringWriter out(rule);
+        out << "fill:" << style.fill << ";stroke:" << style.stroke << ";stroke-width:" << style.stroke_width;
+        if (style.stroke_line_cap)
+            out << ";stroke-linecap:" << *style.stroke_line_cap;
+        if (style.stroke_line_join)
+            out << ";stroke-linejoin:" << *style.stroke_line_join;
+        if (style.font_size)
+            out << ";font-size:" << style.font_size << "px";
+        if (style.font_family)
+            out << ";font-family:" << *style.font_family;
+        if (style.font_weight)
+            out << ";font-weight:" << *style.font_weight;
+        auto [style_it, inserted] = style_ids_.emplace(rule, static_cast<StyleId>(style_rules_.size()));
+        if (inserted) {
+            style_rules_.push_back(std::move(rule));
+        }
+        return style_it->second;
+    }
+
+    void FlatDocument::AddPolyline(const Point* points_begin, const Point* points_end, StyleId style) {
+        size_t first_point = points_.size();
+        points_.insert(points_.end(), points_begin, points_end);
+        polylines_.push_back({first_point, points_.size(), style});
+    }
+
+    void FlatDocument::AddText(Point position, string_view data, StyleId style) {
+        size_t data_begin = text_data_.size();
+        text_data_.append(data);
+        texts_.push_back({position, data_begin, text_data_.size(), style});
+    }
+
+    template<typename Out>
+    void FlatDocument::RenderImpl(Out& out) const {
+        out << Document::PROLOGUE;
+        out << "<style>";
+        for (size_t style = 0; style < style_rules_.size(); ++style) {
+            out << ".s" << static_cast<uint32_t>(style) << "{" << style_rules_[style] << "}";
+        }
+        out << "</style>";
+        for (const PolylineShape& polyline : polylines_) {
+            out << "<polyline class=\"s" << polyline.style << "\" points=\"";
+            for (size_t point = polyline.points_begin; point < polyline.points_end; ++point) {
+                if (point != polyline.points_begin) {
+                    out << ' ';
+                }
+                out << points_[point].x << ',' << points_[point].y;
+            }
+            out << "\"/>";
+        }
+        for (const CircleShape& circle : circles_) {
+            out << "<circle class=\"s" << circle.style << "\" cx=\"" << circle.center.x
+                << "\" cy=\"" << circle.center.y << "\" r=\"" << circle.radius << "\"/>";
+        }
+        for (const TextShape& text : texts_) {
+            out << "<text class=\"s" << text.style << "\" x=\"" << text.position.x
+                << "\" y=\"" << text.position.y << "\">"
+                << string_view(text_data_).substr(text.data_begin, text.data_end - text.data_begin) << "</text>";
+        }
+        out << Document::EPILOGUE;
+    }
+
+    void FlatDocument::Render(ostream& out) const {
+        string buffer;
+        Render(buffer);
+        out.write(buffer.data(), buffer.size());
+    }
+
+    void FlatDocument::Render(string& out) const {
+        StringWriter writer(out);
+        RenderImpl(writer);
+    }
+
+    string FlatDocument::AsString() const {
+        string result;
+        Render(result);
+        return result;
+    }
 }
@@ -8,6 +8,8 @@
 #include <cinttypes>
 #include <optional>
 #include <iostream>
+#include <string_view>
+#include <unordered_map>
 
 
 namespace Svg {
@@ -30,6 +32,38 @@ namespace Svg {
 
     const Color NoneColor = Color();
 
+    class StringWriter {
+        // Appends to string like ostream but without locale and virtual calls,
+        // numbers are formatted with std::to_chars exactly as default ostream does (%g, precision 6)
+    private:
+        std::string& buffer_;
+    public:
+        explicit StringWriter(std::string& buffer) : buffer_(buffer) {}
+
+        std::string& GetBuffer() { return buffer_; }
+
+        StringWriter& operator <<(std::string_view str) {
+            buffer_.append(str);
+            return *this;
+        }
+        StringWriter& operator <<(const std::string& str) {
+            buffer_.append(str);
+            return *this;
+        }
+        StringWriter& operator <<(const char* str) {
+            buffer_.append(str);
+            return *this;
+        }
+        StringWriter& operator <<(char ch) {
+            buffer_.push_back(ch);
+            return *this;
+        }
+        StringWriter& operator <<(double value);
+        StringWriter& operator <<(int value);
+        StringWriter& operator <<(uint32_t value);
+        StringWriter& operator <<(const Color& col);
+    };
+
     class GraphicalObject {
     protected:
         Color fill_color_ = NoneColor;
@@ -39,8 +73,11 @@ namespace Svg {
     public:
         virtual ~GraphicalObject() = default;
         virtual void Render(std::ostream& out) const = 0;
+        virtual void Render(std::string& out) const = 0;
+        // Appends object to out, faster than ostream version
 
-        void RenderFeatures(std::ostream& out) const;
+        template<typename Out>
+        void RenderFeatures(Out& out) const;
     };
 
 
@@ -86,6 +123,10 @@ namespace Svg {
         }
 
         void Render(std::ostream& out) const override;
+        void Render(std::string& out) const override;
+    private:
+        template<typename Out>
+        void RenderImpl(Out& out) const;
     };
 
     class Polyline : public GraphicalObjectSetters<Polyline> {
@@ -99,13 +140,43 @@ namespace Svg {
         }
 
         void Render(std::ostream& out) const override;
+        void Render(std::string& out) const override;
+    private:
+        template<typename Out>
+        void RenderImpl(Out& out) const;
+    };
+
+    class Path : public GraphicalObjectSetters<Path> {
+        // Straight subpaths: MoveTo starts a subpath, LineTo extends it. LineTo that continues the last
+        // segment in the same direction moves its end instead of adding a segment
+    private:
+        struct Command {
+            Point point;
+            bool move;
+        };
+        std::vector<Command> commands_;
+    public:
+        ~Path() = default;
+        Path& MoveTo(Point p) {
+            commands_.push_back({p, true});
+            return *this;
+        }
+        Path& LineTo(Point p);
+
+        size_t GetSegmentCount() const;
+
+        void Render(std::ostream& out) const override;
+        void Render(std::string& out) const override;
+    private:
+        template<typename Out>
+        void RenderImpl(Out& out) const;
     };
 
     class Text : public GraphicalObjectSetters<Text> {
     private:
         double x_ = 0.0, y_ = 0.0;
         double dx_ = 0.0, dy_ = 0.0;
-        uint32_t font_size_ = 1;
+        double font_size_ = 1;
         std::optional<std::string> font_family_, font_weight_;
         std::string data_;
     public:
@@ -123,7 +194,7 @@ namespace Svg {
             return *this;
         }
 
-        Text& SetFontSize(uint32_t new_font_size) {
+        Text& SetFontSize(double new_font_size) {
             font_size_ = new_font_size;
             return *this;
         }
@@ -144,6 +215,10 @@ namespace Svg {
         }
 
         void Render(std::ostream& out) const override;
+        void Render(std::string& out) const override;
+    private:
+        template<typename Out>
+        void RenderImpl(Out& out) const;
     };
 
     class Rect : public GraphicalObjectSetters<Rect> {
@@ -166,19 +241,146 @@ namespace Svg {
         }
 
         void Render(std::ostream& out) const override;
+        void Render(std::string& out) const override;
+    private:
+        template<typename Out>
+        void RenderImpl(Out& out) const;
+    };
+
+    class Group : public GraphicalObjectSetters<Group> {
+        // <g> element: features are inherited by the children, class lets a viewer show or hide them at once
+    private:
+        std::optional<std::string> class_name_;
+        std::vector<std::unique_ptr<GraphicalObject>> objects_;
+    public:
+        Group& SetClass(const std::string& class_name) {
+            class_name_ = class_name;
+            return *this;
+        }
+
+        template<typename GraphObject>
+        Group& Add(GraphObject object) {
+            objects_.push_back(std::make_unique<GraphObject>(std::move(object)));
+            return *this;
+        }
+        size_t GetObjectCount() const { return objects_.size(); }
+
+        void Render(std::ostream& out) const override;
+        void Render(std::string& out) const override;
+    private:
+        template<typename Out>
+        void RenderImpl(Out& out) const;
+    };
+
+    struct Box {
+        double left, top, right, bottom;
+
+        bool Intersects(const Box& other) const {
+            return left < other.right && other.left < right && top < other.bottom && other.top < bottom;
+        }
+    };
+
+    class BoxGrid {
+        // Uniform grid over inserted boxes: overlap queries look only at cells covered by the query box.
+        // Coordinates divided by cell size must fit in int32, otherwise std::out_of_range is thrown
+    private:
+        double cell_size_;
+        std::vector<Box> boxes_;
+        std::unordered_map<uint64_t, std::vector<size_t>> cells_;
+
+        template<typename CellConsumer>
+        void ForEachCell(const Box& box, CellConsumer consume) const;
+    public:
+        explicit BoxGrid(double cell_size);
+
+        bool Overlaps(const Box& box) const;
+        void Insert(const Box& box);
+        bool TryInsert(const Box& box);
+        // Inserts box if it overlaps none of already inserted ones
+        size_t GetSize() const { return boxes_.size(); }
     };
 
     class Document {
     private:
         std::vector<std::unique_ptr<GraphicalObject>> objects_;
     public:
+        static constexpr std::string_view PROLOGUE =
+                R"(<?xml version="1.0" encoding="UTF-8" ?><svg xmlns="http://www.w3.org/2000/svg" version="1.1">)";
+        static constexpr std::string_view EPILOGUE = "</svg>";
+
         template<typename GraphObject>
         void Add(GraphObject object) {
             auto ptr = std::make_unique<GraphObject>(std::move(object));
             objects_.push_back(std::move(ptr));
         }
         void Merge(Document&& other);
+        size_t GetObjectCount() const { return objects_.size(); }
+        void Render(std::ostream& out) const;
+        std::string AsString() const;
+    };
+
+    struct Style {
+        Color fill = NoneColor;
+        Color stroke = NoneColor;
+        double stroke_width = 1.0;
+        std::optional<std::string> stroke_line_cap = {}, stroke_line_join = {};
+        uint32_t font_size = 0;  // 0 - not set
+        std::optional<std::string> font_family = {}, font_weight = {};
+    };
+
+    class FlatDocument {
+        // Value-based document: shapes are stored by type in contiguous arrays without
+        // virtual dispatch, equal styles are interned into a palette emitted once as CSS classes.
+        // Rendered in layers: polylines, then circles, then texts.
+    public:
+        using StyleId = uint32_t;
+
+    private:
+        struct CircleShape {
+            Point center;
+            double radius;
+            StyleId style;
+        };
+        struct PolylineShape {
+            size_t points_begin, points_end;
+            StyleId style;
+        };
+        struct TextShape {
+            Point position;
+            size_t data_begin, data_end;
+            StyleId style;
+        };
+
+        std::vector<std::string> style_rules_;
+        std::unordered_map<std::string, StyleId> style_ids_;
+        std::vector<CircleShape> circles_;
+        std::vector<PolylineShape> polylines_;
+        std::vector<TextShape> texts_;
+        std::vector<Point> points_;
+        std::string text_data_;
+
+        template<typename Out>
+        void RenderImpl(Out& out) const;
+
+    public:
+        StyleId AddStyle(const Style& style);
+        // Equal styles get the same id
+        size_t GetStyleCount() const { return style_rules_.size(); }
+
+        void AddCircle(Point center, double radius, StyleId style) {
+            circles_.push_back({center, radius, style});
+        }
+        void AddPolyline(const Point* points_begin, const Point* points_end, StyleId style);
+        void AddLine(Point from, Point to, StyleId style) {
+            Point points[] = {from, to};
+            AddPolyline(std::begin(points), std::end(points), style);
+        }
+        void AddText(Point position, std::string_view data, StyleId style);
+
+        size_t GetShapeCount() const { return circles_.size() + polylines_.size() + texts_.size(); }
+
         void Render(std::ostream& out) const;
+        void Render(std::string& out) const;
         std::string AsString() const;
     };
 }
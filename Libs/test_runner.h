@@ -9,6 +9,13 @@
 #include <string>
 #include <vector>
 #include <unordered_set>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <shared_mutex>
+#include <thread>
 
 namespace TestRunnerPrivate {
     template <
@@ -96,23 +103,53 @@ inline void Assert(bool b, const std::string& hint) {
     AssertEqual(b, true, hint);
 }
 
+struct ScaleBudget {
+    size_t scale;
+    double budget_ms = 0;
+    // 0 - no budget
+};
+
 class TestRunner {
+    // Runs tests on n_threads workers (1 - in place, in order) and reports wall-clock time of every test.
+    // Test with a budget fails if it runs longer than budget_ms; timed tests run alone, so that
+    // concurrent tests don't inflate their time
 public:
-    template <class TestFunc>
-    void RunTest(TestFunc func, const std::string& test_name) {
-        try {
-            func();
-            std::cerr << test_name << " OK" << std::endl;
-        } catch (std::exception& e) {
-            ++fail_count;
-            std::cerr << test_name << " fail: " << e.what() << std::endl;
-        } catch (...) {
-            ++fail_count;
-            std::cerr << "Unknown exception caught" << std::endl;
+    explicit TestRunner(size_t n_threads = 1) {
+        for (size_t thread_i = 0; n_threads > 1 && thread_i < n_threads; ++thread_i) {
+            workers.emplace_back([this] { Work(); });
         }
     }
 
+    template <class TestFunc>
+    void RunTest(TestFunc func, const std::string& test_name, double budget_ms = 0) {
+        Schedule([this, func, test_name, budget_ms] {
+            RunTimed(func, test_name, budget_ms);
+        });
+    }
+
+    template <class TestFunc>
+    void RunScaledTest(TestFunc func, const std::string& test_name, std::vector<ScaleBudget> scales) {
+        // Runs func(scale) for growing scales one after another: every scale has its own budget,
+        // time per unit of scale shows how the tested code grows
+        Schedule([this, func, test_name, scales] {
+            for (const ScaleBudget& scale : scales) {
+                if (!RunTimed([&func, &scale] { func(scale.scale); },
+                              test_name + "[" + std::to_string(scale.scale) + "]", scale.budget_ms)) {
+                    break;
+                }
+            }
+        });
+    }
+
     ~TestRunner() {
+        {
+            std::lock_guard lock(queue_mutex);
+            stopping = true;
+        }
+        queue_changed.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
         std::cerr.flush();
         if (fail_count > 0) {
             std::cerr << fail_count << " unit tests failed. Terminate" << std::endl;
@@ -122,6 +159,81 @@ public:
 
 private:
     int fail_count = 0;
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex queue_mutex;
+    std::condition_variable queue_changed;
+    bool stopping = false;
+    std::shared_mutex timing_mutex;
+    // Shared by untimed tests, exclusive for tests with budget
+    std::mutex report_mutex;
+
+    void Schedule(std::function<void()> task) {
+        if (workers.empty()) {
+            task();
+            return;
+        }
+        {
+            std::lock_guard lock(queue_mutex);
+            tasks.push(std::move(task));
+        }
+        queue_changed.notify_one();
+    }
+
+    void Work() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock lock(queue_mutex);
+                queue_changed.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop();
+            }
+            task();
+        }
+    }
+
+    template <class TestFunc>
+    bool RunTimed(const TestFunc& func, const std::string& test_name, double budget_ms) {
+        // Returns whether test passed
+        std::ostringstream report;
+        bool passed = false;
+        {
+            std::shared_lock shared_lock(timing_mutex, std::defer_lock);
+            std::unique_lock exclusive_lock(timing_mutex, std::defer_lock);
+            if (budget_ms > 0) {
+                exclusive_lock.lock();
+            } else {
+                shared_lock.lock();
+            }
+            auto start = std::chrono::steady_clock::now();
+            try {
+                func();
+                std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+                report << test_name;
+                if (budget_ms > 0 && elapsed.count() > budget_ms) {
+                    report << " fail: " << elapsed.count() << " ms exceeds budget of " << budget_ms << " ms";
+                } else {
+                    report << " OK " << elapsed.count() << " ms";
+                    if (budget_ms > 0) {
+                        report << " of " << budget_ms;
+                    }
+                    passed = true;
+                }
+            } catch (std::exception& e) {
+                report << test_name << " fail: " << e.what();
+            } catch (...) {
+                report << test_name << " fail: unknown exception caught";
+            }
+        }
+        std::lock_guard lock(report_mutex);
+        fail_count += !passed;
+        std::cerr << report.str() << std::endl;
+        return passed;
+    }
 };
 
 #ifndef FILE_NAME
@@ -146,6 +258,12 @@ private:
 #define RUN_TEST(tr, func) \
   tr.RunTest(func, #func)
 
+#define RUN_TEST_WITH_BUDGET(tr, func, budget_ms) \
+  tr.RunTest(func, #func, budget_ms)
+
+#define RUN_SCALED_TEST(tr, func, ...) \
+  tr.RunScaledTest(func, #func, {__VA_ARGS__})
+
 #define ASSERT_THROWS(expr, expected_exception) {                                           \
   bool __assert_private_flag = true;                                                        \
   try {                                                                                     \
@@ -0,0 +1,522 @@
+#include "attributes.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <charconv>
+#include <limits>
+#include <stdexcept>
+
+using namespace std;
+
+
+namespace FamilyTree {
+    NodeSet::NodeSet(size_t size, bool filled): words_((size + WORD_BITS - 1) / WORD_BITS, filled ? ~uint64_t(0) : 0),
+                                                size_(size) {
+        TrimLastWord();
+    }
+
+    void NodeSet::TrimLastWord() {
+        if (size_ % WORD_BITS) {
+            words_.back() &= (uint64_t(1) << (size_ % WORD_BITS)) - 1;
+        }
+    }
+
+    void NodeSet::Resize(size_t size) {
+        size_ = size;
+        words_.resize((size + WORD_BITS - 1) / WORD_BITS);
+        TrimLastWord();
+    }
+
+    size_t NodeSet::Count() const {
+        size_t count = 0;
+        for (uint64_t word : words_) {
+            count += popcount(word);
+        }
+        return count;
+    }
+
+    bool NodeSet::IsEmpty() const {
+        return all_of(begin(words_), end(words_), [](uint64_t word) { return word == 0; });
+    }
+
+    NodeSet &NodeSet::operator &=(const NodeSet &other) {
+        for (size_t word_i = 0; word_i < words_.size(); ++word_i) {
+            words_[word_i] &= other.words_[word_i];
+        }
+        return *this;
+    }
+
+    NodeSet &NodeSet::operator |=(const NodeSet &other) {
+        for (size_t word_i = 0; word_i < words_.size(); ++word_i) {
+            words_[word_i] |= other.words_[word_i];
+        }
+        return *this;
+    }
+
+    NodeSet &NodeSet::operator -=(const NodeSet &other) {
+        for (size_t word_i = 0; word_i < words_.size(); ++word_i) {
+            words_[word_i] &= ~other.words_[word_i];
+        }
+        return *this;
+    }
+
+    NodeSet &NodeSet::Invert() {
+        for (uint64_t &word : words_) {
+            word = ~word;
+        }
+        TrimLastWord();
+        return *this;
+    }
+
+    vector<size_t> NodeSet::ToIndices() const {
+        vector<size_t> indices;
+        indices.reserve(Count());
+        ForEach([&indices](size_t index) { indices.push_back(index); });
+        return indices;
+    }
+
+
+    const string_view AttributeStore::SCHEMA_PREFIX = "@ column ";
+    const string_view AttributeStore::ROW_SEPARATOR = " | ";
+
+    AttributeType AttributeStore::ParseType(string_view type) {
+        static const pair<string_view, AttributeType> TYPES[] = {
+                {"integer", AttributeType::Integer}, {"date", AttributeType::Date},
+                {"enum", AttributeType::Enum}, {"string", AttributeType::String},
+        };
+        for (auto [name, value] : TYPES) {
+            if (name == type) {
+                return value;
+            }
+        }
+        throw runtime_error("Unknown attribute type " + string(type) + ", should be integer, date, enum or string");
+    }
+
+    string_view AttributeStore::TypeName(AttributeType type) {
+        switch (type) {
+            case AttributeType::Integer:
+                return "integer";
+            case AttributeType::Date:
+                return "date";
+            case AttributeType::Enum:
+                return "enum";
+            case AttributeType::String:
+                return "string";
+        }
+        return "";
+    }
+
+    const AttributeStore::Column &AttributeStore::GetColumn(string_view name) const {
+        auto column_it = column_index_.find(name);
+        if (column_it == column_index_.end()) {
+            throw runtime_error("Unknown attribute " + string(name));
+        }
+        return columns_[column_it->second];
+    }
+
+    AttributeStore::Column &AttributeStore::GetColumn(string_view name) {
+        return const_cast<Column &>(static_cast<const AttributeStore &>(*this).GetColumn(name));
+    }
+
+    void AttributeStore::AddColumn(string_view name, AttributeType type, vector<string> enum_values) {
+        if (name.empty() || name.find_first_of(" \t=|") != string_view::npos) {
+            throw runtime_error("Bad attribute name \"" + string(name) + "\"");
+        }
+        if (HasColumn(name)) {
+            throw runtime_error("Attribute " + string(name) + " already exists");
+        }
+        if ((type == AttributeType::Enum) == enum_values.empty()) {
+            throw runtime_error("Values should be given for enum attributes only");
+        }
+        Column column{.name = string(name), .type = type, .values = vector<int64_t>(n_rows_),
+                      .present = NodeSet(n_rows_)};
+        for (string &value : enum_values) {
+            if (!column.codes.emplace(value, column.dictionary.size()).second) {
+                throw runtime_error("Duplicate value " + value + " of enum " + string(name));
+            }
+            column.dictionary.push_back(std::move(value));
+        }
+        column_index_.emplace(column.name, columns_.size());
+        columns_.push_back(std::move(column));
+    }
+
+    void AttributeStore::TruncateColumns(size_t n_columns) {
+        for (size_t column_i = n_columns; column_i < columns_.size(); ++column_i) {
+            column_index_.erase(columns_[column_i].name);
+        }
+        columns_.resize(min(n_columns, columns_.size()));
+    }
+
+    void AttributeStore::Resize(size_t n_rows) {
+        n_rows_ = n_rows;
+        for (Column &column : columns_) {
+            column.values.resize(n_rows);
+            column.present.Resize(n_rows);
+        }
+    }
+
+    int64_t AttributeStore::ParseValue(const Column &column, string_view value, bool upper_bound) {
+        auto parse_number = [&value](string_view digits) {
+            int64_t number;
+            auto [end, error] = from_chars(digits.data(), digits.data() + digits.size(), number);
+            if (digits.empty() || error != errc() || end != digits.data() + digits.size()) {
+                throw runtime_error("Bad attribute value " + string(value));
+            }
+            return number;
+        };
+        switch (column.type) {
+            case AttributeType::Integer:
+                return parse_number(value);
+            case AttributeType::Date: {
+                auto parts = Split(value, "-");
+                if (parts.empty() || parts.size() > 3 || value.front() == '-' || value.back() == '-') {
+                    throw runtime_error("Bad date " + string(value) + ", should be YYYY[-MM[-DD]]");
+                }
+                int64_t year = parse_number(parts[0]);
+                int64_t month = parts.size() > 1 ? parse_number(parts[1]) : (upper_bound ? 99 : 0);
+                int64_t day = parts.size() > 2 ? parse_number(parts[2]) : (upper_bound ? 99 : 0);
+                if (year < 0 || (parts.size() > 1 && (month < 1 || month > 12)) ||
+                    (parts.size() > 2 && (day < 1 || day > 31))) {
+                    throw runtime_error("Bad date " + string(value) + ", should be YYYY[-MM[-DD]]");
+                }
+                return (year * 100 + month) * 100 + day;
+            }
+            case AttributeType::Enum:
+            case AttributeType::String: {
+                auto code_it = column.codes.find(value);
+                if (code_it == column.codes.end()) {
+                    if (column.type == AttributeType::Enum) {
+                        throw runtime_error("Value " + string(value) + " is not in enum " + column.name);
+                    }
+                    return -1;
+                }
+                return code_it->second;
+            }
+        }
+        return 0;
+    }
+
+    int64_t AttributeStore::EncodeValue(Column &column, string_view value) {
+        if (column.type == AttributeType::String && !column.codes.count(value)) {
+            if (value.empty() || value.find_first_of(" \t\r\n") != string_view::npos) {
+                throw runtime_error("Attribute values can't be empty or contain whitespace");
+            }
+            column.codes.emplace(string(value), column.dictionary.size());
+            column.dictionary.emplace_back(value);
+        }
+        return ParseValue(column, value);
+    }
+
+    void AttributeStore::FormatValue(string &output, const Column &column, int64_t value) {
+        char buffer[32];
+        auto append_number = [&output, &buffer](int64_t number, int min_width) {
+            auto [end, error] = to_chars(buffer, buffer + sizeof(buffer), number);
+            output.append(max<ptrdiff_t>(0, min_width - (end - buffer)), '0');
+            output.append(buffer, end);
+        };
+        switch (column.type) {
+            case AttributeType::Integer:
+                append_number(value, 0);
+                break;
+            case AttributeType::Date:
+                append_number(value / 10000, 0);
+                if (value / 100 % 100) {
+                    output += '-';
+                    append_number(value / 100 % 100, 2);
+                    if (value % 100) {
+                        output += '-';
+                        append_number(value % 100, 2);
+                    }
+                }
+                break;
+            case AttributeType::Enum:
+            case AttributeType::String:
+                output += column.dictionary[value];
+                break;
+        }
+    }
+
+    void AttributeStore::Set(size_t row, string_view column_name, string_view value) {
+        Column &column = GetColumn(column_name);
+        column.values[row] = EncodeValue(column, value);
+        column.present.Insert(row);
+    }
+
+    void AttributeStore::Erase(size_t row, string_view column) {
+        GetColumn(column).present.Erase(row);
+    }
+
+    optional<string> AttributeStore::Get(size_t row, string_view column_name) const {
+        const Column &column = GetColumn(column_name);
+        if (!column.present.Contains(row)) {
+            return nullopt;
+        }
+        string value;
+        FormatValue(value, column, column.values[row]);
+        return value;
+    }
+
+    NodeSet AttributeStore::ScanRange(const Column &column, int64_t low, int64_t high) const {
+        // Unsigned wraparound turns low <= value <= high into one comparison,
+        // bits are built a word at a time without branches so the loop vectorizes
+        NodeSet result(n_rows_);
+        if (low > high) {
+            return result;
+        }
+        const int64_t *values = column.values.data();
+        const uint64_t range = static_cast<uint64_t>(high) - static_cast<uint64_t>(low);
+        auto &words = result.GetWords();
+        const auto &present_words = column.present.GetWords();
+        for (size_t word_i = 0; word_i < words.size(); ++word_i) {
+            size_t first_row = word_i * NodeSet::WORD_BITS;
+            size_t n_bits = min(NodeSet::WORD_BITS, n_rows_ - first_row);
+            uint64_t word = 0;
+            for (size_t bit = 0; bit < n_bits; ++bit) {
+                uint64_t offset = static_cast<uint64_t>(values[first_row + bit]) - static_cast<uint64_t>(low);
+                word |= static_cast<uint64_t>(offset <= range) << bit;
+            }
+            words[word_i] = word & present_words[word_i];
+        }
+        return result;
+    }
+
+    NodeSet AttributeStore::FilterPresent(string_view column) const {
+        return GetColumn(column).present;
+    }
+
+    NodeSet AttributeStore::FilterEqual(string_view column_name, string_view value) const {
+        const Column &column = GetColumn(column_name);
+        if (column.type == AttributeType::Date) {
+            return ScanRange(column, ParseValue(column, value), ParseValue(column, value, true));
+        }
+        int64_t code = ParseValue(column, value);
+        if (column.type == AttributeType::String && code < 0) {
+            return NodeSet(n_rows_);
+        }
+        return ScanRange(column, code, code);
+    }
+
+    NodeSet AttributeStore::FilterRange(string_view column_name, string_view low, string_view high) const {
+        const Column &column = GetColumn(column_name);
+        if (column.type != AttributeType::Integer && column.type != AttributeType::Date) {
+            throw runtime_error("Range filter needs integer or date attribute, " + column.name + " is " +
+                                string(TypeName(column.type)));
+        }
+        return ScanRange(column, ParseValue(column, low), ParseValue(column, high, true));
+    }
+
+    AttributeStore AttributeStore::SelectRows(const vector<size_t> &rows) const {
+        AttributeStore selected;
+        selected.column_index_ = column_index_;
+        selected.n_rows_ = rows.size();
+        for (const Column &column : columns_) {
+            Column &selected_column = selected.columns_.emplace_back(Column{
+                    .name = column.name, .type = column.type, .values = vector<int64_t>(rows.size()),
+                    .present = NodeSet(rows.size()), .dictionary = column.dictionary, .codes = column.codes});
+            for (size_t row = 0; row < rows.size(); ++row) {
+                selected_column.values[row] = column.values[rows[row]];
+                if (column.present.Contains(rows[row])) {
+                    selected_column.present.Insert(row);
+                }
+            }
+        }
+        return selected;
+    }
+
+    void AttributeStore::AssignRows(size_t first_row, const AttributeStore &rows) {
+        for (size_t column_i = 0; column_i < columns_.size(); ++column_i) {
+            Column &column = columns_[column_i];
+            const Column &source_column = rows.columns_[column_i];
+            for (size_t row = 0; row < rows.n_rows_; ++row) {
+                column.values[first_row + row] = source_column.values[row];
+                if (source_column.present.Contains(row)) {
+                    column.present.Insert(first_row + row);
+                } else {
+                    column.present.Erase(first_row + row);
+                }
+            }
+        }
+    }
+
+    void AttributeStore::AddColumnsOf(const AttributeStore &other) {
+        for (const Column &other_column : other.columns_) {
+            auto column_it = column_index_.find(other_column.name);
+            if (column_it == column_index_.end()) {
+                AddColumn(other_column.name, other_column.type,
+                          other_column.type == AttributeType::Enum ? other_column.dictionary : vector<string>());
+                continue;
+            }
+            const Column &column = columns_[column_it->second];
+            if (column.type != other_column.type ||
+                (column.type == AttributeType::Enum && column.dictionary != other_column.dictionary)) {
+                throw runtime_error("Attribute " + column.name + " has different types");
+            }
+        }
+    }
+
+    void AttributeStore::CopyRow(size_t row, const AttributeStore &source, size_t source_row) {
+        for (const Column &source_column : source.columns_) {
+            Column &column = GetColumn(source_column.name);
+            if (!source_column.present.Contains(source_row)) {
+                column.present.Erase(row);
+                continue;
+            }
+            int64_t value = source_column.values[source_row];
+            // Enum codes are equal in both stores, string codes are positions in different dictionaries
+            column.values[row] = source_column.type == AttributeType::String
+                                 ? EncodeValue(column, source_column.dictionary[value]) : value;
+            column.present.Insert(row);
+        }
+    }
+
+    void AttributeStore::WriteSchema(ostream &output, size_t first_column) const {
+        for (size_t column_i = first_column; column_i < columns_.size(); ++column_i) {
+            const Column &column = columns_[column_i];
+            output << SCHEMA_PREFIX << column.name << ' ' << TypeName(column.type);
+            if (column.type == AttributeType::Enum) {
+                for (const string &value : column.dictionary) {
+                    output << ' ' << value;
+                }
+            }
+            output << '\n';
+        }
+    }
+
+    void AttributeStore::ParseSchemaLine(string_view line) {
+        if (line.substr(0, SCHEMA_PREFIX.size()) != SCHEMA_PREFIX) {
+            throw runtime_error("Bad attribute schema line " + string(line));
+        }
+        auto tokens = Split(line.substr(SCHEMA_PREFIX.size()));
+        if (tokens.size() < 2) {
+            throw runtime_error("Attribute schema line should be @ column name type [enum values]");
+        }
+        AddColumn(tokens[0], ParseType(tokens[1]), vector<string>(tokens.begin() + 2, tokens.end()));
+    }
+
+    void AttributeStore::FormatRow(string &output, size_t row) const {
+        bool first = true;
+        for (const Column &column : columns_) {
+            if (!column.present.Contains(row)) {
+                continue;
+            }
+            output += first ? ROW_SEPARATOR : " ";
+            first = false;
+            output += column.name;
+            output += '=';
+            FormatValue(output, column, column.values[row]);
+        }
+    }
+
+    void AttributeStore::ParseRow(size_t row, string_view assignments) {
+        for (const string &assignment : Split(assignments)) {
+            size_t equals_pos = assignment.find('=');
+            if (equals_pos == string::npos) {
+                throw runtime_error("Attribute should be given as name=value, got " + assignment);
+            }
+            Set(row, string_view(assignment).substr(0, equals_pos), string_view(assignment).substr(equals_pos + 1));
+        }
+    }
+
+
+    namespace {
+        const char BINARY_MAGIC[4] = {'F', 'T', 'A', 'S'};
+        const uint32_t BINARY_VERSION = 1;
+
+        template<typename T>
+        void WriteRaw(ostream &output, const T &value) {
+            output.write(reinterpret_cast<const char *>(&value), sizeof(value));
+        }
+
+        template<typename T>
+        void WriteRawArray(ostream &output, const vector<T> &values) {
+            output.write(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(T));
+        }
+
+        void WriteString(ostream &output, string_view str) {
+            WriteRaw(output, static_cast<uint32_t>(str.size()));
+            output.write(str.data(), str.size());
+        }
+
+        template<typename T>
+        T ReadRaw(istream &input) {
+            T value;
+            if (!input.read(reinterpret_cast<char *>(&value), sizeof(value))) {
+                throw runtime_error("Truncated binary attribute store");
+            }
+            return value;
+        }
+
+        template<typename T>
+        void ReadRawArray(istream &input, vector<T> &values) {
+            if (!input.read(reinterpret_cast<char *>(values.data()), values.size() * sizeof(T))) {
+                throw runtime_error("Truncated binary attribute store");
+            }
+        }
+
+        string ReadString(istream &input) {
+            string str(ReadRaw<uint32_t>(input), '\0');
+            if (!input.read(str.data(), str.size())) {
+                throw runtime_error("Truncated binary attribute store");
+            }
+            return str;
+        }
+    }
+
+    void AttributeStore::WriteBinary(ostream &output) const {
+        // magic, version, rows, columns, then per column: name, type, dictionary, presence words, values
+        output.write(BINARY_MAGIC, sizeof(BINARY_MAGIC));
+        WriteRaw(output, BINARY_VERSION);
+        WriteRaw(output, static_cast<uint64_t>(n_rows_));
+        WriteRaw(output, static_cast<uint32_t>(columns_.size()));
+        for (const Column &column : columns_) {
+            WriteString(output, column.name);
+            WriteRaw(output, static_cast<uint8_t>(column.type));
+            WriteRaw(output, static_cast<uint32_t>(column.dictionary.size()));
+            for (const string &value : column.dictionary) {
+                WriteString(output, value);
+            }
+            WriteRawArray(output, column.present.GetWords());
+            WriteRawArray(output, column.values);
+        }
+    }
+
+    AttributeStore AttributeStore::ReadBinary(istream &input) {
+        char magic[sizeof(BINARY_MAGIC)];
+        if (!input.read(magic, sizeof(magic)) || !equal(begin(magic), end(magic), begin(BINARY_MAGIC)) ||
+            ReadRaw<uint32_t>(input) != BINARY_VERSION) {
+            throw runtime_error("Not a binary attribute store");
+        }
+        AttributeStore store;
+        store.n_rows_ = ReadRaw<uint64_t>(input);
+        auto n_columns = ReadRaw<uint32_t>(input);
+        for (uint32_t column_i = 0; column_i < n_columns; ++column_i) {
+            Column column{.name = ReadString(input)};
+            auto type = ReadRaw<uint8_t>(input);
+            if (type > static_cast<uint8_t>(AttributeType::String)) {
+                throw runtime_error("Bad attribute type in binary attribute store");
+            }
+            column.type = static_cast<AttributeType>(type);
+            auto dictionary_size = ReadRaw<uint32_t>(input);
+            for (uint32_t value_i = 0; value_i < dictionary_size; ++value_i) {
+                column.codes.emplace(column.dictionary.emplace_back(ReadString(input)), value_i);
+            }
+            column.present = NodeSet(store.n_rows_);
+            ReadRawArray(input, column.present.GetWords());
+            column.values.resize(store.n_rows_);
+            ReadRawArray(input, column.values);
+            column.present.Resize(store.n_rows_);
+            if (column.type == AttributeType::Enum || column.type == AttributeType::String) {
+                column.present.ForEach([&column](size_t row) {
+                    if (column.values[row] < 0 || column.values[row] >= static_cast<int64_t>(column.dictionary.size())) {
+                        throw runtime_error("Bad value code in binary attribute store");
+                    }
+                });
+            }
+            if (!store.column_index_.emplace(column.name, store.columns_.size()).second) {
+                throw runtime_error("Duplicate attribute in binary attribute store");
+            }
+            store.columns_.push_back(std::move(column));
+        }
+        return store;
+    }
+}
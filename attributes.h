@@ -0,0 +1,162 @@
+#pragma once
+
+#include "id_traits.h"
+
+#include <bit>
+#include <cstdint>
+#include <istream>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+
+namespace FamilyTree {
+    class NodeSet {
+        // Bitset over node indices [0, universe size), set algebra works a word (64 nodes) at a time
+    private:
+        std::vector<uint64_t> words_;
+        size_t size_ = 0;
+
+        void TrimLastWord();
+        // Keeps bits past size_ zero, so that Count and operator == don't see them
+
+    public:
+        static constexpr size_t WORD_BITS = 64;
+
+        NodeSet() = default;
+        explicit NodeSet(size_t size, bool filled = false);
+
+        size_t GetUniverseSize() const { return size_; }
+        void Resize(size_t size);
+        // New indices are not in set
+
+        bool Contains(size_t index) const { return words_[index / WORD_BITS] >> (index % WORD_BITS) & 1; }
+        void Insert(size_t index) { words_[index / WORD_BITS] |= uint64_t(1) << (index % WORD_BITS); }
+        void Erase(size_t index) { words_[index / WORD_BITS] &= ~(uint64_t(1) << (index % WORD_BITS)); }
+
+        size_t Count() const;
+        bool IsEmpty() const;
+
+        NodeSet &operator &=(const NodeSet &other);
+        NodeSet &operator |=(const NodeSet &other);
+        NodeSet &operator -=(const NodeSet &other);
+        NodeSet &Invert();
+        // Sets must have equal universe sizes
+
+        const std::vector<uint64_t> &GetWords() const { return words_; }
+        std::vector<uint64_t> &GetWords() { return words_; }
+        // Raw words for scan kernels, bits past universe size must stay zero
+
+        template<typename IndexConsumer>
+        void ForEach(IndexConsumer consume) const;
+        // Ascending indices
+        std::vector<size_t> ToIndices() const;
+
+        friend bool operator ==(const NodeSet &lhs, const NodeSet &rhs) {
+            return lhs.size_ == rhs.size_ && lhs.words_ == rhs.words_;
+        }
+    };
+
+
+    enum class AttributeType {
+        Integer,  // int64
+        Date,  // YYYY[-MM[-DD]], stored as YYYYMMDD with zero missing parts
+        Enum,  // one of values fixed when column is added
+        String,  // any value without whitespace, interned
+    };
+
+
+    class AttributeStore {
+        // Optional per-node attributes in typed columns indexed by node birth position.
+        // Every column is one contiguous int64 array: numbers, dates or dictionary codes of enums and strings,
+        // so every filter is the same branchless scan producing a NodeSet.
+        // Text format: schema lines "@ column name integer|date|string|enum value1 value2 ..." and
+        // node line suffixes " | name=value name=value".
+    private:
+        struct Column {
+            std::string name = {};
+            AttributeType type = AttributeType::Integer;
+            std::vector<int64_t> values = {};
+            NodeSet present = {};
+            std::vector<std::string> dictionary = {};
+            std::unordered_map<std::string, int64_t, TransparentStringHash, std::equal_to<>> codes = {};
+            // Code of value is its position in dictionary
+        };
+
+        std::vector<Column> columns_;
+        std::unordered_map<std::string, size_t, TransparentStringHash, std::equal_to<>> column_index_;
+        size_t n_rows_ = 0;
+
+        const Column &GetColumn(std::string_view name) const;
+        Column &GetColumn(std::string_view name);
+        static int64_t ParseValue(const Column &column, std::string_view value, bool upper_bound = false);
+        // upper_bound - partial dates are completed to their last day
+        int64_t EncodeValue(Column &column, std::string_view value);
+        // ParseValue interning new strings
+        static void FormatValue(std::string &output, const Column &column, int64_t value);
+        NodeSet ScanRange(const Column &column, int64_t low, int64_t high) const;
+
+    public:
+        static const std::string_view SCHEMA_PREFIX;
+        static const std::string_view ROW_SEPARATOR;
+
+        static AttributeType ParseType(std::string_view type);
+        static std::string_view TypeName(AttributeType type);
+
+        void AddColumn(std::string_view name, AttributeType type, std::vector<std::string> enum_values = {});
+        void TruncateColumns(size_t n_columns);
+        // Drops columns from position n_columns on
+        bool HasColumn(std::string_view name) const { return column_index_.count(name); }
+        bool IsEmpty() const { return columns_.empty(); }
+        size_t GetColumnCount() const { return columns_.size(); }
+        const std::string &GetColumnName(size_t column) const { return columns_[column].name; }
+        AttributeType GetColumnType(std::string_view name) const { return GetColumn(name).type; }
+
+        size_t GetRowCount() const { return n_rows_; }
+        void Resize(size_t n_rows);
+        // Tree keeps one row per node, new rows have no values
+
+        void Set(size_t row, std::string_view column, std::string_view value);
+        void Erase(size_t row, std::string_view column);
+        std::optional<std::string> Get(size_t row, std::string_view column) const;
+
+        NodeSet FilterPresent(std::string_view column) const;
+        NodeSet FilterEqual(std::string_view column, std::string_view value) const;
+        NodeSet FilterRange(std::string_view column, std::string_view low, std::string_view high) const;
+        // Inclusive range of integer or date column: dates "1600" - "1650" match the whole years
+
+        AttributeStore SelectRows(const std::vector<size_t> &rows) const;
+        // Same columns, row i is row rows[i] of this store
+        void AssignRows(size_t first_row, const AttributeStore &rows);
+        // Row first_row + i becomes row i of rows, which must be selected from this store
+        void AddColumnsOf(const AttributeStore &other);
+        // Adds columns of other missing here, columns of both stores must have the same type (and enum values)
+        void CopyRow(size_t row, const AttributeStore &source, size_t source_row);
+        // Row takes values of source_row in every column of source, columns are matched by name
+        // and must exist here; strings are interned into this store
+
+        void WriteSchema(std::ostream &output, size_t first_column = 0) const;
+        void ParseSchemaLine(std::string_view line);
+        void FormatRow(std::string &output, size_t row) const;
+        // Appends ROW_SEPARATOR and assignments, nothing if row has no values
+        void ParseRow(size_t row, std::string_view assignments);
+        // Whitespace separated name=value pairs
+
+        void WriteBinary(std::ostream &output) const;
+        static AttributeStore ReadBinary(std::istream &input);
+        // Raw columns in host byte order, for fast reload of large stores
+    };
+
+
+    template<typename IndexConsumer>
+    void NodeSet::ForEach(IndexConsumer consume) const {
+        for (size_t word_i = 0; word_i < words_.size(); ++word_i) {
+            for (uint64_t word = words_[word_i]; word; word &= word - 1) {
+                consume(word_i * WORD_BITS + std::countr_zero(word));
+            }
+        }
+    }
+}
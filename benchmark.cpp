@@ -0,0 +1,155 @@
+#include "benchmark.h"
+#include "synthetic_tree.h"
+#include "tree.h"
+
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <queue>
+#include <random>
+#include <thread>
+
+using namespace std;
+
+
+namespace {
+    class CountingBuffer : public streambuf {
+        // Discards everything, only counts bytes
+    public:
+        size_t n_bytes = 0;
+    protected:
+        int_type overflow(int_type ch) override {
+            ++n_bytes;
+            return ch;
+        }
+        streamsize xsputn(const char*, streamsize count) override {
+            n_bytes += count;
+            return count;
+        }
+    };
+
+    double MeasureSeconds(const function<void()>& func) {
+        auto start = chrono::steady_clock::now();
+        func();
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+
+    template<typename TreeT>
+    void BenchmarkRender(ostream& output, const TreeT& tree) {
+        output << "render, " << tree.GetSize() << " nodes, hardware concurrency "
+               << thread::hardware_concurrency() << '\n';
+        CountingBuffer sequential_buffer;
+        ostream sequential_stream(&sequential_buffer);
+        double sequential_seconds = MeasureSeconds([&] {
+            tree.RenderSvg().Render(sequential_stream);
+        });
+        output << "  RenderSvg().Render: " << sequential_seconds << " s, "
+               << sequential_buffer.n_bytes << " bytes\n";
+        for (size_t n_threads : {1, 2, 4, 8, 16}) {
+            CountingBuffer parallel_buffer;
+            ostream parallel_stream(&parallel_buffer);
+            double parallel_seconds = MeasureSeconds([&] {
+                tree.RenderSvgParallel(parallel_stream, n_threads);
+            });
+            output << "  RenderSvgParallel, " << setw(2) << n_threads << " threads: " << parallel_seconds
+                   << " s, speedup " << sequential_seconds / parallel_seconds << '\n';
+        }
+        CountingBuffer flat_buffer;
+        ostream flat_stream(&flat_buffer);
+        double flat_seconds = MeasureSeconds([&] {
+            tree.RenderFlatSvg().Render(flat_stream);
+        });
+        output << "  RenderFlatSvg().Render: " << flat_seconds << " s, " << flat_buffer.n_bytes
+               << " bytes, speedup " << sequential_seconds / flat_seconds << '\n';
+        CountingBuffer bundled_buffer;
+        ostream bundled_stream(&bundled_buffer);
+        double bundled_seconds = MeasureSeconds([&] {
+            tree.RenderBundledSvg().Render(bundled_stream);
+        });
+        output << "  RenderBundledSvg().Render: " << bundled_seconds << " s, " << bundled_buffer.n_bytes
+               << " bytes, speedup " << sequential_seconds / bundled_seconds << '\n';
+    }
+
+    template<typename TreeT>
+    TreeT ScatterBirthOrder(const TreeT& tree, uint32_t seed = 17) {
+        // Same nodes in a random valid birth order, like a pedigree typed in as records were found
+        mt19937 rnd(seed);
+        vector<size_t> n_unplaced_parents(tree.GetSize());
+        priority_queue<pair<uint32_t, size_t>> ready;
+        for (size_t index = 0; index < tree.GetSize(); ++index) {
+            for (size_t parent_index : tree.GetParentIndices(index)) {
+                n_unplaced_parents[index] += parent_index != TreeT::NO_INDEX;
+            }
+            if (n_unplaced_parents[index] == 0) {
+                ready.emplace(rnd(), index);
+            }
+        }
+        TreeT scattered;
+        while (!ready.empty()) {
+            size_t index = ready.top().second;
+            ready.pop();
+            scattered.AddNode(*tree.GetNode(tree.GetIdByIndex(index)));
+            for (size_t child_index : tree.GetChildrenIndices(index)) {
+                // A child is listed once even if both parents are the same node
+                for (size_t parent_index : tree.GetParentIndices(child_index)) {
+                    n_unplaced_parents[child_index] -= parent_index == index;
+                }
+                if (n_unplaced_parents[child_index] == 0) {
+                    ready.emplace(rnd(), child_index);
+                }
+            }
+        }
+        return scattered;
+    }
+
+    template<typename TreeT>
+    void BenchmarkLayout(ostream& output, const string& tree_name, const TreeT& tree, size_t n_queries = 2000,
+                         size_t query_generation = 12) {
+        // Ancestor queries of the same nodes before and after Tree::Compact. Deep nodes of synthetic trees
+        // descend from most of their tree, so queried nodes are taken from a middle generation
+        TreeT scattered = ScatterBirthOrder(tree);
+        TreeT compacted = scattered;
+        double compact_seconds = MeasureSeconds([&] {
+            compacted.Compact();
+        });
+        output << "layout, " << tree_name << ", " << tree.GetSize() << " nodes, Compact: " << compact_seconds << " s\n";
+        mt19937 rnd(5);
+        const auto& generation = tree.NodeIndicesInGeneration(min(query_generation, tree.GetGenerationCount() - 1));
+        vector<typename TreeT::IdView> queries;
+        for (size_t query_i = 0; query_i < n_queries; ++query_i) {
+            queries.push_back(tree.GetIdByIndex(generation[rnd() % generation.size()]));
+        }
+        for (const auto& [name, layout] : {pair<const char*, const TreeT*>{"generated", &tree},
+                                           {"scattered", &scattered}, {"compacted", &compacted}}) {
+            size_t n_ancestors = 0;
+            double set_seconds = MeasureSeconds([&] {
+                for (const auto& query : queries) {
+                    n_ancestors += layout->GetAncestorSet(query).Count();
+                }
+            });
+            double ids_seconds = MeasureSeconds([&] {
+                for (const auto& query : queries) {
+                    n_ancestors += layout->GetAncestors(query).size();
+                }
+            });
+            output << "  " << setw(9) << name << " order: GetAncestorSet " << set_seconds / n_queries * 1e6
+                   << " us, GetAncestors " << ids_seconds / n_queries * 1e6 << " us per query, "
+                   << n_ancestors / (2 * n_queries) << " ancestors on average\n";
+        }
+    }
+}
+
+
+void RunBenchmarks(ostream& output, size_t n_nodes) {
+    using TreeT = FamilyTree::Tree<string, 2>;
+    TreeT tree;
+    double generation_seconds = MeasureSeconds([&] {
+        tree = FamilyTree::GenerateSyntheticTree<string, 2>(n_nodes);
+    });
+    output << "synthetic tree of " << n_nodes << " nodes generated in " << generation_seconds << " s\n";
+    BenchmarkRender(output, tree);
+    BenchmarkLayout(output, "parents from whole generation", tree);
+    // Real pedigrees are local: people mostly marry within their region, which a good layout can exploit
+    BenchmarkLayout(output, "parents from 64 neighbours",
+                    FamilyTree::GenerateSyntheticTree<string, 2>(n_nodes, 30, 239, 64));
+}
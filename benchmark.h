@@ -0,0 +1,7 @@
+#pragma once
+
+#include <iostream>
+
+
+void RunBenchmarks(std::ostream& output = std::cout, size_t n_nodes = 1'000'000);
+// Measures tree algorithms on a synthetic pedigree of n_nodes nodes
@@ -0,0 +1,35 @@
+#include "contribution.h"
+
+using namespace std;
+
+
+namespace FamilyTree {
+    void ContributionEngine::AddScaled(Contribution &accumulator, const Contribution &addend, double scale,
+                                       Contribution &buffer) {
+        buffer.clear();
+        buffer.reserve(accumulator.size() + addend.size());
+        auto accumulator_it = accumulator.begin();
+        auto addend_it = addend.begin();
+        while (accumulator_it != accumulator.end() || addend_it != addend.end()) {
+            if (addend_it == addend.end() ||
+                (accumulator_it != accumulator.end() && accumulator_it->founder_index < addend_it->founder_index)) {
+                buffer.push_back(*accumulator_it++);
+            } else if (accumulator_it == accumulator.end() || addend_it->founder_index < accumulator_it->founder_index) {
+                buffer.push_back({addend_it->founder_index, addend_it->share * scale});
+                ++addend_it;
+            } else {
+                buffer.push_back({accumulator_it->founder_index, accumulator_it->share + addend_it->share * scale});
+                ++accumulator_it;
+                ++addend_it;
+            }
+        }
+        // Result is copied, not swapped: buffer keeps its capacity for the next merge
+        accumulator.assign(buffer.begin(), buffer.end());
+    }
+
+
+    void ContributionEngine::Clear() {
+        memo_.clear();
+        known_.clear();
+    }
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include "tree.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+
+namespace FamilyTree {
+    struct FounderShare {
+        size_t founder_index;
+        double share;
+    };
+
+    using Contribution = std::vector<FounderShare>;
+    // Sparse vector sorted by founder birth index, shares of a node sum up to 1
+
+
+    class ContributionEngine {
+        // Expected fraction of every founder's genome in nodes: a founder carries only itself, a child carries
+        // the average of its parents. Vectors are computed over ancestors in birth order, so every parent is ready
+        // before its children, and memoized for later queries. Appending nodes to the tree keeps memoized vectors
+        // valid, any other edit needs Clear
+    private:
+        std::vector<Contribution> memo_;
+        std::vector<char> known_;
+        // Not vector<bool>: CalculateAll marks nodes of one generation from several threads
+
+        template<typename NodeId, size_t NParents>
+        void Calculate(const Tree<NodeId, NParents> &tree, size_t index, Contribution &buffer);
+        // Parents of index must be known
+        static void AddScaled(Contribution &accumulator, const Contribution &addend, double scale,
+                              Contribution &buffer);
+        // Two-pointer merge of sorted vectors, buffer is reused between merges to avoid allocations
+
+    public:
+        template<typename NodeId, size_t NParents>
+        const Contribution &Get(const Tree<NodeId, NParents> &tree, size_t index);
+        // Calculates only ancestors of index which are not memoized yet
+
+        template<typename NodeId, size_t NParents>
+        void CalculateAll(const Tree<NodeId, NParents> &tree, size_t n_threads = 0);
+        // Memoizes every node generation by generation, nodes of a generation are spread between
+        // n_threads workers (0 - hardware concurrency). Memory is the total number of nonzero shares
+
+        void Clear();
+    };
+}
+
+
+// Implementations
+namespace FamilyTree {
+    template<typename NodeId, size_t NParents>
+    void ContributionEngine::Calculate(const Tree<NodeId, NParents> &tree, size_t index, Contribution &buffer) {
+        Contribution contribution;
+        const auto &parent_indices = tree.GetParentIndices(index);
+        if (parent_indices.front() == Tree<NodeId, NParents>::NO_INDEX) {
+            contribution.push_back({index, 1});
+        } else {
+            for (size_t parent_index : parent_indices) {
+                AddScaled(contribution, memo_[parent_index], 1.0 / NParents, buffer);
+            }
+        }
+        memo_[index] = std::move(contribution);
+        known_[index] = true;
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    const Contribution &ContributionEngine::Get(const Tree<NodeId, NParents> &tree, size_t index) {
+        PROFILE_OPERATION("ContributionEngine::Get");
+        memo_.resize(tree.GetSize());
+        known_.resize(tree.GetSize());
+        if (known_[index]) {
+            return memo_[index];
+        }
+        NodeSet unknown(tree.GetSize());
+        unknown.Insert(index);
+        std::vector<size_t> stack = {index};
+        while (!stack.empty()) {
+            size_t node_index = stack.back();
+            stack.pop_back();
+            for (size_t parent_index : tree.GetParentIndices(node_index)) {
+                if (parent_index != Tree<NodeId, NParents>::NO_INDEX && !known_[parent_index] &&
+                    !unknown.Contains(parent_index)) {
+                    unknown.Insert(parent_index);
+                    stack.push_back(parent_index);
+                }
+            }
+        }
+        Contribution buffer;
+        unknown.ForEach([&](size_t unknown_index) {
+            Calculate(tree, unknown_index, buffer);
+        });
+        return memo_[index];
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    void ContributionEngine::CalculateAll(const Tree<NodeId, NParents> &tree, size_t n_threads) {
+        PROFILE_OPERATION("ContributionEngine::CalculateAll");
+        memo_.resize(tree.GetSize());
+        known_.resize(tree.GetSize());
+        if (n_threads == 0) {
+            n_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        const size_t BLOCK_SIZE = 256;
+        for (size_t generation = 0; generation < tree.GetGenerationCount(); ++generation) {
+            const std::vector<size_t> &indices = tree.NodeIndicesInGeneration(generation);
+            std::atomic<size_t> next_block = 0;
+            auto work = [&]() {
+                Contribution buffer;
+                for (size_t block_begin; (block_begin = next_block.fetch_add(BLOCK_SIZE)) < indices.size(); ) {
+                    size_t block_end = std::min(block_begin + BLOCK_SIZE, indices.size());
+                    for (size_t index_i = block_begin; index_i < block_end; ++index_i) {
+                        if (!known_[indices[index_i]]) {
+                            Calculate(tree, indices[index_i], buffer);
+                        }
+                    }
+                }
+            };
+            // Small generations are not worth starting threads
+            size_t n_workers = std::min(n_threads, (indices.size() + BLOCK_SIZE - 1) / BLOCK_SIZE);
+            std::vector<std::thread> workers;
+            for (size_t worker_i = 1; worker_i < n_workers; ++worker_i) {
+                workers.emplace_back(work);
+            }
+            work();
+            for (std::thread &worker : workers) {
+                worker.join();
+            }
+        }
+    }
+}
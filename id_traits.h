@@ -0,0 +1,107 @@
+#pragma once
+
+#include <charconv>
+#include <functional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+
+namespace FamilyTree {
+    template<typename NodeId, typename Enable = void>
+    struct IdTraits {
+        // Customization point for node id types: how ids are hashed, looked up, formatted and parsed.
+        // Fallback goes through operator <<(ostream&, NodeId) and operator >>(istream&, NodeId&)
+        using Hash = std::hash<NodeId>;
+        using KeyEqual = std::equal_to<NodeId>;
+        using View = const NodeId &;
+        // Type accepted by lookups, transparent Hash and KeyEqual let it differ from NodeId
+
+        static void Format(std::string &output, View node_id) {
+            std::ostringstream output_stream;
+            output_stream << node_id;
+            output += output_stream.str();
+        }
+
+        static NodeId Parse(std::string_view token) {
+            std::istringstream input_stream{std::string(token)};
+            NodeId node_id;
+            if (!(input_stream >> node_id)) {
+                throw std::runtime_error("Can't parse node id " + std::string(token));
+            }
+            return node_id;
+        }
+    };
+
+
+    struct TransparentStringHash {
+        using is_transparent = void;
+
+        size_t operator()(std::string_view str) const {
+            return std::hash<std::string_view>()(str);
+        }
+    };
+
+    template<>
+    struct IdTraits<std::string> {
+        // string_view and const char * lookups don't construct strings
+        using Hash = TransparentStringHash;
+        using KeyEqual = std::equal_to<>;
+        using View = std::string_view;
+
+        static void Format(std::string &output, View node_id) {
+            output += node_id;
+        }
+
+        static std::string Parse(std::string_view token) {
+            return std::string(token);
+        }
+    };
+
+
+    template<>
+    struct IdTraits<char> {
+        using Hash = std::hash<char>;
+        using KeyEqual = std::equal_to<char>;
+        using View = char;
+
+        static void Format(std::string &output, View node_id) {
+            output += node_id;
+        }
+
+        static char Parse(std::string_view token) {
+            if (token.size() != 1) {
+                throw std::runtime_error("Can't parse node id " + std::string(token) + ", should be one character");
+            }
+            return token.front();
+        }
+    };
+
+
+    template<typename NodeId>
+    struct IdTraits<NodeId, std::enable_if_t<(std::is_integral_v<NodeId> && sizeof(NodeId) > 1 &&
+                                              !std::is_same_v<NodeId, bool>) ||
+                                             std::is_floating_point_v<NodeId>>> {
+        // Numbers are formatted and parsed with std::to_chars and std::from_chars
+        using Hash = std::hash<NodeId>;
+        using KeyEqual = std::equal_to<NodeId>;
+        using View = NodeId;
+
+        static void Format(std::string &output, View node_id) {
+            char buffer[64];
+            auto [end, error] = std::to_chars(buffer, buffer + sizeof(buffer), node_id);
+            output.append(buffer, end);
+        }
+
+        static NodeId Parse(std::string_view token) {
+            NodeId node_id{};
+            auto [end, error] = std::from_chars(token.data(), token.data() + token.size(), node_id);
+            if (error != std::errc() || end != token.data() + token.size()) {
+                throw std::runtime_error("Can't parse node id " + std::string(token));
+            }
+            return node_id;
+        }
+    };
+}
@@ -0,0 +1,312 @@
+#pragma once
+
+#include "tree.h"
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+
+namespace FamilyTree {
+    template<typename NodeId, size_t NParents>
+    class Journal {
+        // Append-only change log of a tree snapshot, kept in file snapshot_filename + ".journal".
+        // Records are lines "+ node_id [parent_ids...] [| name=value ...]" meaning AddNode with attribute values,
+        // "- node_id reject|cascade|orphan" meaning RemoveNode, "= node_id [parent_ids...]" meaning SetParents
+        // and "@ column name type ..." meaning a new attribute column, as in the snapshot.
+        // First record "# base size content_hash" names the snapshot version the records apply to:
+        // a journal left behind by an interrupted compaction doesn't match the new snapshot and is skipped
+    public:
+        using Tree = FamilyTree::Tree<NodeId, NParents>;
+        using Node = FamilyTree::Node<NodeId, NParents>;
+        using IdView = typename Tree::IdView;
+
+    private:
+        std::string snapshot_filename_;
+        std::ofstream output_;
+        std::string base_record_;
+        // Base record of the current snapshot, empty - unknown (journal is written without it)
+        bool stale_journal_ = false;
+        // Journal file belongs to a replaced snapshot, first append starts it anew
+
+        static std::string MakeBaseRecord(const Tree &tree);
+        static std::string_view FormatPolicy(RemovalPolicy policy);
+        static RemovalPolicy ParsePolicy(std::string_view name);
+        static void TrimTornRecord(const std::string &journal_filename);
+        // Cuts unterminated last record, otherwise next record would be glued to it
+        void OpenForAppend();
+        // Journal file is created lazily, opening a tree must not litter its directory
+        void Write(const std::string &records);
+        // One flush per edit, so that an edit hits the file as one block
+
+    public:
+        static std::string MakeJournalFilename(const std::string &snapshot_filename) {
+            return snapshot_filename + ".journal";
+        }
+
+        explicit Journal(const std::string &snapshot_filename) : snapshot_filename_(snapshot_filename) {}
+
+        const std::string &GetSnapshotFilename() const { return snapshot_filename_; }
+
+        Tree Open();
+        // Load that remembers the snapshot version for the base record of a journal started later
+
+        void AppendSuffix(const Tree &tree, size_t first_index, size_t first_column);
+        // Appends attribute columns of tree from first_column on, then nodes of tree starting from
+        // birth position first_index with their attribute values
+        void AppendRemoval(IdView node_id, RemovalPolicy policy);
+        void AppendParents(const Node &node);
+        // Records SetParents(node.id, parents of node)
+
+        void Compact(const Tree &tree);
+        // Writes tree as the new snapshot (through a temporary file) and empties the journal
+
+        static size_t Replay(std::istream &input, Tree &tree);
+        // Applies journal records to tree, returns number of applied node records.
+        // Journal with a base record of another version is skipped, as are records of nodes already present
+        // in the same version (journals without base record), an unterminated last record (torn write) is ignored.
+        static Tree Load(const std::string &snapshot_filename);
+        // Snapshot with its journal replayed on top
+    };
+}
+
+
+// Implementations
+namespace FamilyTree {
+    template<typename NodeId, size_t NParents>
+    void Journal<NodeId, NParents>::TrimTornRecord(const std::string &journal_filename) {
+        std::ifstream input(journal_filename, std::ios::binary | std::ios::ate);
+        if (!input || input.tellg() <= 0) {
+            return;
+        }
+        input.seekg(-1, std::ios::end);
+        if (input.get() == '\n') {
+            return;
+        }
+        input.seekg(0);
+        std::string content((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+        if (!content.empty() && content.back() != '\n') {
+            size_t last_line_end = content.rfind('\n');
+            input.close();
+            std::filesystem::resize_file(journal_filename,
+                                         last_line_end == std::string::npos ? 0 : last_line_end + 1);
+        }
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    std::string Journal<NodeId, NParents>::MakeBaseRecord(const Tree &tree) {
+        return "# base " + std::to_string(tree.GetSize()) + ' ' + std::to_string(tree.GetContentHash());
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    std::string_view Journal<NodeId, NParents>::FormatPolicy(RemovalPolicy policy) {
+        switch (policy) {
+            case RemovalPolicy::RejectParents:
+                return "reject";
+            case RemovalPolicy::Cascade:
+                return "cascade";
+            case RemovalPolicy::Orphan:
+                return "orphan";
+        }
+        throw std::logic_error("Unknown removal policy");
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    RemovalPolicy Journal<NodeId, NParents>::ParsePolicy(std::string_view name) {
+        for (RemovalPolicy policy : {RemovalPolicy::RejectParents, RemovalPolicy::Cascade, RemovalPolicy::Orphan}) {
+            if (FormatPolicy(policy) == name) {
+                return policy;
+            }
+        }
+        throw std::runtime_error("Unknown removal policy " + std::string(name));
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    void Journal<NodeId, NParents>::OpenForAppend() {
+        if (output_.is_open()) {
+            return;
+        }
+        std::string journal_filename = MakeJournalFilename(snapshot_filename_);
+        TrimTornRecord(journal_filename);
+        std::error_code error;
+        bool is_new = stale_journal_ || !std::filesystem::exists(journal_filename, error) ||
+                      std::filesystem::file_size(journal_filename, error) == 0;
+        output_.open(journal_filename, stale_journal_ ? std::ios::trunc : std::ios::app);
+        stale_journal_ = false;
+        if (!output_) {
+            throw std::runtime_error("Can't open journal " + journal_filename);
+        }
+        if (is_new && !base_record_.empty()) {
+            output_ << base_record_ << '\n';
+        }
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    void Journal<NodeId, NParents>::Write(const std::string &records) {
+        OpenForAppend();
+        output_ << records;
+        output_.flush();
+        if (!output_) {
+            throw std::runtime_error("Can't write journal " + MakeJournalFilename(snapshot_filename_));
+        }
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    Tree<NodeId, NParents> Journal<NodeId, NParents>::Open() {
+        Tree tree = Tree::ParseFrom(ReadEverythingFromFile(snapshot_filename_));
+        base_record_ = MakeBaseRecord(tree);
+        std::ifstream journal_input(MakeJournalFilename(snapshot_filename_));
+        std::string first_record;
+        std::getline(journal_input, first_record);
+        stale_journal_ = first_record.starts_with("# ") && first_record != base_record_;
+        journal_input.clear();
+        journal_input.seekg(0);
+        Replay(journal_input, tree);
+        return tree;
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    void Journal<NodeId, NParents>::AppendSuffix(const Tree &tree, size_t first_index, size_t first_column) {
+        const AttributeStore &attributes = tree.GetAttributes();
+        if (first_index == tree.GetSize() && first_column == attributes.GetColumnCount()) {
+            return;
+        }
+        std::stringstream records;
+        attributes.WriteSchema(records, first_column);
+        std::string row;
+        for (size_t index = first_index; index < tree.GetSize(); ++index) {
+            row.clear();
+            attributes.FormatRow(row, index);
+            records << "+ " << *tree.GetNode(tree.GetIdByIndex(index)) << row << '\n';
+        }
+        Write(records.str());
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    void Journal<NodeId, NParents>::AppendRemoval(IdView node_id, RemovalPolicy policy) {
+        std::string record = "- ";
+        IdTraits<NodeId>::Format(record, node_id);
+        record += ' ';
+        record += FormatPolicy(policy);
+        Write(record + '\n');
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    void Journal<NodeId, NParents>::AppendParents(const Node &node) {
+        std::stringstream record;
+        record << "= " << node << '\n';
+        Write(record.str());
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    void Journal<NodeId, NParents>::Compact(const Tree &tree) {
+        std::string temporary_filename = snapshot_filename_ + ".tmp";
+        {
+            std::ofstream snapshot(temporary_filename);
+            snapshot << tree;
+            if (!snapshot.flush()) {
+                throw std::runtime_error("Can't write snapshot " + temporary_filename);
+            }
+        }
+        if (std::rename(temporary_filename.c_str(), snapshot_filename_.c_str()) != 0) {
+            throw std::runtime_error("Can't replace snapshot " + snapshot_filename_);
+        }
+        base_record_ = MakeBaseRecord(tree);
+        stale_journal_ = false;
+        output_.close();
+        std::error_code error;
+        std::filesystem::remove(MakeJournalFilename(snapshot_filename_), error);
+        if (error) {
+            throw std::runtime_error("Can't empty journal " + MakeJournalFilename(snapshot_filename_));
+        }
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    size_t Journal<NodeId, NParents>::Replay(std::istream &input, Tree &tree) {
+        size_t n_applied = 0;
+        for (std::string line; std::getline(input, line);) {
+            if (input.eof()) {
+                break;
+            }
+            if (line.empty()) {
+                continue;
+            }
+            if (line.starts_with("# ")) {
+                if (line != MakeBaseRecord(tree)) {
+                    // Snapshot was replaced by a compaction interrupted before emptying its journal
+                    return n_applied;
+                }
+                continue;
+            }
+            if (line.starts_with(AttributeStore::SCHEMA_PREFIX)) {
+                std::string column_name = Split(line.substr(AttributeStore::SCHEMA_PREFIX.size())).at(0);
+                if (!tree.GetAttributes().HasColumn(column_name)) {
+                    tree.GetAttributes().ParseSchemaLine(line);
+                }
+                continue;
+            }
+            if (line.size() < 2 || line[1] != ' ') {
+                throw std::runtime_error("Bad journal record: " + line);
+            }
+            std::string_view record = std::string_view(line).substr(2);
+            if (line[0] == '-') {
+                auto tokens = Split(record);
+                if (tokens.size() != 2) {
+                    throw std::runtime_error("Bad journal record: " + line);
+                }
+                tree.RemoveNode(IdTraits<NodeId>::Parse(tokens[0]), ParsePolicy(tokens[1]));
+                ++n_applied;
+                continue;
+            }
+            if (line[0] == '=') {
+                Node node = Node::ParseFrom(std::string(record));
+                tree.SetParents(node.id, node.GetParents());
+                ++n_applied;
+                continue;
+            }
+            if (line[0] != '+') {
+                throw std::runtime_error("Bad journal record: " + line);
+            }
+            std::string_view assignments;
+            if (size_t separator_pos = record.find(AttributeStore::ROW_SEPARATOR); separator_pos != std::string::npos) {
+                assignments = record.substr(separator_pos + AttributeStore::ROW_SEPARATOR.size());
+                record = record.substr(0, separator_pos);
+            }
+            Node node = Node::ParseFrom(std::string(record));
+            if (const Node *existing_node = tree.GetNode(node.id)) {
+                if (*existing_node != node) {
+                    throw std::runtime_error("Journal record contradicts snapshot: " + line);
+                }
+                continue;
+            }
+            tree.AddNode(node);
+            try {
+                tree.GetAttributes().ParseRow(tree.GetSize() - 1, assignments);
+            } catch (...) {
+                // Bad record is not applied at all
+                tree.TruncateTo(tree.GetSize() - 1);
+                throw;
+            }
+            ++n_applied;
+        }
+        return n_applied;
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    Tree<NodeId, NParents> Journal<NodeId, NParents>::Load(const std::string &snapshot_filename) {
+        return Journal(snapshot_filename).Open();
+    }
+}
@@ -1,3 +1,4 @@
+#include "benchmark.h"
 #include "test_tree.h"
 #include "user_interface.h"
 
@@ -12,14 +13,69 @@
 using namespace std;
 
 
+namespace {
+    const char* const USAGE = R"(Usage:
+FamilyTree [start_filename] - interactive mode
+FamilyTree --batch script_filename|- [start_filename] - executes commands from script (- for stdin)
+FamilyTree --serve socket_path [start_filename] [n_workers] - serves commands over unix domain socket
+FamilyTree --bench [n_nodes] - runs benchmarks on synthetic tree of n_nodes nodes
+FamilyTree --test [n_threads] - runs all unit tests including large-input ones with time budgets
+)";
+
+    int RunBatchFromArguments(const vector<string>& arguments) {
+        if (arguments.empty() || arguments.size() > 2) {
+            cerr << USAGE;
+            return 2;
+        }
+        ios::sync_with_stdio(false);
+        string start_filename = arguments.size() == 2 ? arguments[1] : "";
+        if (arguments[0] == "-") {
+            return RunBatch(cin, start_filename);
+        }
+        ifstream script(arguments[0]);
+        if (!script) {
+            cerr << "Can't open script " << arguments[0] << endl;
+            return 1;
+        }
+        return RunBatch(script, start_filename);
+    }
+
+    int RunServerFromArguments(const vector<string>& arguments) {
+        if (arguments.empty() || arguments.size() > 3) {
+            cerr << USAGE;
+            return 2;
+        }
+        string start_filename = arguments.size() >= 2 ? arguments[1] : "";
+        size_t n_workers = arguments.size() == 3 ? stoul(arguments[2]) : 0;
+        return RunServer(arguments[0], start_filename, n_workers);
+    }
+}
+
+
 int main(int argc, char* argv[]) {
+    vector<string> arguments(argv + 1, argv + argc);
+    if (!arguments.empty() && arguments[0] == "--batch") {
+        return RunBatchFromArguments({arguments.begin() + 1, arguments.end()});
+    }
+    if (!arguments.empty() && arguments[0] == "--serve") {
+        return RunServerFromArguments({arguments.begin() + 1, arguments.end()});
+    }
+    if (!arguments.empty() && arguments[0] == "--bench") {
+        RunBenchmarks(cout, arguments.size() > 1 ? stoul(arguments[1]) : 1'000'000);
+        return 0;
+    }
+    if (!arguments.empty() && arguments[0] == "--test") {
+        TestAll(true, arguments.size() > 1 ? stoul(arguments[1]) : 0);
+        return 0;
+    }
     TestAll();
-    if (argc == 1) {
+    if (arguments.empty()) {
         RunInteraction();
-    } else if (argc == 2) {
-        RunInteraction(argv[1]);
+    } else if (arguments.size() == 1) {
+        RunInteraction(arguments[0]);
     } else {
         cout << "Too many command line arguments, should be 1 or 0!" << endl;
+        cout << USAGE;
     }
     return 0;
 }
@@ -0,0 +1,234 @@
+#include "query.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+
+using namespace std;
+
+
+namespace FamilyTree {
+    namespace {
+        const map<string, QueryOp> OPERATORS = {
+                {"all", QueryOp::All}, {"generation", QueryOp::Generation}, {"attribute", QueryOp::Attribute},
+                {"parents", QueryOp::Parents}, {"children", QueryOp::Children},
+                {"ancestors", QueryOp::Ancestors}, {"descendants", QueryOp::Descendants},
+                {"union", QueryOp::Union}, {"intersect", QueryOp::Intersect}, {"minus", QueryOp::Minus},
+        };
+
+        string_view OperatorName(QueryOp op) {
+            if (op == QueryOp::Node) {
+                return "node";
+            }
+            for (const auto &[name, name_op] : OPERATORS) {
+                if (name_op == op) {
+                    return name;
+                }
+            }
+            return "";
+        }
+
+        class QueryCompiler {
+            // Recursive descent over "word" | "word(arguments)", steps are hash-consed while being built
+        private:
+            string_view input_;
+            size_t pos_ = 0;
+            vector<QueryStep> steps_;
+            map<string, size_t> step_by_key_;
+
+            void SkipSpaces() {
+                while (pos_ < input_.size() && isspace(static_cast<unsigned char>(input_[pos_]))) {
+                    ++pos_;
+                }
+            }
+
+            bool Consume(char ch) {
+                SkipSpaces();
+                if (pos_ < input_.size() && input_[pos_] == ch) {
+                    ++pos_;
+                    return true;
+                }
+                return false;
+            }
+
+            void Expect(char ch) {
+                if (!Consume(ch)) {
+                    throw runtime_error("Query: expected '" + string(1, ch) + "' at position " + to_string(pos_));
+                }
+            }
+
+            string ReadWord() {
+                SkipSpaces();
+                size_t word_begin = pos_;
+                while (pos_ < input_.size() && !isspace(static_cast<unsigned char>(input_[pos_])) &&
+                       input_[pos_] != '(' && input_[pos_] != ')' && input_[pos_] != ',') {
+                    ++pos_;
+                }
+                if (word_begin == pos_) {
+                    throw runtime_error("Query: expected word at position " + to_string(pos_));
+                }
+                return string(input_.substr(word_begin, pos_ - word_begin));
+            }
+
+            size_t AddStep(QueryStep step) {
+                if (step.op == QueryOp::Union || step.op == QueryOp::Intersect) {
+                    // Order and repetitions of operands don't matter
+                    sort(step.inputs.begin(), step.inputs.end());
+                    step.inputs.erase(unique(step.inputs.begin(), step.inputs.end()), step.inputs.end());
+                    if (step.inputs.size() == 1) {
+                        return step.inputs.front();
+                    }
+                }
+                string key = string(OperatorName(step.op)) + '^' + to_string(step.repeat);
+                for (size_t input : step.inputs) {
+                    key += " #" + to_string(input);
+                }
+                for (const string &argument : step.arguments) {
+                    key += " " + argument;
+                }
+                auto [step_it, inserted] = step_by_key_.emplace(key, steps_.size());
+                if (inserted) {
+                    steps_.push_back(std::move(step));
+                }
+                return step_it->second;
+            }
+
+            size_t Fuse(QueryOp op, vector<size_t> inputs) {
+                // Operand steps of the same kind are absorbed: their own operands are used directly
+                vector<size_t> fused_inputs;
+                size_t repeat = 1;
+                if ((op == QueryOp::Parents || op == QueryOp::Children) && inputs.size() == 1 &&
+                    steps_[inputs[0]].op == op) {
+                    repeat += steps_[inputs[0]].repeat;
+                    fused_inputs = steps_[inputs[0]].inputs;
+                } else {
+                    for (size_t input : inputs) {
+                        QueryOp input_op = steps_[input].op;
+                        bool absorbed = input_op == op && (op == QueryOp::Union || op == QueryOp::Intersect ||
+                                                           op == QueryOp::Ancestors || op == QueryOp::Descendants);
+                        if (absorbed) {
+                            fused_inputs.insert(fused_inputs.end(), steps_[input].inputs.begin(),
+                                                steps_[input].inputs.end());
+                        } else {
+                            fused_inputs.push_back(input);
+                        }
+                    }
+                }
+                return AddStep({.op = op, .inputs = std::move(fused_inputs), .repeat = repeat});
+            }
+
+            size_t ParseExpression() {
+                string word = ReadWord();
+                auto op_it = OPERATORS.find(MakeLower(word));
+                SkipSpaces();
+                bool has_arguments = pos_ < input_.size() && input_[pos_] == '(';
+                if (op_it == OPERATORS.end() || (!has_arguments && op_it->second != QueryOp::All)) {
+                    // Node ids may coincide with operator names when used without parentheses
+                    if (has_arguments) {
+                        throw runtime_error("Query: unknown operator " + word);
+                    }
+                    return AddStep({.op = QueryOp::Node, .arguments = {word}});
+                }
+                QueryOp op = op_it->second;
+                if (op == QueryOp::All) {
+                    if (has_arguments) {
+                        Expect('(');
+                        Expect(')');
+                    }
+                    return AddStep({.op = op});
+                }
+                Expect('(');
+                vector<string> arguments;
+                vector<size_t> inputs;
+                do {
+                    if (op == QueryOp::Generation || op == QueryOp::Attribute) {
+                        arguments.push_back(ReadWord());
+                    } else {
+                        inputs.push_back(ParseExpression());
+                    }
+                } while (Consume(','));
+                Expect(')');
+                if (op == QueryOp::Generation) {
+                    if (arguments.size() > 2) {
+                        throw runtime_error("Query: generation(n) or generation(min, max) takes at most two arguments");
+                    }
+                    for (const string &argument : arguments) {
+                        if (argument.find_first_not_of("0123456789") != string::npos) {
+                            throw runtime_error("Query: generation bounds should be numbers, got " + argument);
+                        }
+                    }
+                    return AddStep({.op = op, .arguments = std::move(arguments)});
+                }
+                if (op == QueryOp::Attribute) {
+                    if (arguments.size() < 2 || arguments.size() > 3) {
+                        throw runtime_error("Query: attribute(name, value[, high_value]) takes two or three arguments");
+                    }
+                    return AddStep({.op = op, .arguments = std::move(arguments)});
+                }
+                if (op == QueryOp::Minus && inputs.size() < 2) {
+                    throw runtime_error("Query: minus takes at least two arguments");
+                }
+                return Fuse(op, std::move(inputs));
+            }
+
+        public:
+            explicit QueryCompiler(string_view input) : input_(input) {}
+
+            vector<QueryStep> Compile() {
+                size_t result = ParseExpression();
+                SkipSpaces();
+                if (pos_ != input_.size()) {
+                    throw runtime_error("Query: unexpected text at position " + to_string(pos_));
+                }
+                // Steps absorbed by fusion stay in the list, only those reachable from the result are kept
+                vector<bool> needed(steps_.size());
+                needed[result] = true;
+                for (size_t step_i = result + 1; step_i-- > 0; ) {
+                    if (needed[step_i]) {
+                        for (size_t input : steps_[step_i].inputs) {
+                            needed[input] = true;
+                        }
+                    }
+                }
+                vector<size_t> new_index(steps_.size());
+                vector<QueryStep> plan;
+                for (size_t step_i = 0; step_i <= result; ++step_i) {
+                    if (needed[step_i]) {
+                        new_index[step_i] = plan.size();
+                        plan.push_back(std::move(steps_[step_i]));
+                        for (size_t &input : plan.back().inputs) {
+                            input = new_index[input];
+                        }
+                    }
+                }
+                return plan;
+            }
+        };
+    }
+
+
+    Query Query::Compile(string_view expression) {
+        Query query;
+        query.steps_ = QueryCompiler(expression).Compile();
+        return query;
+    }
+
+
+    void Query::Explain(ostream &output) const {
+        for (size_t step_i = 0; step_i < steps_.size(); ++step_i) {
+            const QueryStep &step = steps_[step_i];
+            output << '#' << step_i << ' ' << OperatorName(step.op);
+            if (step.repeat > 1) {
+                output << '^' << step.repeat;
+            }
+            for (size_t input : step.inputs) {
+                output << " #" << input;
+            }
+            for (const string &argument : step.arguments) {
+                output << ' ' << argument;
+            }
+            output << '\n';
+        }
+    }
+}
@@ -0,0 +1,211 @@
+#pragma once
+
+#include "attributes.h"
+#include "tree.h"
+
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+namespace FamilyTree {
+    enum class QueryOp {
+        Node,  // arguments: node id
+        All,
+        Generation,  // arguments: generation or min max, generations as in Tree::GetGeneration
+        Attribute,  // arguments: name value [high_value], as in AttributeStore filters
+        Parents,  // repeat times
+        Children,  // repeat times
+        Ancestors,  // inputs with all their ancestors
+        Descendants,  // inputs with all their descendants
+        Union,
+        Intersect,
+        Minus,  // first input without all other inputs
+    };
+
+    struct QueryStep {
+        QueryOp op = QueryOp::All;
+        std::vector<size_t> inputs = {};
+        // Indices of earlier steps
+        std::vector<std::string> arguments = {};
+        size_t repeat = 1;
+    };
+
+    class Query {
+        // Set algebra over nodes of a tree, for example
+        //   minus(intersect(ancestors(A), ancestors(B), generation(5)), ancestors(C))
+        // Operators: ancestors, descendants, parents, children (one or more inputs, their union is taken),
+        // union, intersect, minus (first argument without the rest), generation(n) or generation(min, max),
+        // attribute(name, value[, high_value]), all; any other word is a node id.
+        // Compiled plan is a list of steps evaluated over bitsets once each: equal subexpressions are shared,
+        // nested parents / children are fused into one repeated step, nested ancestors / descendants,
+        // unions and intersections are flattened, steps not needed for the result are dropped.
+    private:
+        std::vector<QueryStep> steps_;
+        // Topological order, the last step is the result
+
+        template<typename NodeId, size_t NParents>
+        static NodeSet EvaluateStep(const QueryStep &step, const std::vector<NodeSet> &results,
+                                    const Tree<NodeId, NParents> &tree);
+
+    public:
+        static Query Compile(std::string_view expression);
+
+        const std::vector<QueryStep> &GetSteps() const { return steps_; }
+        void Explain(std::ostream &output) const;
+        // One line per step: "#2 intersect #0 #1"
+
+        template<typename NodeId, size_t NParents>
+        NodeSet Evaluate(const Tree<NodeId, NParents> &tree) const;
+    };
+}
+
+
+// Implementations
+namespace FamilyTree {
+    template<typename NodeId, size_t NParents>
+    NodeSet Query::EvaluateStep(const QueryStep &step, const std::vector<NodeSet> &results,
+                                const Tree<NodeId, NParents> &tree) {
+        const size_t NO_INDEX = Tree<NodeId, NParents>::NO_INDEX;
+        NodeSet result(tree.GetSize());
+        auto union_of_inputs = [&]() {
+            NodeSet inputs = results[step.inputs.front()];
+            for (size_t input_i = 1; input_i < step.inputs.size(); ++input_i) {
+                inputs |= results[step.inputs[input_i]];
+            }
+            return inputs;
+        };
+        switch (step.op) {
+            case QueryOp::Node: {
+                size_t index = tree.GetIndex(IdTraits<NodeId>::Parse(step.arguments[0]));
+                if (index == NO_INDEX) {
+                    throw std::runtime_error("Unknown node id " + step.arguments[0]);
+                }
+                result.Insert(index);
+                break;
+            }
+            case QueryOp::All:
+                result = NodeSet(tree.GetSize(), true);
+                break;
+            case QueryOp::Generation: {
+                size_t min_generation = std::stoul(step.arguments[0]);
+                size_t max_generation = step.arguments.size() > 1 ? std::stoul(step.arguments[1]) : min_generation;
+                for (size_t generation = min_generation;
+                     generation <= max_generation && generation < tree.GetGenerationCount(); ++generation) {
+                    for (size_t index : tree.NodeIndicesInGeneration(generation)) {
+                        result.Insert(index);
+                    }
+                }
+                break;
+            }
+            case QueryOp::Attribute: {
+                const auto &attributes = tree.GetAttributes();
+                result = step.arguments.size() == 2
+                         ? attributes.FilterEqual(step.arguments[0], step.arguments[1])
+                         : attributes.FilterRange(step.arguments[0], step.arguments[1], step.arguments[2]);
+                break;
+            }
+            case QueryOp::Parents:
+            case QueryOp::Children: {
+                NodeSet frontier = union_of_inputs();
+                for (size_t step_i = 0; step_i < step.repeat; ++step_i) {
+                    result = NodeSet(tree.GetSize());
+                    frontier.ForEach([&](size_t index) {
+                        if (step.op == QueryOp::Parents) {
+                            for (size_t parent_index : tree.GetParentIndices(index)) {
+                                if (parent_index != NO_INDEX) {
+                                    result.Insert(parent_index);
+                                }
+                            }
+                        } else {
+                            for (size_t child_index : tree.GetChildrenIndices(index)) {
+                                result.Insert(child_index);
+                            }
+                        }
+                    });
+                    std::swap(frontier, result);
+                }
+                std::swap(frontier, result);
+                break;
+            }
+            case QueryOp::Ancestors: {
+                // Parents precede children: one pass against birth order visits every ancestor after its children
+                result = union_of_inputs();
+                auto &words = result.GetWords();
+                for (size_t word_i = words.size(); word_i-- > 0; ) {
+                    // Bits of a word are only added by its higher bits, so an empty word stays empty
+                    if (!words[word_i]) {
+                        continue;
+                    }
+                    for (size_t bit = NodeSet::WORD_BITS; bit-- > 0; ) {
+                        if (words[word_i] >> bit & 1) {
+                            for (size_t parent_index : tree.GetParentIndices(word_i * NodeSet::WORD_BITS + bit)) {
+                                if (parent_index != NO_INDEX) {
+                                    result.Insert(parent_index);
+                                }
+                            }
+                        }
+                    }
+                }
+                break;
+            }
+            case QueryOp::Descendants: {
+                result = union_of_inputs();
+                auto &words = result.GetWords();
+                for (size_t word_i = 0; word_i < words.size(); ++word_i) {
+                    if (!words[word_i]) {
+                        continue;
+                    }
+                    for (size_t bit = 0; bit < NodeSet::WORD_BITS; ++bit) {
+                        if (words[word_i] >> bit & 1) {
+                            for (size_t child_index : tree.GetChildrenIndices(word_i * NodeSet::WORD_BITS + bit)) {
+                                result.Insert(child_index);
+                            }
+                        }
+                    }
+                }
+                break;
+            }
+            case QueryOp::Union:
+                result = union_of_inputs();
+                break;
+            case QueryOp::Intersect:
+                result = results[step.inputs.front()];
+                for (size_t input_i = 1; input_i < step.inputs.size(); ++input_i) {
+                    result &= results[step.inputs[input_i]];
+                }
+                break;
+            case QueryOp::Minus:
+                result = results[step.inputs.front()];
+                for (size_t input_i = 1; input_i < step.inputs.size(); ++input_i) {
+                    result -= results[step.inputs[input_i]];
+                }
+                break;
+        }
+        return result;
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    NodeSet Query::Evaluate(const Tree<NodeId, NParents> &tree) const {
+        PROFILE_OPERATION("Query::Evaluate");
+        // Intermediate sets are released after their last use
+        std::vector<size_t> last_use(steps_.size());
+        for (size_t step_i = 0; step_i < steps_.size(); ++step_i) {
+            for (size_t input : steps_[step_i].inputs) {
+                last_use[input] = step_i;
+            }
+        }
+        std::vector<NodeSet> results(steps_.size());
+        for (size_t step_i = 0; step_i < steps_.size(); ++step_i) {
+            results[step_i] = EvaluateStep(steps_[step_i], results, tree);
+            for (size_t input : steps_[step_i].inputs) {
+                if (last_use[input] == step_i) {
+                    results[input] = NodeSet();
+                }
+            }
+        }
+        return std::move(results.back());
+    }
+}
@@ -0,0 +1,253 @@
+#include "server.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+
+namespace {
+    string FormatResponse(LineServer::Response response) {
+        if (response.ok) {
+            return "OK " + to_string(response.payload.size()) + "\n" + response.payload;
+        }
+        replace(response.payload.begin(), response.payload.end(), '\n', ' ');
+        return "ERROR " + response.payload + "\n";
+    }
+}
+
+
+LineServer::LineServer(string socket_path, size_t n_workers, RequestHandler handler)
+        : socket_path_(std::move(socket_path)), n_workers_(max<size_t>(n_workers, 1)),
+          handler_(std::move(handler)) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socket_path_.size() >= sizeof(address.sun_path)) {
+        throw invalid_argument("Socket path is too long: " + socket_path_);
+    }
+    strcpy(address.sun_path, socket_path_.c_str());
+    if (pipe2(wake_fds_, O_NONBLOCK | O_CLOEXEC) < 0) {
+        throw runtime_error(string("Can't create pipe: ") + strerror(errno));
+    }
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd_ < 0) {
+        string error = strerror(errno);
+        close(wake_fds_[0]);
+        close(wake_fds_[1]);
+        throw runtime_error("Can't create socket: " + error);
+    }
+    unlink(socket_path_.c_str());
+    if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0
+        || listen(listen_fd_, SOMAXCONN) < 0) {
+        string error = strerror(errno);
+        close(listen_fd_);
+        close(wake_fds_[0]);
+        close(wake_fds_[1]);
+        throw runtime_error("Can't listen on " + socket_path_ + ": " + error);
+    }
+}
+
+
+LineServer::~LineServer() {
+    Stop();
+    close(listen_fd_);
+    close(wake_fds_[0]);
+    close(wake_fds_[1]);
+    unlink(socket_path_.c_str());
+}
+
+
+void LineServer::Wake() {
+    // Full pipe already wakes poll up
+    [[maybe_unused]] ssize_t written = write(wake_fds_[1], "", 1);
+}
+
+
+void LineServer::Stop() {
+    // Only async-signal-safe calls here
+    if (!stopped_.exchange(true)) {
+        Wake();
+    }
+}
+
+
+void LineServer::Run() {
+    vector<thread> workers;
+    for (size_t worker_i = 0; worker_i < n_workers_; ++worker_i) {
+        workers.emplace_back(&LineServer::ServeWorker, this);
+    }
+    unordered_map<int, Connection> connections;
+    vector<pollfd> poll_fds;
+    vector<Reply> replies;
+    while (!stopped_) {
+        poll_fds.clear();
+        poll_fds.push_back({.fd = wake_fds_[0], .events = POLLIN, .revents = 0});
+        poll_fds.push_back({.fd = listen_fd_, .events = POLLIN, .revents = 0});
+        for (const auto& [client_fd, connection] : connections) {
+            short events = 0;
+            if (!connection.end_of_input && !connection.closing && connection.input.size() <= MAX_REQUEST_SIZE
+                && connection.input.find('\n') == string::npos) {
+                // Next request is read only when the buffered one is taken, so input stays bounded
+                events |= POLLIN;
+            }
+            if (!connection.output.empty()) {
+                events |= POLLOUT;
+            }
+            if (events != 0) {
+                // Half-closed socket reports POLLHUP whatever events are, polling it while a worker handles
+                // its request would spin
+                poll_fds.push_back({.fd = client_fd, .events = events, .revents = 0});
+            }
+        }
+        if (poll(poll_fds.data(), poll_fds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (poll_fds[0].revents) {
+            char drained[64];
+            while (read(wake_fds_[0], drained, sizeof(drained)) > 0) {
+            }
+        }
+        {
+            lock_guard guard(mutex_);
+            swap(replies, replies_);
+        }
+        for (Reply& reply : replies) {
+            Connection& connection = connections.at(reply.client_fd);
+            connection.busy = false;
+            connection.output += reply.message;
+            connection.closing |= reply.close_connection;
+        }
+        replies.clear();
+        for (size_t poll_i = 2; poll_i < poll_fds.size(); ++poll_i) {
+            const pollfd& poll_fd = poll_fds[poll_i];
+            Connection& connection = connections.at(poll_fd.fd);
+            if (poll_fd.revents & POLLOUT) {
+                WriteResponses(poll_fd.fd, connection);
+            }
+            if ((poll_fd.revents & (POLLIN | POLLHUP | POLLERR)) && !connection.end_of_input) {
+                ReadRequests(poll_fd.fd, connection);
+            }
+        }
+        if (poll_fds[1].revents & POLLIN) {
+            for (int client_fd; (client_fd = accept4(listen_fd_, nullptr, nullptr,
+                                                     SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0;) {
+                connections.emplace(client_fd, Connection());
+            }
+        }
+        for (auto it = connections.begin(); it != connections.end();) {
+            auto& [client_fd, connection] = *it;
+            if (!connection.busy && !connection.closing) {
+                if (size_t line_end = connection.input.find('\n'); line_end != string::npos) {
+                    Job job{.client_fd = client_fd, .request = connection.input.substr(0, line_end)};
+                    connection.input.erase(0, line_end + 1);
+                    connection.busy = true;
+                    lock_guard guard(mutex_);
+                    jobs_.push(std::move(job));
+                    has_jobs_.notify_one();
+                } else if (connection.input.size() > MAX_REQUEST_SIZE) {
+                    connection.output += FormatResponse({.ok = false, .payload = "Request is longer than " +
+                                                                                  to_string(MAX_REQUEST_SIZE)});
+                    connection.input.clear();
+                    connection.closing = true;
+                }
+            }
+            bool served = connection.closing ||
+                          (connection.end_of_input && connection.input.find('\n') == string::npos);
+            if (!connection.busy && connection.output.empty() && served) {
+                close(client_fd);
+                it = connections.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    {
+        lock_guard guard(mutex_);
+        stopped_ = true;
+        has_jobs_.notify_all();
+    }
+    for (thread& worker : workers) {
+        worker.join();
+    }
+    for (const auto& [client_fd, connection] : connections) {
+        close(client_fd);
+    }
+    jobs_ = {};
+    replies_.clear();
+}
+
+
+void LineServer::ServeWorker() {
+    while (true) {
+        Job job;
+        {
+            unique_lock lock(mutex_);
+            has_jobs_.wait(lock, [this] { return stopped_ || !jobs_.empty(); });
+            if (stopped_) {
+                return;
+            }
+            job = std::move(jobs_.front());
+            jobs_.pop();
+        }
+        Reply reply = Handle(std::move(job));
+        {
+            lock_guard guard(mutex_);
+            replies_.push_back(std::move(reply));
+        }
+        Wake();
+    }
+}
+
+
+LineServer::Reply LineServer::Handle(Job job) {
+    if (!job.request.empty() && job.request.back() == '\r') {
+        job.request.pop_back();
+    }
+    Response response;
+    try {
+        response = handler_(job.request);
+    } catch (const exception& e) {
+        response = Response{.ok = false, .payload = e.what()};
+    }
+    bool close_connection = response.close_connection;
+    return Reply{.client_fd = job.client_fd, .message = FormatResponse(std::move(response)),
+                 .close_connection = close_connection};
+}
+
+
+void LineServer::ReadRequests(int client_fd, Connection& connection) {
+    // One chunk per poll round keeps connections fair
+    char chunk[4096];
+    ssize_t n_read = recv(client_fd, chunk, sizeof(chunk), 0);
+    if (n_read > 0) {
+        connection.input.append(chunk, n_read);
+    } else if (n_read == 0 || (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        connection.end_of_input = true;
+    }
+}
+
+
+void LineServer::WriteResponses(int client_fd, Connection& connection) {
+    ssize_t sent = send(client_fd, connection.output.data(), connection.output.size(), MSG_NOSIGNAL);
+    if (sent > 0) {
+        connection.output.erase(0, sent);
+    } else if (sent < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+        // Client is gone, nothing more can be delivered
+        connection.output.clear();
+        connection.end_of_input = true;
+        connection.closing = true;
+    }
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+// Unix domain socket server with a line protocol:
+// every request is one line, every response is a status line
+// "OK <payload_size>\n<payload>" or "ERROR <message>\n".
+// One thread polls all connections, complete request lines go to a fixed pool of worker threads,
+// so an idle connection costs a buffer, not a thread. Requests of one connection are answered in order.
+class LineServer {
+public:
+    struct Response {
+        bool ok = true;
+        std::string payload;  // output for OK, message for ERROR
+        bool close_connection = false;
+    };
+    using RequestHandler = std::function<Response(const std::string& request)>;
+
+    static constexpr size_t MAX_REQUEST_SIZE = 1 << 20;
+    // Longer request line is answered with ERROR and its connection is closed
+
+    LineServer(std::string socket_path, size_t n_workers, RequestHandler handler);
+    LineServer(const LineServer&) = delete;
+    LineServer& operator =(const LineServer&) = delete;
+    ~LineServer();
+
+    void Run();
+    // Serves connections until Stop() is called
+    void Stop();
+    // Can be called from any thread and from signal handlers
+
+private:
+    struct Connection {
+        std::string input;
+        std::string output;
+        // Responses not yet accepted by the socket
+        bool busy = false;
+        // Request is being handled by a worker
+        bool end_of_input = false;
+        // Client closed its side or request was too long: no more reading, buffered requests are still served
+        bool closing = false;
+        // Close after output is sent: client asked or socket failed
+    };
+    struct Job {
+        int client_fd;
+        std::string request;
+    };
+    struct Reply {
+        int client_fd;
+        std::string message;
+        bool close_connection;
+    };
+
+    std::string socket_path_;
+    size_t n_workers_;
+    RequestHandler handler_;
+    int listen_fd_ = -1;
+    int wake_fds_[2] = {-1, -1};
+    // Self-pipe waking up poll for Stop() and finished requests
+    std::atomic<bool> stopped_ = false;
+
+    std::mutex mutex_;
+    std::condition_variable has_jobs_;
+    std::queue<Job> jobs_;
+    std::vector<Reply> replies_;
+
+    void Wake();
+    void ServeWorker();
+    Reply Handle(Job job);
+    static void ReadRequests(int client_fd, Connection& connection);
+    static void WriteResponses(int client_fd, Connection& connection);
+};
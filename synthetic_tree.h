@@ -0,0 +1,55 @@
+#pragma once
+
+#include "tree.h"
+
+#include <random>
+#include <string>
+#include <type_traits>
+
+
+namespace FamilyTree {
+    template<typename NodeId>
+    NodeId MakeSyntheticId(size_t index) {
+        if constexpr (std::is_arithmetic_v<NodeId>) {
+            return static_cast<NodeId>(index);
+        } else {
+            return NodeId("P" + std::to_string(index));
+        }
+    }
+
+    template<typename NodeId, size_t NParents>
+    Tree<NodeId, NParents> GenerateSyntheticTree(size_t n_nodes, size_t n_generations = 30, uint32_t seed = 239,
+                                                 size_t mating_window = 0) {
+        // Pedigree-shaped tree: nodes are split into n_generations generations of equal size,
+        // parents of every node are distinct random nodes of the previous generation.
+        // mating_window > 0 - parents are taken among mating_window nodes around the same position
+        // of the previous generation, like families of one region (0 - anywhere in the generation)
+        size_t generation_size = std::max((n_nodes + n_generations - 1) / n_generations, NParents);
+        std::mt19937 rnd(seed);
+        Tree<NodeId, NParents> tree;
+        for (size_t index = 0; index < n_nodes; ++index) {
+            NodeId node_id = MakeSyntheticId<NodeId>(index);
+            if (index < generation_size) {
+                tree.AddNode(Node<NodeId, NParents>(node_id));
+                continue;
+            }
+            size_t previous_generation_begin = (index / generation_size - 1) * generation_size;
+            size_t window = mating_window ? std::clamp(mating_window, NParents, generation_size) : generation_size;
+            size_t window_begin = previous_generation_begin +
+                                  std::min(index % generation_size - std::min(index % generation_size, window / 2),
+                                           generation_size - window);
+            std::uniform_int_distribution<size_t> pick_parent(window_begin, window_begin + window - 1);
+            std::array<NodeId, NParents> parent_ids;
+            std::array<size_t, NParents> parent_indices;
+            for (size_t parent_i = 0; parent_i < NParents; ++parent_i) {
+                do {
+                    parent_indices[parent_i] = pick_parent(rnd);
+                } while (std::find(parent_indices.begin(), parent_indices.begin() + parent_i,
+                                   parent_indices[parent_i]) != parent_indices.begin() + parent_i);
+                parent_ids[parent_i] = MakeSyntheticId<NodeId>(parent_indices[parent_i]);
+            }
+            tree.AddNode(Node<NodeId, NParents>(node_id, parent_ids));
+        }
+        return tree;
+    }
+}
@@ -1,12 +1,73 @@
 #include "test_tree.h"
 #include "Libs/test_runner.h"
 #include "tree.h"
+#include "journal.h"
+#include "tree_diff.h"
+#include "query.h"
+#include "contribution.h"
+#include "synthetic_tree.h"
+#include "server.h"
+#include "user_interface.h"
+#include "Libs/gzip/gzip_stream.h"
+
+#include <cstring>
+#include <thread>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <zlib.h>
 
 using namespace std;
 using namespace FamilyTree;
 
 
 namespace {
+    struct PersonId {
+        // Neither std::hash nor stream operators: hashing, formatting and parsing only come from IdTraits
+        uint32_t number;
+
+        bool operator ==(const PersonId& other) const = default;
+    };
+}
+
+
+template<>
+struct FamilyTree::IdTraits<PersonId> {
+    struct Hash {
+        size_t operator()(const PersonId& node_id) const {
+            return std::hash<uint32_t>()(node_id.number);
+        }
+    };
+    using KeyEqual = std::equal_to<PersonId>;
+    using View = const PersonId&;
+
+    static void Format(string& output, View node_id) {
+        output += 'P' + to_string(node_id.number);
+    }
+
+    static PersonId Parse(string_view token) {
+        if (token.size() < 2 || token.front() != 'P') {
+            throw runtime_error("Can't parse node id " + string(token));
+        }
+        return {IdTraits<uint32_t>::Parse(token.substr(1))};
+    }
+};
+
+
+namespace {
+    string EraseRgbColors(const string& svg) {
+        // Colors of rendered trees are random. Copies pieces between colors: erasing them in place is quadratic
+        string erased;
+        size_t copied_pos = 0;
+        for (size_t color_pos; (color_pos = svg.find("rgb(", copied_pos)) != string::npos; ) {
+            erased.append(svg, copied_pos, color_pos - copied_pos);
+            copied_pos = svg.find(')', color_pos) + 1;
+        }
+        erased.append(svg, copied_pos);
+        return erased;
+    }
+
     void TestFamilyTreeNode() {
         {
             using NodeT = Node<int, 2>;
@@ -30,6 +91,8 @@ namespace {
             ASSERT_EQUAL(node5.GetParents(), (vector<int>{1, 2}));
             ASSERT_EQUAL(node5, NodeT::ParseFrom("5 2 1"));
             ASSERT(node5 != NodeT::ParseFrom("2 1 5"));
+            ASSERT_EQUAL(node5.Hash(), NodeT::ParseFrom("5 2 1").Hash());
+            ASSERT(node5 != NodeT::ParseFrom("5 1 1"));
             stringstream ss;
             ss << node1 << endl << node5;
             ASSERT_EQUAL(ss.str(), "1\n5 1 2");
@@ -86,8 +149,18 @@ D
 G B A C D E
 F A B E D C)");
             ASSERT_EQUAL(tree1, tree2);
+            ASSERT_EQUAL(tree1.GetContentHash(), tree2.GetContentHash());
             auto tree3 = TreeT::ParseFrom("A");
             ASSERT(tree1 != tree3);
+            auto tree4 = TreeT::ParseFrom(R"(A
+B
+C
+D
+E
+F A B C D E
+G A B C D A)");
+            ASSERT(tree1.GetContentHash() != tree4.GetContentHash());
+            ASSERT(tree1 != tree4);
         }
         {
             Tree<string, 2> simple_tree;
@@ -130,6 +203,40 @@ biba)");
             auto tree2 = TreeT::ParseFrom("100");
             ASSERT_EQUAL(tree2.GetNodes(), vector<NodeT>{NodeT(100)});
         }
+        {
+            // Lookups by string_view and const char * without constructing strings
+            auto tree3 = Tree<string, 2>::ParseFrom("a\nbb\nc a bb");
+            string_view key = "xbbx";
+            ASSERT_EQUAL(tree3.GetIndex(key.substr(1, 2)), 1u);
+            ASSERT_EQUAL(tree3.GetNode("c")->GetParents(), (vector<string>{"a", "bb"}));
+            ASSERT_EQUAL(tree3.GetGeneration(string_view("c")), 1u);
+            ASSERT(!tree3.GetNode(key));
+            ASSERT_EQUAL(tree3.LowestCommonAncestors("c", "bb"), unordered_set<string>{"bb"});
+            ASSERT_THROWS(tree3.GetAncestors("zz"), runtime_error);
+        }
+        {
+            ASSERT_EQUAL((Node<int, 2>::ParseFrom(" -5\t10  20 ")), (Node<int, 2>(-5, vector<int>{10, 20})));
+            ASSERT_THROWS((Node<int, 2>::ParseFrom("1 2x 3")), runtime_error);
+            ASSERT_THROWS((Node<char, 2>::ParseFrom("ab")), runtime_error);
+            ASSERT_EQUAL((Node<double, 1>::ParseFrom("0.5 1e3").GetParents()), vector<double>{1000.0});
+            stringstream output;
+            output << TreeT::ParseFrom("18446744073709551615\n7\n3 18446744073709551615 7");
+            ASSERT_EQUAL(output.str(), "18446744073709551615\n7\n3 18446744073709551615 7\n");
+            ASSERT_EQUAL(IdTraits<size_t>::Parse("18446744073709551615"), numeric_limits<size_t>::max());
+        }
+        {
+            using PersonTree = Tree<PersonId, 2>;
+            auto lhs = PersonTree::ParseFrom("P1\nP2\nP3 P1 P2");
+            auto rhs = PersonTree::ParseFrom("P1\nP5\nP3 P1 P5\nP4 P3 P1");
+            auto merged = PersonTree::Merge(lhs, rhs, MergePolicy::PreferRight);
+            ASSERT_EQUAL(merged.conflicts.size(), 1u);
+            stringstream output;
+            output << merged.tree;
+            ASSERT_EQUAL(output.str(), "P1\nP2\nP5\nP3 P1 P5\nP4 P3 P1\n");
+            ASSERT_THROWS(Apply(lhs, Diff(lhs, rhs)), runtime_error);
+            Apply(lhs, Diff(lhs, PersonTree::ParseFrom("P1\nP2\nP3 P1 P2\nP6 P3 P2")));
+            ASSERT_EQUAL(lhs.GetIndex(PersonId{6}), 3u);
+        }
     }
 
     void TestFamilyTreeAncestorFunctional() {
@@ -176,6 +283,1070 @@ M A K L)");
         ASSERT_EQUAL(tree.LowestCommonAncestors('E', 'D'), expected_e_d_ancestors);
     }
 
+    void TestFamilyTreeGenerations() {
+        using TreeT = Tree<char, 2>;
+        auto tree = TreeT::ParseFrom(R"(A
+B
+C A B
+D
+E C D
+F A B
+G E F)");
+        ASSERT_EQUAL(tree.GetGenerationCount(), 4u);
+        ASSERT_EQUAL(tree.NodesInGeneration(0), (vector<char>{'A', 'B', 'D'}));
+        ASSERT_EQUAL(tree.NodesInGeneration(1), (vector<char>{'C', 'F'}));
+        ASSERT_EQUAL(tree.NodesInGeneration(2), (vector<char>{'E'}));
+        ASSERT_EQUAL(tree.NodesInGeneration(3), (vector<char>{'G'}));
+        ASSERT(tree.NodesInGeneration(4).empty());
+        ASSERT_EQUAL(tree.GetGeneration('A'), 0u);
+        ASSERT_EQUAL(tree.GetGeneration('G'), 3u);
+        ASSERT_EQUAL(tree.GetHeight('A'), 3u);
+        ASSERT_EQUAL(tree.GetHeight('D'), 2u);
+        ASSERT_EQUAL(tree.GetHeight('F'), 1u);
+        ASSERT_EQUAL(tree.GetHeight('G'), 0u);
+        ASSERT_EQUAL(tree.GetIndex('E'), 4u);
+        ASSERT_EQUAL(tree.GetIdByIndex(4), 'E');
+        ASSERT_EQUAL(tree.GetIndex('Z'), TreeT::NO_INDEX);
+        ASSERT_THROWS(tree.GetGeneration('Z'), runtime_error);
+        tree.AddNode(Node<char, 2>::ParseFrom("H G D"));
+        ASSERT_EQUAL(tree.GetGeneration('H'), 4u);
+        ASSERT_EQUAL(tree.GetHeight('A'), 4u);
+        ASSERT_EQUAL(tree.GetHeight('D'), 3u);
+        ASSERT_EQUAL(tree.GetHeight('G'), 1u);
+    }
+
+    void TestFamilyTreeTruncate() {
+        using TreeT = Tree<char, 2>;
+        auto tree = TreeT::ParseFrom("@ column born integer\nA\nB\nC A B\nD\nE C D\nF A B\nG E F\nH G D | born=1600");
+        tree.TruncateTo(6);
+        auto expected = TreeT::ParseFrom("A\nB\nC A B\nD\nE C D\nF A B");
+        ASSERT_EQUAL(tree, expected);
+        ASSERT_EQUAL(tree.GetContentHash(), expected.GetContentHash());
+        ASSERT_EQUAL(tree.GetGenerationCount(), 3u);
+        ASSERT_EQUAL(tree.GetHeight('A'), 2u);
+        ASSERT_EQUAL(tree.GetHeight('D'), 1u);
+        ASSERT_EQUAL(tree.GetChildrenIndices(tree.GetIndex('E')), vector<size_t>{});
+        ASSERT(!tree.GetNode('G'));
+        ASSERT_EQUAL(tree.GetAttributes().GetRowCount(), 6u);
+        tree.AddNode(Node<char, 2>::ParseFrom("G B D"));
+        ASSERT_EQUAL(tree.GetGeneration('G'), 1u);
+        ASSERT_EQUAL(tree.GetHeight('D'), 1u);
+        tree.TruncateTo(100);
+        ASSERT_EQUAL(tree.GetSize(), 7u);
+        tree.TruncateTo(0);
+        ASSERT_EQUAL(tree, TreeT());
+
+        auto big_tree = GenerateSyntheticTree<string, 2>(2000, 10);
+        auto nodes = big_tree.GetNodes();
+        for (size_t size : {1999, 1500, 700, 1}) {
+            big_tree.TruncateTo(size);
+            Tree<string, 2> prefix(nodes.begin(), nodes.begin() + size);
+            ASSERT_EQUAL(big_tree.GetContentHash(), prefix.GetContentHash());
+            for (size_t index = 0; index < size; index += 7) {
+                const string& id = prefix.GetIdByIndex(index);
+                ASSERT_EQUAL(big_tree.GetHeight(id), prefix.GetHeight(id));
+                ASSERT_EQUAL(big_tree.GetChildrenIndices(index), prefix.GetChildrenIndices(index));
+            }
+            for (size_t generation = 0; generation <= prefix.GetGenerationCount(); ++generation) {
+                ASSERT_EQUAL(big_tree.NodeIndicesInGeneration(generation), prefix.NodeIndicesInGeneration(generation));
+            }
+        }
+    }
+
+    void TestFamilyTreeDiff() {
+        using TreeT = Tree<int, 2>;
+        using NodeT = Node<int, 2>;
+        using PatchT = TreePatch<int, 2>;
+        auto tree1 = TreeT::ParseFrom(R"(1
+2
+4 1 2
+3
+5 4 3)");
+        auto tree2 = TreeT::ParseFrom(R"(2
+6
+1
+4 2 1
+7 6 2
+8 4 7)");
+        ASSERT(Diff(tree1, tree1).IsEmpty());
+        auto patch12 = Diff(tree1, tree2, 3);
+        ASSERT_EQUAL(patch12.added_nodes, (vector<NodeT>{NodeT(6), NodeT::ParseFrom("7 6 2"),
+                                                        NodeT::ParseFrom("8 4 7")}));
+        ASSERT(patch12.conflicts.empty());
+        stringstream patch_stream;
+        patch_stream << patch12;
+        ASSERT_EQUAL(patch_stream.str(), "+ 6\n+ 7 6 2\n+ 8 4 7\n");
+        auto applied = tree1;
+        Apply(applied, PatchT::ParseFrom(patch_stream.str()));
+        ASSERT_EQUAL(applied, TreeT::Merge(tree1, tree2));
+        ASSERT_THROWS(Apply(applied, patch12), runtime_error);
+        ASSERT_EQUAL(applied, TreeT::Merge(tree1, tree2));
+
+        auto tree3 = TreeT::ParseFrom(R"(1
+2
+3
+4 1 3
+9 4 2)");
+        auto patch13 = Diff(tree1, tree3);
+        ASSERT_EQUAL(patch13.added_nodes, vector<NodeT>{NodeT::ParseFrom("9 4 2")});
+        ASSERT_EQUAL(patch13.conflicts.size(), 1u);
+        ASSERT_EQUAL(patch13.conflicts[0].lhs_version, NodeT::ParseFrom("4 1 2"));
+        ASSERT_EQUAL(patch13.conflicts[0].rhs_version, NodeT::ParseFrom("4 1 3"));
+        patch_stream.str("");
+        patch_stream << patch13;
+        ASSERT_EQUAL(patch_stream.str(), "+ 9 4 2\n< 4 1 2\n> 4 1 3\n");
+        ASSERT_EQUAL(PatchT::ParseFrom(patch_stream.str()).conflicts.size(), 1u);
+        ASSERT_THROWS(Apply(tree1, patch13), runtime_error);
+        ASSERT_THROWS(PatchT::ParseFrom("> 4 1 3"), runtime_error);
+    }
+
+    void TestFamilyTreeJournal() {
+        using TreeT = Tree<string, 2>;
+        using JournalT = Journal<string, 2>;
+        auto tree = TreeT::ParseFrom(R"(A
+B
+C A B)");
+        stringstream journal(R"(+ D
++ C A B
++ E C D
+
++ F E)");
+        ASSERT_EQUAL(JournalT::Replay(journal, tree), 2u);
+        ASSERT_EQUAL(tree, TreeT::ParseFrom(R"(A
+B
+C A B
+D
+E C D)"));
+        stringstream bad_record("X\n");
+        ASSERT_THROWS(JournalT::Replay(bad_record, tree), runtime_error);
+        stringstream contradiction("+ C A D\n");
+        ASSERT_THROWS(JournalT::Replay(contradiction, tree), runtime_error);
+
+        stringstream attributed(R"(@ column born integer
+@ column place string
++ F E D | born=1600 place=Madrid
++ G
+)");
+        ASSERT_EQUAL(JournalT::Replay(attributed, tree), 2u);
+        ASSERT_EQUAL(*tree.GetAttributes().Get(tree.GetIndex("F"), "born"), "1600");
+        ASSERT_EQUAL(*tree.GetAttributes().Get(tree.GetIndex("F"), "place"), "Madrid");
+        ASSERT(!tree.GetAttributes().Get(tree.GetIndex("G"), "born"));
+        stringstream unknown_column("+ H | height=180\n");
+        ASSERT_THROWS(JournalT::Replay(unknown_column, tree), runtime_error);
+
+        stringstream edits("= G E F\n- C orphan\n+ C A B\n");
+        ASSERT_EQUAL(JournalT::Replay(edits, tree), 3u);
+        ASSERT_EQUAL(tree, TreeT::ParseFrom("A\nB\nD\nE\nF E D\nG E F\nC A B"));
+        ASSERT_EQUAL(*tree.GetAttributes().Get(tree.GetIndex("F"), "place"), "Madrid");
+        stringstream bad_removal("- G\n");
+        ASSERT_THROWS(JournalT::Replay(bad_removal, tree), runtime_error);
+        stringstream other_base("# base 1 2\n- C reject\n");
+        ASSERT_EQUAL(JournalT::Replay(other_base, tree), 0u);
+        stringstream same_base("# base " + to_string(tree.GetSize()) + ' ' + to_string(tree.GetContentHash()) +
+                               "\n- C reject\n");
+        ASSERT_EQUAL(JournalT::Replay(same_base, tree), 1u);
+        ASSERT(!tree.GetNode("C"));
+
+        const string snapshot = "/tmp/family_tree_test_journal.txt";
+        JournalT written(snapshot);
+        written.Compact(TreeT::ParseFrom("A\nB"));
+        auto edited = TreeT::ParseFrom("@ column place string\nA\nB\nC A B | place=Ghent");
+        written.AppendSuffix(edited, 2, 0);
+        ASSERT_EQUAL(JournalT::Load(snapshot), edited);
+        ASSERT_EQUAL(*JournalT::Load(snapshot).GetAttributes().Get(2, "place"), "Ghent");
+        written.AppendRemoval("C", RemovalPolicy::RejectParents);
+        written.AppendParents(Node<string, 2>::ParseFrom("B"));
+        ASSERT_EQUAL(JournalT::Load(snapshot), TreeT::ParseFrom("A\nB"));
+
+        // Compaction interrupted after replacing the snapshot leaves a journal of the previous version
+        ofstream(snapshot) << "A\nB\nD\n";
+        JournalT reopened(snapshot);
+        auto reopened_tree = reopened.Open();
+        ASSERT_EQUAL(reopened_tree, TreeT::ParseFrom("A\nB\nD"));
+        reopened_tree.AddNode(Node<string, 2>::ParseFrom("E A D"));
+        reopened.AppendSuffix(reopened_tree, 3, 0);
+        ASSERT_EQUAL(JournalT::Load(snapshot), reopened_tree);
+        remove(snapshot.c_str());
+        remove((snapshot + ".journal").c_str());
+    }
+
+    string RunScript(const string& script) {
+        // Output of a successful batch run
+        stringstream input(script), output, log;
+        ASSERT_EQUAL(RunBatch(input, "", output, log), 0);
+        return output.str();
+    }
+
+    void TestFamilyTreeBatch() {
+        using TreeT = Tree<string, 2>;
+        using JournalT = Journal<string, 2>;
+        const string filename = "/tmp/family_tree_test_batch.txt";
+        ofstream(filename) << "A\nB\n";
+        remove((filename + ".journal").c_str());
+        {
+            stringstream script("add C A B\n\nadd D C Z\nadd E\n"), output, log;
+            ASSERT_EQUAL(RunBatch(script, filename, output, log), 1);
+            ASSERT(log.str().starts_with("line 1 add: "));
+            ASSERT(log.str().ends_with("Error at line 3 (add): Unknown parent id\n"));
+            // Edits before the error reach the journal, commands after it are not run
+            string journal = ReadEverythingFromFile(filename + ".journal");
+            ASSERT(journal.starts_with("# base 2 "));
+            ASSERT(journal.ends_with("\n+ C A B\n"));
+            ASSERT_EQUAL(JournalT::Load(filename), TreeT::ParseFrom("A\nB\nC A B"));
+        }
+        {
+            stringstream script("print\nfrobnicate\nadd F\n"), output, log;
+            ASSERT_EQUAL(RunBatch(script, filename, output, log), 1);
+            ASSERT_EQUAL(output.str(), "A\nB\nC A B\n");
+            ASSERT(log.str().ends_with("Error at line 2 (frobnicate): Unknown command\n"));
+        }
+        {
+            stringstream script("add F\nexit\nadd G\n"), output, log;
+            ASSERT_EQUAL(RunBatch(script, filename, output, log), 0);
+            ASSERT_EQUAL(JournalT::Load(filename).GetSize(), 4u);
+        }
+        {
+            const string bad_filename = "/tmp/family_tree_test_batch_bad.txt";
+            ofstream(bad_filename) << "A B\n";
+            stringstream script("print\n"), output, log;
+            ASSERT_EQUAL(RunBatch(script, bad_filename, output, log), 1);
+            ASSERT(log.str().starts_with("Error at line 0 (open " + bad_filename + "): "));
+            ASSERT(output.str().empty());
+            remove(bad_filename.c_str());
+        }
+        remove(filename.c_str());
+        remove((filename + ".journal").c_str());
+    }
+
+    int ConnectTo(const string& socket_path) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        strcpy(address.sun_path, socket_path.c_str());
+        int client_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        ASSERT(connect(client_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0);
+        return client_fd;
+    }
+
+    string Exchange(int client_fd, const string& request, size_t response_size) {
+        // Sends request and reads response_size bytes or until the server closes connection
+        for (size_t sent = 0; sent < request.size();) {
+            ssize_t n_sent = send(client_fd, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+            ASSERT(n_sent > 0);
+            sent += n_sent;
+        }
+        string response(response_size, '\0');
+        size_t received = 0;
+        while (received < response_size) {
+            ssize_t n_received = recv(client_fd, response.data() + received, response_size - received, 0);
+            if (n_received <= 0) {
+                break;
+            }
+            received += n_received;
+        }
+        response.resize(received);
+        return response;
+    }
+
+    void TestFamilyTreeServer() {
+        const string socket_path = "/tmp/family_tree_test_server.sock";
+        LineServer server(socket_path, 1, [](const string& request) {
+            if (request == "fail") {
+                throw runtime_error("failed\nbadly");
+            }
+            if (request == "slow") {
+                this_thread::sleep_for(chrono::milliseconds(50));
+            }
+            return LineServer::Response{.payload = request, .close_connection = request == "exit"};
+        });
+        thread server_thread(&LineServer::Run, &server);
+        // The only worker must not be held by a connection that sends nothing
+        int idle_fd = ConnectTo(socket_path);
+        int client_fd = ConnectTo(socket_path);
+        const string responses = "OK 2\nabOK 0\nERROR failed badly\nOK 4\nexit";
+        ASSERT_EQUAL(Exchange(client_fd, "ab\n\nfail\r\nexit\nignored\n", responses.size() + 1), responses);
+        close(client_fd);
+
+        int long_fd = ConnectTo(socket_path);
+        ASSERT_EQUAL(Exchange(long_fd, string(LineServer::MAX_REQUEST_SIZE + 1, 'x'), 100),
+                     "ERROR Request is longer than " + to_string(LineServer::MAX_REQUEST_SIZE) + "\n");
+        close(long_fd);
+
+        // Client half-closed while its request is handled still gets the response
+        int half_closed_fd = ConnectTo(socket_path);
+        ASSERT_EQUAL(Exchange(half_closed_fd, "slow\n", 0), "");
+        shutdown(half_closed_fd, SHUT_WR);
+        ASSERT_EQUAL(Exchange(half_closed_fd, "", 100), "OK 4\nslow");
+        close(half_closed_fd);
+
+        int other_fd = ConnectTo(socket_path);
+        ASSERT_EQUAL(Exchange(other_fd, "x\n", 6), "OK 1\nx");
+        server.Stop();
+        server_thread.join();
+        ASSERT_EQUAL(Exchange(idle_fd, "", 1), "");
+        close(other_fd);
+        close(idle_fd);
+    }
+
+    void TestFamilyTreeUndo() {
+        const string filename = "/tmp/family_tree_test_undo.txt";
+        const string other_filename = "/tmp/family_tree_test_undo_other.txt";
+        ofstream(other_filename) << "@ column born integer\nX2\nX3\nX1 X2 X3 | born=1500\nX6 | born=1600\n";
+        ASSERT_EQUAL(RunScript("save " + filename + R"(
+add X1
+add X2
+add X3
+checkpoint c
+undo
+undo c
+checkpoint
+undo 2
+checkpoint
+redo
+undo c
+print
+add X4 X1 X2
+reparent X4 X2 X3
+remove X1 orphan
+undo 2
+print
+redo 5
+checkpoint
+undo c
+add X5
+redo
+merge )" + other_filename + R"( right
+print
+undo
+print
+redo
+)"), R"(1 edits undone
+1 edits redone
+c: 0 edits ago
+2 edits undone
+c: 2 edits ahead
+1 edits redone
+1 edits redone
+X1
+X2
+X3
+1 nodes removed
+2 edits undone
+X1
+X2
+X3
+X4 X1 X2
+2 edits redone
+c: 3 edits ago
+3 edits undone
+0 edits redone
+< X1
+> X1 X2 X3
+1 conflicts
+@ column born integer
+X3
+X2
+X1 X2 X3 | born=1500
+X5
+X6 | born=1600
+1 edits undone
+X1
+X2
+X3
+X5
+1 edits redone
+)");
+        // Every command leaves the snapshot with its journal equal to the current version
+        using TreeT = Tree<string, 2>;
+        auto saved = Journal<string, 2>::Load(filename);
+        ASSERT_EQUAL(saved, TreeT::ParseFrom("X2\nX3\nX5\nX1 X2 X3\nX6"));
+        ASSERT_EQUAL(*saved.GetAttributes().Get(saved.GetIndex("X6"), "born"), "1600");
+        ASSERT_EQUAL(RunScript("open " + filename + "\nundo\nredo 2\ncheckpoint\n"), "0 edits undone\n0 edits redone\n");
+
+        // Removal and reparenting are journaled, snapshot is not rewritten
+        ASSERT_EQUAL(RunScript("open " + filename + "\nadd X7 X5 X6\nreparent X7 X2 X3\nremove X5 cascade\n"),
+                     "1 nodes removed\n");
+        string journal = ReadEverythingFromFile(filename + ".journal");
+        ASSERT(journal.starts_with("# base 5 "));
+        ASSERT(journal.ends_with("\n+ X7 X5 X6\n= X7 X2 X3\n- X5 cascade\n"));
+        saved = Journal<string, 2>::Load(filename);
+        ASSERT_EQUAL(saved, TreeT::ParseFrom("X2\nX3\nX1 X2 X3\nX6\nX7 X2 X3"));
+        ASSERT_EQUAL(RunScript("open " + filename + "\nremove X1\nundo\nprint\n"),
+                     "1 nodes removed\n1 edits undone\n@ column born integer\nX3\nX2\nX1 X2 X3 | born=1500\n"
+                     "X6 | born=1600\nX7 X2 X3\n");
+        remove(filename.c_str());
+        remove((filename + ".journal").c_str());
+        remove(other_filename.c_str());
+    }
+
+    void TestFamilyTreeEditing() {
+        using TreeT = Tree<char, 2>;
+        const string text = "@ column born integer\nA\nB\nC A B\nD\nE C D\nF A B\nG E F | born=1600";
+        auto birth_order = [](const TreeT& tree) {
+            string order;
+            for (size_t index = 0; index < tree.GetSize(); ++index) {
+                order += tree.GetIdByIndex(index);
+            }
+            return order;
+        };
+        {
+            auto tree = TreeT::ParseFrom(text);
+            ASSERT_THROWS(tree.RemoveNode('C'), runtime_error);
+            ASSERT_THROWS(tree.RemoveNode('Z', RemovalPolicy::Cascade), runtime_error);
+            ASSERT_EQUAL(tree.RemoveNode('G'), 1u);
+            ASSERT_EQUAL(tree, TreeT::ParseFrom("A\nB\nC A B\nD\nE C D\nF A B"));
+            ASSERT_EQUAL(tree.RemoveNode('C', RemovalPolicy::Cascade), 2u);
+            ASSERT_EQUAL(tree, TreeT::ParseFrom("A\nB\nD\nF A B"));
+            ASSERT_EQUAL(tree.GetHeight('D'), 0u);
+        }
+        {
+            auto tree = TreeT::ParseFrom(text);
+            ASSERT_EQUAL(tree.RemoveNode('C', RemovalPolicy::Orphan), 1u);
+            ASSERT_EQUAL(tree, TreeT::ParseFrom("A\nB\nD\nE\nF A B\nG E F"));
+            ASSERT_EQUAL(tree.GetGeneration('G'), 2u);
+            ASSERT_EQUAL(*tree.GetAttributes().Get(tree.GetIndex('G'), "born"), "1600");
+        }
+        {
+            auto tree = TreeT::ParseFrom(text);
+            tree.SetParents('E', {'A', 'F'});
+            ASSERT_EQUAL(birth_order(tree), "ABCDFEG");
+            ASSERT_EQUAL(tree, TreeT::ParseFrom("A\nB\nC A B\nD\nF A B\nE A F\nG E F"));
+            ASSERT_EQUAL(tree.GetGeneration('G'), 3u);
+            ASSERT_EQUAL(tree.GetHeight('D'), 0u);
+            ASSERT_EQUAL(*tree.GetAttributes().Get(6, "born"), "1600");
+            ASSERT_THROWS(tree.SetParents('A', {'G', 'B'}), runtime_error);
+            ASSERT_THROWS(tree.SetParents('C', {'C', 'A'}), runtime_error);
+            ASSERT_THROWS(tree.SetParents('C', {'A'}), runtime_error);
+            ASSERT_THROWS(tree.SetParents('C', {'A', 'Z'}), runtime_error);
+            ASSERT_EQUAL(birth_order(tree), "ABCDFEG");
+            tree.SetParents('C', {'D', 'B'});
+            ASSERT_EQUAL(birth_order(tree), "ABDCFEG");
+            tree.SetParents('E', {});
+            ASSERT_EQUAL(tree.GetGeneration('E'), 0u);
+            ASSERT_EQUAL(tree.GetGeneration('G'), 2u);
+        }
+        {
+            // Suffix taken before an edit restores the previous version, the replaced suffix redoes the edit
+            const auto original = TreeT::ParseFrom(text);
+            auto tree = original;
+            auto undo = tree.GetSuffix(tree.GetIndex('C'), tree.GetAttributes().GetColumnCount());
+            tree.RemoveNode('C', RemovalPolicy::Orphan);
+            tree.GetAttributes().AddColumn("place", AttributeType::String);
+            tree.SetAttribute('D', "place", "Ghent");
+            auto redo = tree.SwapSuffix(std::move(undo));
+            ASSERT_EQUAL(birth_order(tree), "ABCDEFG");
+            ASSERT_EQUAL(tree, original);
+            ASSERT_EQUAL(tree.GetHeight('A'), 3u);
+            ASSERT_EQUAL(tree.GetAttributes().GetColumnCount(), 1u);
+            ASSERT_EQUAL(*tree.GetAttributes().Get(6, "born"), "1600");
+            ASSERT_EQUAL(redo.nodes.size(), 4u);
+            tree.SwapSuffix(std::move(redo));
+            ASSERT_EQUAL(tree, TreeT::ParseFrom("A\nB\nD\nE\nF A B\nG E F"));
+            ASSERT_EQUAL(*tree.GetAttributes().Get(tree.GetIndex('D'), "place"), "Ghent");
+            ASSERT_EQUAL(*tree.GetAttributes().Get(tree.GetIndex('G'), "born"), "1600");
+        }
+
+        // Edited indices match a tree built from scratch with the same nodes
+        auto big_tree = GenerateSyntheticTree<string, 2>(1500, 10);
+        mt19937 random(7);
+        for (size_t edit = 0; edit < 30; ++edit) {
+            const string node = big_tree.GetIdByIndex(random() % big_tree.GetSize());
+            if (edit % 3 == 0) {
+                big_tree.RemoveNode(node, edit % 2 ? RemovalPolicy::Cascade : RemovalPolicy::Orphan);
+            } else {
+                vector<string> parents = {big_tree.GetIdByIndex(random() % big_tree.GetSize()),
+                                          big_tree.GetIdByIndex(random() % big_tree.GetSize())};
+                auto ancestors = big_tree.GetAncestors(parents[0]);
+                auto other_ancestors = big_tree.GetAncestors(parents[1]);
+                bool cycle = ancestors.count(node) || other_ancestors.count(node);
+                try {
+                    big_tree.SetParents(node, parents);
+                    ASSERT(!cycle);
+                } catch (const runtime_error&) {
+                    ASSERT(cycle);
+                }
+            }
+            auto nodes = big_tree.GetNodes();
+            Tree<string, 2> rebuilt(nodes.begin(), nodes.end());
+            ASSERT_EQUAL(big_tree.GetContentHash(), rebuilt.GetContentHash());
+            ASSERT_EQUAL(big_tree.GetGenerationCount(), rebuilt.GetGenerationCount());
+            for (size_t index = 0; index < rebuilt.GetSize(); ++index) {
+                const string& id = rebuilt.GetIdByIndex(index);
+                ASSERT_EQUAL(big_tree.GetIndex(id), index);
+                ASSERT_EQUAL(big_tree.GetHeight(id), rebuilt.GetHeight(id));
+                ASSERT_EQUAL(big_tree.GetGeneration(id), rebuilt.GetGeneration(id));
+                ASSERT_EQUAL(big_tree.GetChildrenIndices(index), rebuilt.GetChildrenIndices(index));
+            }
+        }
+    }
+
+    void TestFamilyTreeCompact() {
+        using TreeT = Tree<char, 2>;
+        auto tree = TreeT::ParseFrom("@ column born integer\nA\nD\nB\nF A B\nG D B | born=1600\nC A B\nE C G");
+        auto original = tree;
+        tree.Compact();
+        ASSERT_EQUAL(tree, original);
+        string order;
+        for (size_t index = 0; index < tree.GetSize(); ++index) {
+            order += tree.GetIdByIndex(index);
+        }
+        // Ranks come from breadth-first search started at D, the last node reached from A
+        ASSERT_EQUAL(order, "DBAGFCE");
+        ASSERT_EQUAL(*tree.GetAttributes().Get(tree.GetIndex('G'), "born"), "1600");
+        ASSERT(!tree.GetAttributes().Get(tree.GetIndex('C'), "born"));
+
+        auto big_tree = GenerateSyntheticTree<string, 2>(3000, 12);
+        auto compacted = big_tree;
+        compacted.Compact();
+        ASSERT_EQUAL(compacted, big_tree);
+        for (size_t index = 0; index < compacted.GetSize(); ++index) {
+            const string& id = compacted.GetIdByIndex(index);
+            ASSERT_EQUAL(compacted.GetHeight(id), big_tree.GetHeight(id));
+            ASSERT_EQUAL(compacted.GetGeneration(id), big_tree.GetGeneration(id));
+            for (size_t parent_index : compacted.GetParentIndices(index)) {
+                ASSERT(parent_index == TreeT::NO_INDEX || parent_index < index);
+            }
+        }
+        const string& someone = big_tree.GetIdByIndex(2500);
+        ASSERT(compacted.GetAncestors(someone) == big_tree.GetAncestors(someone));
+    }
+
+    void TestFamilyTreeExtraction() {
+        using TreeT = Tree<char, 3>;
+        auto tree = TreeT::ParseFrom(R"(A
+B
+C
+D
+E A B C
+F A B C
+G A B C
+H A B C
+I E F D
+J F G H
+K I G H
+L I G D
+M A K L)");
+        ASSERT_EQUAL(tree.ExtractAncestry({'I'}), TreeT::ParseFrom(R"(A
+B
+C
+D
+E A B C
+F A B C
+I E F D)"));
+        ASSERT_EQUAL(tree.ExtractAncestry({'I'}, 1), TreeT::ParseFrom(R"(D
+E
+F
+I E F D)"));
+        ASSERT_EQUAL(tree.ExtractAncestry({'J', 'D'}, 0), TreeT::ParseFrom("D\nJ"));
+        ASSERT_EQUAL(tree.ExtractDescendants({'E'}), TreeT::ParseFrom(R"(E
+I
+K
+L
+M)"));
+        ASSERT_EQUAL(tree.ExtractDescendants({'G', 'I'}, 1), TreeT::ParseFrom("G\nI\nJ\nK\nL"));
+        auto extracted = tree.ExtractInducedSubtree([](const Node<char, 3> &node) {
+            return node.id != 'A';
+        });
+        ASSERT_EQUAL(extracted.GetSize(), 12u);
+        ASSERT_EQUAL(*extracted.GetNode('J'), (Node<char, 3>::ParseFrom("J F G H")));
+        ASSERT(!extracted.GetNode('E')->parent_ids);
+        ASSERT(!extracted.GetNode('M')->parent_ids);
+        ASSERT_EQUAL(extracted.GetIndex('M'), 11u);
+        ASSERT_THROWS(tree.ExtractAncestry({'Z'}), runtime_error);
+    }
+
+    Tree<string, 2> MakeRenderTree() {
+        // Every node's parents are two neighbouring older nodes: long generations and many shared unions
+        Tree<string, 2> tree;
+        tree.AddNode(Node<string, 2>("founder0")).AddNode(Node<string, 2>("founder1"));
+        for (size_t i = 2; i < 10000; ++i) {
+            tree.AddNode(Node<string, 2>("n" + to_string(i), vector<string>{
+                tree.GetIdByIndex(i / 2), tree.GetIdByIndex(i / 2 - 1)}));
+        }
+        return tree;
+    }
+
+    void TestFamilyTreeRender() {
+        using TreeT = Tree<string, 2>;
+        auto tree = MakeRenderTree();
+        string sequential = EraseRgbColors(tree.RenderSvg().AsString());
+        ASSERT(sequential.find("<text ") != string::npos);
+        for (size_t n_threads : {1, 3}) {
+            stringstream parallel;
+            tree.RenderSvgParallel(parallel, n_threads);
+            ASSERT_EQUAL(EraseRgbColors(parallel.str()), sequential);
+        }
+        stringstream empty_render;
+        TreeT().RenderSvgParallel(empty_render);
+        ASSERT_EQUAL(empty_render.str(), TreeT().RenderSvg().AsString());
+    }
+
+    void TestFamilyTreeRenderFlat() {
+        Svg::FlatDocument flat_doc;
+        auto edge_style = flat_doc.AddStyle({.stroke = Svg::Rgb{1, 2, 3}});
+        auto label_style = flat_doc.AddStyle({.fill = string("black"), .font_size = 30});
+        ASSERT_EQUAL(flat_doc.AddStyle({.stroke = Svg::Rgb{1, 2, 3}}), edge_style);
+        flat_doc.AddText({1, 2}, "label", label_style);
+        flat_doc.AddCircle({1.5, 2}, 3, edge_style);
+        flat_doc.AddLine({0, 0}, {10, 20}, edge_style);
+        ASSERT_EQUAL(flat_doc.AsString(), string(Svg::Document::PROLOGUE) +
+                "<style>.s0{fill:none;stroke:rgb(1,2,3);stroke-width:1}"
+                ".s1{fill:black;stroke:none;stroke-width:1;font-size:30px}</style>"
+                "<polyline class=\"s0\" points=\"0,0 10,20\"/>"
+                "<circle class=\"s0\" cx=\"1.5\" cy=\"2\" r=\"3\"/>"
+                "<text class=\"s1\" x=\"1\" y=\"2\">label</text>" + string(Svg::Document::EPILOGUE));
+
+        auto tree = MakeRenderTree();
+        auto tree_flat_doc = tree.RenderFlatSvg();
+        ASSERT_EQUAL(tree_flat_doc.GetShapeCount(), 2 * tree.GetSize() + 2 * (tree.GetSize() - 2));
+        // Circle and edge style per rounded color and one label style, however large the tree is
+        ASSERT(tree_flat_doc.GetStyleCount() <= 2 * 16 * 16 * 16 + 1);
+        ASSERT(tree_flat_doc.GetStyleCount() < tree.GetSize());
+        ASSERT(tree_flat_doc.AsString().size() < tree.RenderSvg().AsString().size());
+    }
+
+    void TestFamilyTreeRenderBundled() {
+        using TreeT = Tree<string, 2>;
+        Svg::Path path;
+        path.MoveTo({0, 0}).LineTo({1, 1}).LineTo({3, 3}).LineTo({3, 5}).LineTo({3, 4})
+                .MoveTo({3, 5}).LineTo({3, 6}).LineTo({3, 7});
+        ASSERT_EQUAL(path.GetSegmentCount(), 4u);
+        string path_svg;
+        path.Render(path_svg);
+        ASSERT_EQUAL(path_svg, R"(<path fill="none" stroke="none" stroke-width="1" d="M0,0 L3,3 L3,5 L3,4 M3,5 L3,7" />)");
+
+        auto bundled_doc = TreeT::ParseFrom("a\nb\nc a b\nd b a\ne a b\nf\ng e f").RenderBundledSvg();
+        // Unions {a, b} and {e, f}, circle and label per node
+        ASSERT_EQUAL(bundled_doc.GetObjectCount(), 2u + 2 * 7);
+        auto tree = MakeRenderTree();
+        size_t n_unions = 0;
+        for (size_t index = 2; index < tree.GetSize(); ++index) {
+            n_unions += tree.GetParentIndices(index) != tree.GetParentIndices(index - 1);
+        }
+        ASSERT_EQUAL(tree.RenderBundledSvg().GetObjectCount(), n_unions + 2 * tree.GetSize());
+    }
+
+    void TestFamilyTreeRenderLod() {
+        using TreeT = Tree<string, 2>;
+        Svg::BoxGrid grid(10);
+        ASSERT(grid.TryInsert({0, 0, 25, 5}));
+        ASSERT(grid.Overlaps({24, 4, 30, 30}));
+        ASSERT(!grid.Overlaps({25, 0, 40, 5}));
+        ASSERT(!grid.TryInsert({-5, -5, 1, 1}));
+        ASSERT(grid.TryInsert({-15, -5, -1, 1}));
+        ASSERT_EQUAL(grid.GetSize(), 2u);
+        Svg::BoxGrid fine_grid(3e-8);
+        ASSERT(fine_grid.TryInsert({0, 0, 1e-7, 1e-7}));
+        ASSERT_THROWS(fine_grid.TryInsert({1500, 0, 1501, 1}), out_of_range);
+
+        auto count = [](const string& str, const string& pattern) {
+            size_t n_found = 0;
+            for (size_t pos = str.find(pattern); pos != string::npos; pos = str.find(pattern, pos + 1)) {
+                ++n_found;
+            }
+            return n_found;
+        };
+        string small_lod = TreeT::ParseFrom("a\nb\nc a b").RenderLodSvg(1, 2).AsString();
+        ASSERT_EQUAL(count(small_lod, "<text "), 3u);
+        ASSERT(small_lod.find("<g class=\"lod1\" ") > small_lod.rfind("<text "));
+        auto tree = MakeRenderTree();
+        string lod = tree.RenderLodSvg(2).AsString();
+        ASSERT_EQUAL(count(lod, "<circle "), tree.GetSize());
+        ASSERT_EQUAL(count(lod, "<g class=\"lod"), 4u);
+        ASSERT(count(lod, ">+") > 0);
+        ASSERT(count(lod, "<text ") < tree.GetSize());
+        ASSERT_THROWS(tree.RenderLodSvg(0), runtime_error);
+        ASSERT_THROWS(tree.RenderLodSvg(1e9), runtime_error);
+        ASSERT_EQUAL(count(tree.RenderLodSvg(TreeT::MAX_LOD_ZOOM).AsString(), "<circle "), tree.GetSize());
+    }
+
+    string Gunzip(const string& compressed) {
+        z_stream stream{};
+        // 15 + 32 - detect gzip header automatically
+        ASSERT_EQUAL(inflateInit2(&stream, 15 + 32), Z_OK);
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(compressed.data()));
+        stream.avail_in = compressed.size();
+        string result;
+        char buffer[4096];
+        int status;
+        do {
+            stream.next_out = reinterpret_cast<Bytef*>(buffer);
+            stream.avail_out = sizeof(buffer);
+            status = inflate(&stream, Z_NO_FLUSH);
+            ASSERT(status == Z_OK || status == Z_STREAM_END);
+            result.append(buffer, sizeof(buffer) - stream.avail_out);
+        } while (status != Z_STREAM_END);
+        inflateEnd(&stream);
+        return result;
+    }
+
+    void TestFamilyTreeExport() {
+        using TreeT = Tree<string, 2>;
+        auto tree = TreeT::ParseFrom("a\nb\nc a b\n\"q\"");
+        stringstream json;
+        tree.ExportLayoutJson(json);
+        ASSERT(json.str().starts_with("{\"width\":1500,\"height\":740,\"radius\":30,\"nodes\":[{\"id\":\"a\","));
+        ASSERT(json.str().find("{\"id\":\"\\\"q\\\"\",") != string::npos);
+        ASSERT(json.str().ends_with("],\"edges\":[[0,2],[1,2]]}\n"));
+
+        stringstream dot;
+        tree.ExportLayoutDot(dot);
+        ASSERT(dot.str().starts_with("digraph FamilyTree {\n"));
+        ASSERT(dot.str().find("  2 [label=\"c\", pos=\"") != string::npos);
+        ASSERT(dot.str().ends_with("  0 -> 2;\n  1 -> 2;\n}\n"));
+
+        string svg = tree.RenderSvg().AsString();
+        for (string big_svg = svg; big_svg.size() < 1'000'000; ) {
+            // Longer than compression buffers
+            big_svg += big_svg;
+            stringstream compressed;
+            {
+                Gzip::OStream gzip_output(compressed, 9);
+                gzip_output << big_svg;
+            }
+            ASSERT(compressed.str().size() < big_svg.size());
+            ASSERT_EQUAL(Gunzip(compressed.str()), big_svg);
+        }
+        stringstream flushed;
+        Gzip::OStream gzip_output(flushed);
+        gzip_output << svg << flush;
+        gzip_output.Finish();
+        ASSERT_EQUAL(Gunzip(flushed.str()), svg);
+    }
+
+    void TestFamilyTreeAttributes() {
+        NodeSet set(130);
+        set.Insert(0);
+        set.Insert(64);
+        set.Insert(129);
+        ASSERT_EQUAL(set.Count(), 3u);
+        ASSERT_EQUAL(set.ToIndices(), (vector<size_t>{0, 64, 129}));
+        NodeSet inverted = set;
+        inverted.Invert();
+        ASSERT_EQUAL(inverted.Count(), 127u);
+        inverted &= set;
+        ASSERT(inverted.IsEmpty());
+        inverted |= set;
+        inverted -= NodeSet(130, true);
+        ASSERT(inverted == NodeSet(130));
+
+        using TreeT = Tree<string, 2>;
+        const string text = R"(@ column born date
+@ column sex enum M F
+@ column place string
+@ column children integer
+Philip1 | born=1478-07-22 sex=M place=Bruges children=6
+Joanna | born=1479-11-06 sex=F
+Charles5 Philip1 Joanna | born=1500 sex=M place=Ghent
+Isabella | born=1503-10 sex=F
+Philip2 Charles5 Isabella | born=1527-05-21 sex=M children=8
+Anna
+)";
+        auto tree = TreeT::ParseFrom(text);
+        stringstream output;
+        output << tree;
+        ASSERT_EQUAL(output.str(), text);
+        const auto& attributes = tree.GetAttributes();
+        ASSERT_EQUAL(attributes.GetRowCount(), 6u);
+        ASSERT_EQUAL(*attributes.Get(3, "born"), "1503-10");
+        ASSERT(!attributes.Get(5, "sex"));
+        ASSERT_EQUAL(attributes.FilterRange("born", "1479", "1503").ToIndices(), (vector<size_t>{1, 2, 3}));
+        ASSERT_EQUAL(attributes.FilterRange("born", "1479-12", "1503-09").ToIndices(), (vector<size_t>{2}));
+        ASSERT_EQUAL(attributes.FilterEqual("born", "1527-05").ToIndices(), (vector<size_t>{4}));
+        ASSERT_EQUAL(attributes.FilterEqual("sex", "F").ToIndices(), (vector<size_t>{1, 3}));
+        ASSERT_EQUAL(attributes.FilterEqual("place", "Ghent").ToIndices(), (vector<size_t>{2}));
+        ASSERT(attributes.FilterEqual("place", "Madrid").IsEmpty());
+        ASSERT_EQUAL(attributes.FilterRange("children", "7", "100").ToIndices(), (vector<size_t>{4}));
+        ASSERT_THROWS(attributes.FilterEqual("sex", "X"), runtime_error);
+        ASSERT_THROWS(attributes.FilterRange("place", "A", "B"), runtime_error);
+        ASSERT_THROWS(attributes.FilterEqual("height", "1"), runtime_error);
+        ASSERT_THROWS(TreeT::ParseFrom("@ column born date\na | born=1500-13"), runtime_error);
+        ASSERT_THROWS(TreeT::ParseFrom("a | born=1500"), runtime_error);
+
+        auto born_in_1400s = attributes.FilterRange("born", "1400", "1499");
+        born_in_1400s &= tree.GetAncestorSet("Philip2");
+        ASSERT_EQUAL(born_in_1400s.ToIndices(), (vector<size_t>{0, 1}));
+        ASSERT_EQUAL(tree.GetAncestorSet("Isabella").ToIndices(), vector<size_t>{3});
+
+        auto ancestry = tree.ExtractAncestry({"Charles5"});
+        ASSERT_EQUAL(*ancestry.GetAttributes().Get(ancestry.GetIndex("Charles5"), "place"), "Ghent");
+        auto descendants = tree.ExtractDescendants({"Charles5"});
+        ASSERT_EQUAL(*descendants.GetAttributes().Get(descendants.GetIndex("Philip2"), "children"), "8");
+        tree.SetAttribute("Anna", "children", "-1");
+        ASSERT_EQUAL(*tree.GetAttributes().Get(5, "children"), "-1");
+
+        stringstream binary;
+        tree.GetAttributes().WriteBinary(binary);
+        auto loaded = AttributeStore::ReadBinary(binary);
+        for (size_t row = 0; row < tree.GetSize(); ++row) {
+            for (string column : {"born", "sex", "place", "children"}) {
+                ASSERT(loaded.Get(row, column) == tree.GetAttributes().Get(row, column));
+            }
+        }
+        ASSERT(loaded.FilterEqual("sex", "M") == tree.GetAttributes().FilterEqual("sex", "M"));
+        stringstream truncated(binary.str().substr(0, binary.str().size() - 1));
+        ASSERT_THROWS(AttributeStore::ReadBinary(truncated), runtime_error);
+
+        AttributeStore scanned;
+        scanned.AddColumn("value", AttributeType::Integer);
+        scanned.Resize(1000);
+        for (size_t row = 0; row < 1000; row += 1 + row % 3) {
+            scanned.Set(row, "value", to_string(static_cast<int64_t>(row * 7919 % 1000) - 500));
+        }
+        auto in_range = scanned.FilterRange("value", "-100", "250");
+        for (size_t row = 0; row < 1000; ++row) {
+            auto value = scanned.Get(row, "value");
+            ASSERT_EQUAL(in_range.Contains(row), value && stoll(*value) >= -100 && stoll(*value) <= 250);
+        }
+    }
+
+    void TestFamilyTreePedigreeCollapse() {
+        using TreeT = Tree<char, 2>;
+        auto tree = TreeT::ParseFrom("a\nb\nc a b\nd a b\ne c d\nf e c\ng");
+        auto e_collapse = tree.GetPedigreeCollapse('e');
+        ASSERT_EQUAL(e_collapse.distinct_ancestors, (vector<size_t>{1, 2, 2}));
+        ASSERT_EQUAL(e_collapse.ancestor_slots, (vector<double>{1, 2, 4}));
+        ASSERT_EQUAL(e_collapse.GetCollapseRatio(1), 0.0);
+        ASSERT_EQUAL(e_collapse.GetCollapseRatio(2), 0.5);
+        ASSERT(abs(e_collapse.GetCollapseRatio() - 1.0 / 3) < 1e-12);
+        // c is both a parent and a grandparent of f
+        auto f_collapse = tree.GetPedigreeCollapse('f');
+        ASSERT_EQUAL(f_collapse.distinct_ancestors, (vector<size_t>{1, 2, 4, 2}));
+        ASSERT_EQUAL(f_collapse.ancestor_slots, (vector<double>{1, 2, 4, 4}));
+        auto g_collapse = tree.GetPedigreeCollapse('g');
+        ASSERT_EQUAL(g_collapse.GetCollapseRatio(), 0.0);
+        ASSERT_EQUAL(g_collapse.GetCollapseRatio(1), 0.0);
+        ASSERT_THROWS(tree.GetPedigreeCollapse('z'), runtime_error);
+
+        auto big_tree = GenerateSyntheticTree<string, 2>(3000, 12);
+        auto collapses = big_tree.GetPedigreeCollapseAll(3);
+        ASSERT_EQUAL(collapses.size(), big_tree.GetSize());
+        for (size_t index = 0; index < big_tree.GetSize(); index += 97) {
+            auto collapse = big_tree.GetPedigreeCollapse(big_tree.GetIdByIndex(index));
+            ASSERT_EQUAL(collapses[index].distinct_ancestors, collapse.distinct_ancestors);
+            ASSERT_EQUAL(collapses[index].ancestor_slots, collapse.ancestor_slots);
+            size_t n_ancestors = 0;
+            for (size_t generation = 1; generation < collapse.distinct_ancestors.size(); ++generation) {
+                ASSERT(collapse.distinct_ancestors[generation] <= collapse.ancestor_slots[generation]);
+                n_ancestors += collapse.distinct_ancestors[generation];
+            }
+            ASSERT(n_ancestors >= big_tree.GetAncestorSet(big_tree.GetIdByIndex(index)).Count() - 1);
+        }
+    }
+
+    void TestFamilyTreeMostRelated() {
+        using TreeT = Tree<char, 2>;
+        // f and g are full siblings of e, h is a half sibling, i a child, j a cousin
+        auto tree = TreeT::ParseFrom("a\nb\nc a b\nd\ne c d\nf c d\nk\nh c k\nm\ni e m\ng d c\nn\nj f n\nz");
+        auto relatives = tree.MostRelated('e', 100);
+        string order;
+        for (const auto& relative : relatives) {
+            order += relative.id + to_string(relative.distance) + " ";
+        }
+        ASSERT_EQUAL(order, "c1 d1 i1 f2 g2 a2 b2 h2 j3 ");
+        ASSERT_EQUAL(relatives[3].paths, 2.0);
+        ASSERT_EQUAL(relatives[7].paths, 1.0);
+        ASSERT_EQUAL(tree.MostRelated('e', 4).size(), 4u);
+        ASSERT_EQUAL(tree.MostRelated('e', 4).back().id, 'f');
+        ASSERT(tree.MostRelated('z', 5).empty());
+        ASSERT(tree.MostRelated('e', 0).empty());
+        ASSERT_THROWS(tree.MostRelated('y', 1), runtime_error);
+
+        auto big_tree = GenerateSyntheticTree<string, 2>(2000, 10);
+        const string& someone = big_tree.GetIdByIndex(1500);
+        auto closest = big_tree.MostRelated(someone, 50);
+        ASSERT_EQUAL(closest.size(), 50u);
+        auto ancestors = big_tree.GetAncestors(someone);
+        for (size_t i = 0; i < closest.size(); ++i) {
+            ASSERT(closest[i].id != someone);
+            ASSERT(i == 0 || closest[i - 1].distance <= closest[i].distance);
+            if (ancestors.count(closest[i].id)) {
+                ASSERT(closest[i].distance <= big_tree.GetGeneration(someone) - big_tree.GetGeneration(closest[i].id));
+            }
+        }
+    }
+
+    void TestFamilyTreeRelations() {
+        using TreeT = Tree<char, 2>;
+        auto tree = TreeT::ParseFrom("a\nb\nc a b\nd\ne c d\nf c d\nk\nh c k\nm\ni e m\ng d c\nn\nj f n\nz");
+        string labels;
+        tree.SweepRelations('e', [&](size_t index, const vector<CommonAncestor>& nearest) {
+            labels += tree.GetIdByIndex(index);
+            for (const auto& [ancestor_index, up, down] : nearest) {
+                labels += " " + string(1, tree.GetIdByIndex(ancestor_index)) + to_string(up) + to_string(down);
+            }
+            labels += ";";
+        });
+        ASSERT_EQUAL(labels, "a a20;b b20;c c10;d d10;e e00;f c11 d11;k;h c11;m;i e01;g c11 d11;n;j c12 d12;z;");
+        ASSERT_THROWS(tree.SweepRelations('y', [](size_t, const auto&) {}), runtime_error);
+
+        // Brute force: breadth-first search up from every node, stopped at ancestors of the source
+        auto big_tree = GenerateSyntheticTree<string, 2>(2000, 10);
+        const string& someone = big_tree.GetIdByIndex(1500);
+        NodeSet source_ancestors = big_tree.GetAncestorSet(someone);
+        auto distances_up = [&big_tree, &source_ancestors](size_t index, bool stop_at_ancestors) {
+            map<size_t, size_t> distances = {{index, 0}};
+            vector<size_t> layer = {index};
+            for (size_t distance = 1; !layer.empty(); ++distance) {
+                vector<size_t> next_layer;
+                for (size_t layer_index : layer) {
+                    if (stop_at_ancestors && source_ancestors.Contains(layer_index)) {
+                        continue;
+                    }
+                    for (size_t parent_index : big_tree.GetParentIndices(layer_index)) {
+                        if (parent_index != TreeT::NO_INDEX && distances.emplace(parent_index, distance).second) {
+                            next_layer.push_back(parent_index);
+                        }
+                    }
+                }
+                layer = std::move(next_layer);
+            }
+            return distances;
+        };
+        auto up = distances_up(big_tree.GetIndex(someone), false);
+        size_t n_related = 0;
+        big_tree.SweepRelations(someone, [&](size_t index, const vector<CommonAncestor>& nearest) {
+            n_related += !nearest.empty();
+            if (index % 7) {
+                return;
+            }
+            vector<CommonAncestor> expected;
+            size_t min_distance = TreeT::NO_INDEX;
+            for (auto [ancestor_index, down] : distances_up(index, true)) {
+                if (!source_ancestors.Contains(ancestor_index)) {
+                    continue;
+                }
+                if (up[ancestor_index] + down < min_distance) {
+                    min_distance = up[ancestor_index] + down;
+                    expected.clear();
+                }
+                if (up[ancestor_index] + down == min_distance) {
+                    expected.push_back({ancestor_index, up[ancestor_index], down});
+                }
+            }
+            ASSERT_EQUAL(nearest.size(), expected.size());
+            for (size_t ancestor_i = 0; ancestor_i < nearest.size(); ++ancestor_i) {
+                ASSERT_EQUAL(nearest[ancestor_i].index, expected[ancestor_i].index);
+                ASSERT_EQUAL(nearest[ancestor_i].up, expected[ancestor_i].up);
+                ASSERT_EQUAL(nearest[ancestor_i].down, expected[ancestor_i].down);
+            }
+        });
+        ASSERT(n_related > source_ancestors.Count());
+    }
+
+    void TestFamilyTreeContribution() {
+        using TreeT = Tree<char, 2>;
+        auto tree = TreeT::ParseFrom("a\nb\nc a b\nd\ne c d\nf e c");
+        auto format = [](const auto& tree, const Contribution& contribution) {
+            string shares;
+            for (const auto& [founder_index, share] : contribution) {
+                shares += tree.GetIdByIndex(founder_index) + to_string(share).substr(0, 5) + " ";
+            }
+            return shares;
+        };
+        ContributionEngine engine;
+        ASSERT_EQUAL(format(tree, engine.Get(tree, tree.GetIndex('a'))), "a1.000 ");
+        // c is both a parent and a grandparent of f
+        ASSERT_EQUAL(format(tree, engine.Get(tree, tree.GetIndex('f'))), "a0.375 b0.375 d0.250 ");
+        ASSERT_EQUAL(format(tree, engine.Get(tree, tree.GetIndex('e'))), "a0.250 b0.250 d0.500 ");
+        tree.AddNode(Node<char, 2>::ParseFrom("g f d"));
+        ASSERT_EQUAL(format(tree, engine.Get(tree, tree.GetIndex('g'))), "a0.187 b0.187 d0.625 ");
+
+        auto big_tree = GenerateSyntheticTree<string, 2>(3000, 12);
+        ContributionEngine all_engine, lazy_engine;
+        all_engine.CalculateAll(big_tree, 3);
+        for (size_t index = 0; index < big_tree.GetSize(); index += 37) {
+            const auto& contribution = all_engine.Get(big_tree, index);
+            ASSERT_EQUAL(format(big_tree, lazy_engine.Get(big_tree, index)), format(big_tree, contribution));
+            double total = 0;
+            for (size_t share_i = 0; share_i < contribution.size(); ++share_i) {
+                ASSERT(share_i == 0 || contribution[share_i - 1].founder_index < contribution[share_i].founder_index);
+                ASSERT(big_tree.GetGeneration(big_tree.GetIdByIndex(contribution[share_i].founder_index)) == 0);
+                total += contribution[share_i].share;
+            }
+            ASSERT(abs(total - 1) < 1e-9);
+        }
+    }
+
+    void TestFamilyTreeQuery() {
+        using TreeT = Tree<char, 2>;
+        auto tree = TreeT::ParseFrom("a\nb\nc a b\nd\ne c d\nf c d\nk\nh c k\nm\ni e m\ng d c\nn\nj f n\nz");
+        auto run = [&tree](string_view expression) {
+            string ids;
+            Query::Compile(expression).Evaluate(tree).ForEach([&](size_t index) {
+                ids += tree.GetIdByIndex(index);
+            });
+            return ids;
+        };
+        ASSERT_EQUAL(run("ancestors(e)"), "abcde");
+        ASSERT_EQUAL(run("descendants(c)"), "cefhigj");
+        ASSERT_EQUAL(run("intersect(ancestors(e), ancestors(j))"), "abcd");
+        ASSERT_EQUAL(run("minus(intersect(ancestors(e), ancestors(j)), ancestors(c))"), "d");
+        ASSERT_EQUAL(run("parents(parents(i))"), "cd");
+        ASSERT_EQUAL(run("children(a, d)"), "cefg");
+        ASSERT_EQUAL(run("union(z, children(children(a)))"), "efhgz");
+        ASSERT_EQUAL(run("minus(all, descendants(a, b, d, k, m, n))"), "z");
+        ASSERT_EQUAL(run("intersect(generation(0), descendants(e))"), "");
+        ASSERT_EQUAL(run("generation(2, 3)"), "efhigj");
+        ASSERT_EQUAL(run("generation(3)"), "ij");
+        ASSERT_EQUAL(run("  ancestors ( e )  "), "abcde");
+
+        // Shared subexpressions are evaluated once, nested steps are fused
+        ASSERT_EQUAL(Query::Compile("union(ancestors(e), ancestors(e))").GetSteps().size(), 2u);
+        ASSERT_EQUAL(Query::Compile("intersect(ancestors(e), ancestors(f), ancestors(e))").GetSteps().size(), 5u);
+        auto fused = Query::Compile("parents(parents(parents(i)))").GetSteps();
+        ASSERT_EQUAL(fused.size(), 2u);
+        ASSERT_EQUAL(fused.back().repeat, 3u);
+        ASSERT_EQUAL(Query::Compile("ancestors(ancestors(ancestors(e)))").GetSteps().size(), 2u);
+        ASSERT_EQUAL(Query::Compile("union(a, union(b, union(c, a)))").GetSteps().size(), 4u);
+        stringstream plan;
+        Query::Compile("intersect(ancestors(e), generation(1))").Explain(plan);
+        ASSERT_EQUAL(plan.str(), "#0 node e\n#1 ancestors #0\n#2 generation 1\n#3 intersect #1 #2\n");
+
+        ASSERT_THROWS(Query::Compile("ancestors(e"), runtime_error);
+        ASSERT_THROWS(Query::Compile("ancestors(e))"), runtime_error);
+        ASSERT_THROWS(Query::Compile("cousins(e)"), runtime_error);
+        ASSERT_THROWS(Query::Compile("minus(e)"), runtime_error);
+        ASSERT_THROWS(Query::Compile("generation(x)"), runtime_error);
+        ASSERT_THROWS(Query::Compile(""), runtime_error);
+        ASSERT_THROWS(run("ancestors(y)"), runtime_error);
+    }
+
+    void TestFamilyTreeLargeInputs(size_t n_nodes) {
+        // Near-linear tree algorithms on a generated pedigree, scale budgets catch superlinear slowdowns
+        using TreeT = Tree<string, 2>;
+        auto tree = GenerateSyntheticTree<string, 2>(n_nodes, 20);
+        mt19937 random(n_nodes);
+        for (size_t query = 0; query < 20; ++query) {
+            const string& lhs = tree.GetIdByIndex(random() % n_nodes);
+            const string& rhs = tree.GetIdByIndex(random() % n_nodes);
+            auto lhs_ancestors = tree.GetAncestorSet(lhs);
+            auto rhs_ancestors = tree.GetAncestorSet(rhs);
+            for (const string& common_ancestor : tree.LowestCommonAncestors(lhs, rhs)) {
+                size_t index = tree.GetIndex(common_ancestor);
+                ASSERT(lhs_ancestors.Contains(index) && rhs_ancestors.Contains(index));
+            }
+        }
+
+        auto nodes = tree.GetNodes();
+        TreeT first_half(nodes.begin(), nodes.begin() + n_nodes / 2);
+        ASSERT_EQUAL(TreeT::Merge(first_half, tree), tree);
+        ASSERT_EQUAL(TreeT::Merge(tree, tree.ExtractAncestry({tree.GetIdByIndex(n_nodes - 1)})), tree);
+        ASSERT_EQUAL(Diff(first_half, tree).added_nodes.size(), n_nodes - n_nodes / 2);
+        ASSERT_EQUAL(Query::Compile("minus(all, generation(0))").Evaluate(tree).Count(),
+                     n_nodes - tree.NodeIndicesInGeneration(0).size());
+        size_t n_related = 0;
+        tree.SweepRelations(tree.GetIdByIndex(n_nodes / 2), [&n_related](size_t, const auto& nearest) {
+            n_related += !nearest.empty();
+        });
+        ASSERT(n_related > 1);
+
+        auto compacted = tree;
+        compacted.Compact();
+        ASSERT_EQUAL(compacted, tree);
+        compacted.SetParents(compacted.GetIdByIndex(n_nodes / 3), {});
+        ASSERT_EQUAL(compacted.RemoveNode(compacted.GetIdByIndex(0), RemovalPolicy::Orphan), 1u);
+    }
+
     void TestFamilyTreeMerge() {
         {
             using TreeT = Tree<int, 2>;
@@ -242,15 +1413,126 @@ Aboba
 Bingus)");
             ASSERT_THROWS(TreeT::Merge(tree1, tree3), runtime_error);
         }
+        {
+            using TreeT = Tree<char, 2>;
+            auto tree1 = TreeT::ParseFrom(R"(A
+B
+C
+D A B
+E D C
+G)");
+            auto tree2 = TreeT::ParseFrom(R"(A
+B
+C
+X
+D A X
+F D C
+G X B)");
+            ASSERT_EQUAL(TreeT::FindConflicts(tree1, tree2).size(), 2u);
+            ASSERT_THROWS(TreeT::Merge(tree1, tree2), runtime_error);
+            auto collected = TreeT::Merge(tree1, tree2, MergePolicy::CollectConflicts);
+            ASSERT_EQUAL(collected.tree.GetSize(), 0u);
+            ASSERT_EQUAL(collected.conflicts.size(), 2u);
+            ASSERT_EQUAL(collected.conflicts[0].lhs_version, (Node<char, 2>::ParseFrom("D A B")));
+            ASSERT_EQUAL(collected.conflicts[0].rhs_version, (Node<char, 2>::ParseFrom("D A X")));
+            auto left = TreeT::Merge(tree1, tree2, MergePolicy::PreferLeft);
+            ASSERT_EQUAL(left.conflicts.size(), 2u);
+            ASSERT_EQUAL(left.tree, TreeT::ParseFrom(R"(A
+B
+C
+D A B
+E D C
+G
+X
+F D C)"));
+            auto right = TreeT::Merge(tree1, tree2, MergePolicy::PreferRight);
+            ASSERT_EQUAL(right.tree, TreeT::ParseFrom(R"(A
+B
+C
+X
+D A X
+E D C
+G X B
+F D C)"));
+            auto skipped = TreeT::Merge(tree1, tree2, MergePolicy::SkipConflicts);
+            ASSERT_EQUAL(skipped.tree, TreeT::ParseFrom(R"(A
+B
+C
+X)"));
+        }
+        {
+            using TreeT = Tree<char, 2>;
+            auto tree1 = TreeT::ParseFrom(R"(@ column born integer
+@ column place string
+A | born=1500 place=Ghent
+B | place=Madrid
+C A B | born=1530)");
+            auto tree2 = TreeT::ParseFrom(R"(@ column place string
+@ column sex enum M F
+B | place=Vienna
+A | place=Toledo sex=M
+C B A
+D A B | place=Vienna sex=F
+E | place=Lisbon)");
+            auto merged = TreeT::Merge(tree1, tree2);
+            const auto& attributes = merged.GetAttributes();
+            ASSERT_EQUAL(attributes.GetColumnCount(), 3u);
+            ASSERT_EQUAL(*attributes.Get(merged.GetIndex('A'), "place"), "Ghent");
+            ASSERT(!attributes.Get(merged.GetIndex('A'), "sex"));
+            ASSERT_EQUAL(*attributes.Get(merged.GetIndex('C'), "born"), "1530");
+            ASSERT_EQUAL(*attributes.Get(merged.GetIndex('D'), "place"), "Vienna");
+            ASSERT_EQUAL(*attributes.Get(merged.GetIndex('D'), "sex"), "F");
+            ASSERT_EQUAL(*attributes.Get(merged.GetIndex('E'), "place"), "Lisbon");
+            ASSERT(!attributes.Get(merged.GetIndex('E'), "born"));
+            ASSERT_EQUAL(attributes.FilterEqual("place", "Vienna").ToIndices(), vector<size_t>{merged.GetIndex('D')});
+
+            auto right = TreeT::Merge(tree1, tree2, MergePolicy::PreferRight);
+            ASSERT_EQUAL(*right.tree.GetAttributes().Get(right.tree.GetIndex('A'), "place"), "Ghent");
+            ASSERT_EQUAL(*right.tree.GetAttributes().Get(right.tree.GetIndex('D'), "sex"), "F");
+            auto conflicting = TreeT::ParseFrom("@ column place string\nX\nY\nA X Y | place=Toledo");
+            auto preferred = TreeT::Merge(tree1, conflicting, MergePolicy::PreferRight);
+            ASSERT_EQUAL(preferred.conflicts.size(), 1u);
+            ASSERT_EQUAL(*preferred.tree.GetAttributes().Get(preferred.tree.GetIndex('A'), "place"), "Toledo");
+            ASSERT(!preferred.tree.GetAttributes().Get(preferred.tree.GetIndex('A'), "born"));
+            ASSERT_EQUAL(*preferred.tree.GetAttributes().Get(preferred.tree.GetIndex('C'), "born"), "1530");
+
+            auto mistyped = TreeT::ParseFrom("@ column born string\nF | born=early");
+            ASSERT_THROWS(TreeT::Merge(tree1, mistyped), runtime_error);
+            ASSERT_THROWS(TreeT::Merge(tree1, mistyped, MergePolicy::PreferLeft), runtime_error);
+        }
     }
 }
 
 
-void TestAll() {
-    TestRunner tr;
+void TestAll(bool with_large_inputs, size_t n_threads) {
+    TestRunner tr(n_threads ? n_threads : thread::hardware_concurrency());
     RUN_TEST(tr, TestFamilyTreeNode);
     RUN_TEST(tr, TestFamilyTreeCreation);
     RUN_TEST(tr, TestFamilyTreeGetters);
     RUN_TEST(tr, TestFamilyTreeAncestorFunctional);
+    RUN_TEST(tr, TestFamilyTreeGenerations);
+    RUN_TEST(tr, TestFamilyTreeTruncate);
+    RUN_TEST(tr, TestFamilyTreeEditing);
+    RUN_TEST(tr, TestFamilyTreeCompact);
+    RUN_TEST(tr, TestFamilyTreeExtraction);
+    RUN_TEST(tr, TestFamilyTreeRender);
+    RUN_TEST(tr, TestFamilyTreeRenderFlat);
+    RUN_TEST(tr, TestFamilyTreeRenderBundled);
+    RUN_TEST(tr, TestFamilyTreeRenderLod);
+    RUN_TEST(tr, TestFamilyTreeExport);
+    RUN_TEST(tr, TestFamilyTreeAttributes);
+    RUN_TEST(tr, TestFamilyTreePedigreeCollapse);
+    RUN_TEST(tr, TestFamilyTreeMostRelated);
+    RUN_TEST(tr, TestFamilyTreeQuery);
+    RUN_TEST(tr, TestFamilyTreeRelations);
+    RUN_TEST(tr, TestFamilyTreeContribution);
     RUN_TEST(tr, TestFamilyTreeMerge);
+    RUN_TEST(tr, TestFamilyTreeJournal);
+    RUN_TEST(tr, TestFamilyTreeBatch);
+    RUN_TEST(tr, TestFamilyTreeServer);
+    RUN_TEST(tr, TestFamilyTreeUndo);
+    RUN_TEST(tr, TestFamilyTreeDiff);
+    if (with_large_inputs) {
+        RUN_SCALED_TEST(tr, TestFamilyTreeLargeInputs, {2'000, 1'000}, {20'000, 5'000}, {200'000, 60'000});
+    }
 }
@@ -1,3 +1,7 @@
 #pragma once
 
-void TestAll();
+#include <cstddef>
+
+void TestAll(bool with_large_inputs = false, size_t n_threads = 0);
+// Independent tests run on n_threads workers (0 - hardware concurrency), large-input tests with time budgets
+// take tens of seconds and run only on request
@@ -1,8 +1,13 @@
 #pragma once
 
 #include "Libs/svg/svg.h"
+#include "Libs/profiler/profiler.h"
+#include "attributes.h"
+#include "id_traits.h"
 #include "utils.h"
 
+#include <map>
+#include <set>
 #include <unordered_map>
 #include <unordered_set>
 #include <string>
@@ -10,12 +15,18 @@
 #include <vector>
 #include <iostream>
 #include <array>
+#include <atomic>
 #include <queue>
 #include <random>
 #include <ctime>
 #include <algorithm>
 #include <fstream>
 #include <sstream>
+#include <limits>
+#include <numeric>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 
 namespace FamilyTree {
@@ -36,6 +47,9 @@ namespace FamilyTree {
 
         std::vector<NodeId> GetParents() const;
         static Node ParseFrom(const std::string& input);
+
+        uint64_t Hash() const;
+        // Depends on id and parent ids but not on parents order
     };
 
     template<typename NodeId, size_t NParents>
@@ -51,15 +65,139 @@ namespace FamilyTree {
                               const Node<NodeId, NParents>& node);
 
 
+    template<typename NodeId, size_t NParents>
+    struct NodeConflict {
+        Node<NodeId, NParents> lhs_version, rhs_version;
+        // Same id, different parents
+    };
+
+    template<typename NodeId, size_t NParents>
+    struct TreeSuffix {
+        // Tree from birth position first_index and attribute column first_column on. Versions sharing
+        // everything before differ only by their suffixes, so a suffix is enough to switch between them
+        size_t first_index = 0;
+        std::vector<Node<NodeId, NParents>> nodes = {};
+        std::vector<std::string> rows = {};
+        // Attribute assignments of nodes, as in node lines of the text format
+        size_t first_column = 0;
+        std::string schema = {};
+        // Schema lines of columns from first_column on
+    };
+
+    enum class MergePolicy {
+        PreferLeft,  // conflicting node keeps lhs parents
+        PreferRight,  // conflicting node takes rhs parents
+        SkipConflicts,  // conflicting nodes and all their descendants are left out
+        CollectConflicts,  // dry run: nothing is merged, only conflicts are reported
+    };
+
+    enum class RemovalPolicy {
+        RejectParents,  // node with children is not removed
+        Cascade,  // all descendants are removed with node
+        Orphan,  // children of node become founders
+    };
+
+    template<typename NodeId, size_t NParents>
+    struct MergeResult;
+
+    template<typename NodeId>
+    struct Relative {
+        NodeId id;
+        size_t distance;
+        // Generations up to the closest common ancestor plus generations down from it
+        double paths;
+        // Number of such shortest up-then-down paths: full siblings have 2, half siblings 1
+    };
+
+    struct CommonAncestor {
+        size_t index;
+        size_t up;
+        // Generations from the source node up to the ancestor
+        size_t down;
+        // Generations from the ancestor down to the labelled node
+    };
+
+    struct PedigreeCollapse {
+        std::vector<size_t> distinct_ancestors;
+        // [k] - distinct ancestors exactly k generations above the node, [0] is the node itself
+        std::vector<double> ancestor_slots;
+        // [k] - known ancestors k generations above counted once per path, NParents^k for a complete
+        // pedigree without collapse; founders end their paths, so unknown ancestors don't count as collapse
+
+        double GetCollapseRatio(size_t generation) const {
+            // Share of slots of generation filled by ancestors repeated in it
+            if (generation >= distinct_ancestors.size()) {
+                return 0;
+            }
+            return 1 - distinct_ancestors[generation] / ancestor_slots[generation];
+        }
+        double GetCollapseRatio() const {
+            // Over all generations above the node
+            double distinct_sum = 0, slots_sum = 0;
+            for (size_t generation = 1; generation < distinct_ancestors.size(); ++generation) {
+                distinct_sum += distinct_ancestors[generation];
+                slots_sum += ancestor_slots[generation];
+            }
+            return slots_sum > 0 ? 1 - distinct_sum / slots_sum : 0;
+        }
+    };
+
+
     template<typename NodeId, size_t NParents>
     class Tree {
     public: using Node = Node<NodeId, NParents>;
+        using IdView = typename IdTraits<NodeId>::View;
+        // Lookups take IdView: Tree<std::string, N> is queried by std::string_view without allocations
     private:
-        std::unordered_map<NodeId, Node> nodes_;
+        using IdHash = typename IdTraits<NodeId>::Hash;
+        using IdEqual = typename IdTraits<NodeId>::KeyEqual;
+
+        std::unordered_map<NodeId, Node, IdHash, IdEqual> nodes_;
         std::vector<NodeId> birth_order_;
 
-        static std::string MakeString(const NodeId &node_id);
-        // Returns string made from node_id using operator <<(ostream& NodeId)
+        // Generation index, flat arrays indexed by position in birth_order_
+        std::unordered_map<NodeId, size_t, IdHash, IdEqual> birth_index_;
+        std::vector<std::array<size_t, NParents>> parent_indices_;
+        // Founders have NO_INDEX parents
+        std::vector<std::vector<size_t>> children_indices_;
+        // In birth order
+        std::vector<size_t> depth_;
+        // Distance from the farthest founder, never changes after AddNode
+        std::vector<size_t> height_;
+        // Distance to the farthest descendant, grows on AddNode
+        std::vector<std::vector<size_t>> generations_;
+        // Node indices grouped by depth, in birth order
+
+        uint64_t content_hash_ = 0;
+        // Sum of mixed node hashes: independent of birth order, updated on AddNode
+        AttributeStore attributes_;
+        // One row per node in birth order, not a part of tree equality and content hash
+
+        void UpdateHeights(size_t new_index);
+        void AddNodeUnchecked(const Node &new_node);
+        // AddNode without id and parents validation
+        void ReplaceSuffix(size_t first_index, const std::vector<Node> &nodes, const std::vector<size_t> &rows);
+        // Nodes from birth position first_index are replaced with nodes, node i keeps attributes of row rows[i].
+        // Nodes must be in valid birth order, only the suffix is reindexed
+        template<typename NeighboursFunc>
+        std::vector<size_t> CollectWithinDepth(const std::vector<NodeId> &roots, size_t max_depth,
+                                               NeighboursFunc neighbours) const;
+        // Ascending indices of roots and nodes reachable from them by at most max_depth
+        // steps to neighbours(index) (parents or children)
+        template<typename IndexIt>
+        Tree ExtractIndices(IndexIt index_begin, IndexIt index_end) const;
+        // Tree of nodes with given ascending indices, nodes with excluded parents become founders
+        struct AncestorLevelScratch {
+            std::vector<uint64_t> marks;
+            // Node was reached in the level with this epoch
+            std::vector<double> slots;
+            uint64_t epoch = 0;
+        };
+        PedigreeCollapse CalculatePedigreeCollapse(size_t index, AncestorLevelScratch &scratch) const;
+        // Level by level walk up from node, scratch is reused between nodes to avoid clearing O(size) arrays
+
+        static std::string MakeString(IdView node_id);
+        // Returns string made from node_id using IdTraits<NodeId>::Format
 
     public:
         Tree() = default;
@@ -68,23 +206,103 @@ namespace FamilyTree {
         static Tree ParseFrom(const std::string& input);
 
         size_t GetSize() const { return nodes_.size(); }
+        uint64_t GetContentHash() const { return content_hash_; }
+        // Equal trees have equal content hashes
 
         Tree &AddNode(const Node &new_node);
         // TODO: add node by rvalue
         // TODO: node emplacement
-
-        const Node *GetNode(const NodeId &node_id) const;
+        void TruncateTo(size_t size);
+        // Removes nodes from birth position size on, tree becomes equal to the one before their AddNode calls.
+        // Work is proportional to removed nodes and their ancestors whose heights drop
+        size_t RemoveNode(IdView node_id, RemovalPolicy policy = RemovalPolicy::RejectParents);
+        // Returns number of removed nodes
+        void SetParents(IdView node_id, const std::vector<NodeId> &parent_ids);
+        // No parent_ids - node becomes a founder. Throws if the edit would make node its own ancestor.
+        // If a new parent was born after node, node and its descendants born before that parent move after it.
+        // Both edits rebuild indices only from birth position of node on
+        TreeSuffix<NodeId, NParents> GetSuffix(size_t first_index, size_t first_column) const;
+        TreeSuffix<NodeId, NParents> SwapSuffix(TreeSuffix<NodeId, NParents> suffix);
+        // Replaces own suffix with suffix of a version having the same nodes before suffix.first_index
+        // and the same columns before suffix.first_column, returns the replaced suffix
+        void Compact();
+        // Reorders nodes for memory locality of ancestor walks: generation by generation, and inside a generation
+        // by breadth-first (Cuthill-McKee) rank, so close relatives get close positions whatever order nodes
+        // were added in. Storage is rebuilt in that order into freshly reserved maps and arrays.
+        // Birth order changes, node and attribute contents don't
+
+        AttributeStore &GetAttributes() { return attributes_; }
+        const AttributeStore &GetAttributes() const { return attributes_; }
+        // Columns may be added and values set freely, rows follow nodes
+        void SetAttribute(IdView node_id, std::string_view column, std::string_view value);
+
+        const Node *GetNode(IdView node_id) const;
         // nullptr - node with id node_id not found
 
         std::vector<Node> GetNodes() const;
         // Returning nodes in birth order
 
-        std::unordered_set<NodeId> GetAncestors(const NodeId &node) const;
-        std::unordered_set<NodeId> LowestCommonAncestors(const NodeId &node1, const NodeId &node2) const;
+        static constexpr size_t NO_INDEX = std::numeric_limits<size_t>::max();
+
+        size_t GetIndex(IdView node_id) const;
+        // Position of node in birth order, NO_INDEX - node with id node_id not found
+        const NodeId &GetIdByIndex(size_t index) const { return birth_order_[index]; }
+
+        size_t GetGeneration(IdView node_id) const;
+        // Depth from founders: founders are generation 0, child is one generation below its deepest parent
+        size_t GetHeight(IdView node_id) const;
+        // Distance to the youngest descendant: childless nodes have height 0
+        size_t GetGenerationCount() const { return generations_.size(); }
+        const std::vector<size_t> &NodeIndicesInGeneration(size_t generation) const;
+        std::vector<NodeId> NodesInGeneration(size_t generation) const;
+        // Nodes of given generation in birth order, empty if there is no such generation
+
+        const std::array<size_t, NParents> &GetParentIndices(size_t index) const { return parent_indices_[index]; }
+        const std::vector<size_t> &GetChildrenIndices(size_t index) const { return children_indices_[index]; }
+
+        std::unordered_set<NodeId> GetAncestors(IdView node) const;
+        NodeSet GetAncestorSet(IdView node) const;
+        // Same ancestors as indices, ready to be combined with attribute filters.
+        // Set spans the whole tree, GetAncestors and LowestCommonAncestors only touch the ancestors
+
+        std::vector<Relative<NodeId>> MostRelated(IdView node, size_t k) const;
+        // At most k closest blood relatives (ancestors, descendants and descendants of ancestors) ordered by
+        // distance, then by number of paths, then by birth order. Explores outward one distance at a time
+        // and stops after the distance where k relatives are found
+
+        PedigreeCollapse GetPedigreeCollapse(IdView node) const;
+        std::vector<PedigreeCollapse> GetPedigreeCollapseAll(size_t n_threads = 0) const;
+        // For every node in birth order, nodes are spread between n_threads workers (0 - hardware concurrency)
+        std::unordered_set<NodeId> LowestCommonAncestors(IdView node1, IdView node2) const;
         // Return common ancestors (node is an ancestor of itself)
         // that doesn't have common ancestors (for node1 and node2) in offspring
+        template<typename Consumer>
+        void SweepRelations(IdView node, Consumer consume) const;
+        // Relation of node to everyone: calls consume(index, nearest) for every index in birth order. nearest are
+        // common ancestors reached from index going up through non-ancestors of node only (an ancestor of node is
+        // its own nearest, node itself has up 0), the ones with the least up + down, sorted by index; empty
+        // for nodes not related to node. One ancestor marking of node and one pass over birth order, labels are
+        // consumed as soon as they are ready, so results of large trees can be streamed
+
+        static std::vector<NodeConflict<NodeId, NParents>> FindConflicts(const Tree &lhs, const Tree &rhs);
+        // Nodes present in both trees with different parents, in lhs birth order
+        static constexpr size_t UNLIMITED_DEPTH = std::numeric_limits<size_t>::max();
+
+        Tree ExtractAncestry(const std::vector<NodeId> &roots, size_t max_depth = UNLIMITED_DEPTH) const;
+        // Roots with their ancestors at most max_depth generations above
+        Tree ExtractDescendants(const std::vector<NodeId> &roots, size_t max_depth = UNLIMITED_DEPTH) const;
+        // Roots with their descendants at most max_depth generations below
+        template<typename Predicate>
+        Tree ExtractInducedSubtree(Predicate predicate) const;
+        // Nodes satisfying predicate(const Node &)
+        // All extractions keep birth order, nodes whose parents are excluded become founders
 
         static Tree Merge(const Tree &lhs, const Tree &rhs);
+        // Throws if trees have conflicting nodes, lhs nodes go first in resulting birth order.
+        // Resulting attributes have columns of both trees (a column of both must have the same type),
+        // every node keeps attribute values of the version it was taken from, lhs one for nodes of both trees
+        static MergeResult<NodeId, NParents> Merge(const Tree &lhs, const Tree &rhs, MergePolicy policy);
+        // Scans all conflicts up front and resolves them with policy instead of throwing
 
         // Rendering constants
         static const size_t RENDER_WIDTH = 1500;
@@ -98,12 +316,50 @@ namespace FamilyTree {
         template<typename ColorIt>
         static Svg::Color InheritColor(ColorIt color_begin, ColorIt color_end);
 
-        std::unordered_map<NodeId, Svg::Color> CalculateColors() const;
-        std::vector<std::vector<NodeId>> DistributeNodesInLevels() const;
-        std::unordered_map<NodeId, Svg::Point> CalculatePositions() const;
+        std::vector<Svg::Color> CalculateColors() const;
+        std::vector<std::vector<size_t>> DistributeNodesInLevels() const;
+        std::vector<Svg::Point> CalculatePositions() const;
+        // Rendering data is indexed by birth position
+
+        template<typename ObjectConsumer>
+        void RenderNode(size_t index, const std::vector<Svg::Color> &colors,
+                        const std::vector<Svg::Point> &positions, ObjectConsumer consume) const;
+        // Passes svg objects of node (edges from parents, circle and label) to consume
 
     public:
         Svg::Document RenderSvg() const;
+        void RenderSvgParallel(std::ostream &output, size_t n_threads = 0) const;
+        // Writes the same document as RenderSvg().Render(output), but node chunks are serialized
+        // by n_threads workers (0 - hardware concurrency) into string buffers written in order
+        static constexpr double LABEL_CHAR_WIDTH = 0.6;
+        // Estimated width of a label character in font sizes
+        static constexpr double MAX_LOD_ZOOM = 1e4;
+        // Label grid cells shrink with zoom, cell indices of layout coordinates must stay in int32
+
+        Svg::Document RenderLodSvg(double zoom = 1, size_t n_detail_levels = 4) const;
+        // Level of detail rendering for a viewer showing the layout zoom times larger (zoom 2 - 3000px wide).
+        // Level l labels are sized for zoom * 2^l and go to group "lod<l>" nested into "lod<l-1>",
+        // a label is placed at the coarsest level where it overlaps no placed label; runs of unlabeled
+        // nodes of a generation get "+N" cluster labels at the finest level. Circles shrink to fit rows
+        Svg::Document RenderBundledSvg() const;
+        // Draws every union (children sharing the same parents) as one path: a bar halfway between
+        // parents and children joined by vertical legs, instead of NParents lines per child
+        Svg::FlatDocument RenderFlatSvg() const;
+        // Same picture as RenderSvg with colors rounded to 16 levels per channel, but shapes are stored by value
+        // and styles are shared by nodes of one color, so the document is cheaper to build and smaller to write
+        void ExportLayoutJson(std::ostream &output) const;
+        // Rendered layout (node positions and colors, edges from parents) for external viewers:
+        // {"width", "height", "radius", "nodes": [{"id", "x", "y", "color"}], "edges": [[parent, child]]}
+        // with nodes in birth order and edges as their indices
+        void ExportLayoutDot(std::ostream &output) const;
+        // Same layout as a Graphviz digraph, nodes carry pinned "pos" attributes and their colors
+    };
+
+    template<typename NodeId, size_t NParents>
+    struct MergeResult {
+        Tree<NodeId, NParents> tree = {};
+        std::vector<NodeConflict<NodeId, NParents>> conflicts = {};
+        // Every conflict found, whatever the policy did with it
     };
 
     template<typename NodeId, size_t NParents>
@@ -167,24 +423,49 @@ namespace FamilyTree {
         if (input.empty()) {
             throw std::runtime_error("Can't parse Node from empty input");
         }
-        std::stringstream input_stream(input);
-        NodeId node_id;
-        input_stream >> node_id;
+        std::string_view rest = input;
+        auto next_token = [&rest]() {
+            size_t token_begin = std::min(rest.find_first_not_of(" \t\r\n"), rest.size());
+            size_t token_end = std::min(rest.find_first_of(" \t\r\n", token_begin), rest.size());
+            std::string_view token = rest.substr(token_begin, token_end - token_begin);
+            rest.remove_prefix(token_end);
+            return token;
+        };
+        std::string_view id_token = next_token();
+        if (id_token.empty()) {
+            throw std::runtime_error("Can't parse Node from empty input");
+        }
+        NodeId node_id = IdTraits<NodeId>::Parse(id_token);
         std::vector<NodeId> parent_ids;
-        for (NodeId parent_id; input_stream >> parent_id; ) {
-            parent_ids.push_back(std::move(parent_id));
+        for (std::string_view token = next_token(); !token.empty(); token = next_token()) {
+            parent_ids.push_back(IdTraits<NodeId>::Parse(token));
         }
         return Node<NodeId, NParents>(node_id, parent_ids.begin(), parent_ids.end());
     }
 
 
+    template<typename NodeId, size_t NParents>
+    uint64_t Node<NodeId, NParents>::Hash() const {
+        typename IdTraits<NodeId>::Hash hasher;
+        uint64_t parents_hash = 0;
+        if (parent_ids) {
+            for (const NodeId &parent_id : *parent_ids) {
+                parents_hash += MixHash(hasher(parent_id));
+            }
+        }
+        return MixHash(MixHash(hasher(id)) ^ parents_hash);
+    }
+
+
     template<typename NodeId, size_t NParents>
     bool operator ==(const Node<NodeId, NParents>& lhs,
                      const Node<NodeId, NParents>& rhs) {
-        auto l_parents = lhs.GetParents();
-        auto r_parents = rhs.GetParents();
-        return lhs.id == rhs.id && std::unordered_set(l_parents.begin(), l_parents.end())
-                                == std::unordered_set(r_parents.begin(), r_parents.end());
+        if (lhs.id != rhs.id || lhs.parent_ids.has_value() != rhs.parent_ids.has_value()) {
+            return false;
+        }
+        // Parents are compared as multisets right in the fixed-size arrays, without allocations
+        return !lhs.parent_ids || std::is_permutation(lhs.parent_ids->begin(), lhs.parent_ids->end(),
+                                                      rhs.parent_ids->begin());
     }
 
 
@@ -198,21 +479,25 @@ namespace FamilyTree {
     template<typename NodeId, size_t NParents>
     std::ostream& operator <<(std::ostream& output,
                               const Node<NodeId, NParents>& node) {
-        output << node.id;
-        for (const NodeId& parent_id : node.GetParents()) {
-            output << " " << parent_id;
+        std::string line;
+        IdTraits<NodeId>::Format(line, node.id);
+        if (node.parent_ids) {
+            for (const NodeId& parent_id : *node.parent_ids) {
+                line += ' ';
+                IdTraits<NodeId>::Format(line, parent_id);
+            }
         }
-        return output;
+        return output << line;
     }
 }
 
 // Tree
 namespace FamilyTree {
     template<typename NodeId, size_t NParents>
-    std::string Tree<NodeId, NParents>::MakeString(const NodeId &node_id) {
-        std::stringstream ss;
-        ss << node_id;
-        return ss.str();
+    std::string Tree<NodeId, NParents>::MakeString(IdView node_id) {
+        std::string result;
+        IdTraits<NodeId>::Format(result, node_id);
+        return result;
     }
 
 
@@ -235,15 +520,378 @@ namespace FamilyTree {
                 throw std::runtime_error("Unknown parent id");
             }
         }
+        AddNodeUnchecked(new_node);
+        return *this;
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    void Tree<NodeId, NParents>::AddNodeUnchecked(const Node &new_node) {
+        size_t new_index = birth_order_.size();
+        std::array<size_t, NParents> parent_indices;
+        parent_indices.fill(NO_INDEX);
+        size_t new_depth = 0;
+        if (new_node.parent_ids) {
+            for (size_t parent_i = 0; parent_i < NParents; ++parent_i) {
+                parent_indices[parent_i] = birth_index_.at((*new_node.parent_ids)[parent_i]);
+                new_depth = std::max(new_depth, depth_[parent_indices[parent_i]] + 1);
+            }
+        }
         nodes_.emplace(new_node.id, new_node);
         birth_order_.push_back(new_node.id);
-        return *this;
+        birth_index_.emplace(new_node.id, new_index);
+        parent_indices_.push_back(parent_indices);
+        children_indices_.emplace_back();
+        for (size_t parent_index : parent_indices) {
+            if (parent_index != NO_INDEX && (children_indices_[parent_index].empty()
+                                             || children_indices_[parent_index].back() != new_index)) {
+                children_indices_[parent_index].push_back(new_index);
+            }
+        }
+        depth_.push_back(new_depth);
+        height_.push_back(0);
+        if (new_depth >= generations_.size()) {
+            generations_.emplace_back();
+        }
+        generations_[new_depth].push_back(new_index);
+        UpdateHeights(new_index);
+        content_hash_ += MixHash(new_node.Hash());
+        attributes_.Resize(birth_order_.size());
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    void Tree<NodeId, NParents>::SetAttribute(IdView node_id, std::string_view column, std::string_view value) {
+        size_t index = GetIndex(node_id);
+        if (index == NO_INDEX) {
+            throw std::runtime_error("Unknown node id " + MakeString(node_id));
+        }
+        attributes_.Set(index, column, value);
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    void Tree<NodeId, NParents>::TruncateTo(size_t size) {
+        if (size >= birth_order_.size()) {
+            return;
+        }
+        std::set<size_t, std::greater<>> affected;
+        // Kept parents of removed nodes and, transitively, nodes whose height changed; children go first
+        for (size_t index = size; index < birth_order_.size(); ++index) {
+            for (size_t parent_index : parent_indices_[index]) {
+                if (parent_index != NO_INDEX && parent_index < size) {
+                    affected.insert(parent_index);
+                    std::vector<size_t> &children = children_indices_[parent_index];
+                    while (!children.empty() && children.back() >= size) {
+                        children.pop_back();
+                    }
+                }
+            }
+            content_hash_ -= MixHash(nodes_.at(birth_order_[index]).Hash());
+            birth_index_.erase(birth_order_[index]);
+            nodes_.erase(birth_order_[index]);
+        }
+        birth_order_.resize(size);
+        parent_indices_.resize(size);
+        children_indices_.resize(size);
+        depth_.resize(size);
+        height_.resize(size);
+        for (std::vector<size_t> &generation : generations_) {
+            while (!generation.empty() && generation.back() >= size) {
+                generation.pop_back();
+            }
+        }
+        while (!generations_.empty() && generations_.back().empty()) {
+            generations_.pop_back();
+        }
+        while (!affected.empty()) {
+            size_t index = *affected.begin();
+            affected.erase(affected.begin());
+            size_t new_height = 0;
+            for (size_t child_index : children_indices_[index]) {
+                new_height = std::max(new_height, height_[child_index] + 1);
+            }
+            if (new_height != height_[index]) {
+                height_[index] = new_height;
+                for (size_t parent_index : parent_indices_[index]) {
+                    if (parent_index != NO_INDEX) {
+                        affected.insert(parent_index);
+                    }
+                }
+            }
+        }
+        attributes_.Resize(size);
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    void Tree<NodeId, NParents>::ReplaceSuffix(size_t first_index, const std::vector<Node> &nodes,
+                                               const std::vector<size_t> &rows) {
+        AttributeStore suffix_attributes = attributes_.SelectRows(rows);
+        TruncateTo(first_index);
+        for (const Node &node : nodes) {
+            AddNodeUnchecked(node);
+        }
+        attributes_.AssignRows(first_index, suffix_attributes);
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    TreeSuffix<NodeId, NParents> Tree<NodeId, NParents>::GetSuffix(size_t first_index, size_t first_column) const {
+        TreeSuffix<NodeId, NParents> suffix{.first_index = first_index, .first_column = first_column};
+        for (size_t index = first_index; index < GetSize(); ++index) {
+            suffix.nodes.push_back(nodes_.at(birth_order_[index]));
+            std::string &row = suffix.rows.emplace_back();
+            attributes_.FormatRow(row, index);
+            row.erase(0, std::min(row.size(), AttributeStore::ROW_SEPARATOR.size()));
+        }
+        std::stringstream schema;
+        attributes_.WriteSchema(schema, first_column);
+        suffix.schema = schema.str();
+        return suffix;
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    TreeSuffix<NodeId, NParents> Tree<NodeId, NParents>::SwapSuffix(TreeSuffix<NodeId, NParents> suffix) {
+        TreeSuffix<NodeId, NParents> replaced = GetSuffix(suffix.first_index, suffix.first_column);
+        TruncateTo(suffix.first_index);
+        attributes_.TruncateColumns(suffix.first_column);
+        std::stringstream schema(suffix.schema);
+        for (std::string line; std::getline(schema, line);) {
+            attributes_.ParseSchemaLine(line);
+        }
+        for (size_t node_i = 0; node_i < suffix.nodes.size(); ++node_i) {
+            AddNodeUnchecked(suffix.nodes[node_i]);
+            attributes_.ParseRow(GetSize() - 1, suffix.rows[node_i]);
+        }
+        return replaced;
     }
 
 
     template<typename NodeId, size_t NParents>
-    const Node<NodeId, NParents> *Tree<NodeId, NParents>::GetNode(
-            const NodeId &node_id) const {
+    size_t Tree<NodeId, NParents>::RemoveNode(IdView node_id, RemovalPolicy policy) {
+        size_t index = GetIndex(node_id);
+        if (index == NO_INDEX) {
+            throw std::runtime_error("Unknown node id " + MakeString(node_id));
+        }
+        if (policy == RemovalPolicy::RejectParents && !children_indices_[index].empty()) {
+            throw std::runtime_error("Node " + MakeString(node_id) + " has children");
+        }
+        std::vector<bool> removed(birth_order_.size() - index);
+        removed[0] = true;
+        std::vector<Node> nodes;
+        std::vector<size_t> rows;
+        for (size_t suffix_index = index + 1; suffix_index < birth_order_.size(); ++suffix_index) {
+            bool removed_parent = false;
+            for (size_t parent_index : parent_indices_[suffix_index]) {
+                removed_parent |= parent_index != NO_INDEX && parent_index >= index && removed[parent_index - index];
+            }
+            if (removed_parent && policy == RemovalPolicy::Cascade) {
+                removed[suffix_index - index] = true;
+                continue;
+            }
+            nodes.push_back(nodes_.at(birth_order_[suffix_index]));
+            if (removed_parent) {
+                nodes.back().parent_ids.reset();
+            }
+            rows.push_back(suffix_index);
+        }
+        size_t n_removed = birth_order_.size() - index - nodes.size();
+        ReplaceSuffix(index, nodes, rows);
+        return n_removed;
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    void Tree<NodeId, NParents>::SetParents(IdView node_id, const std::vector<NodeId> &parent_ids) {
+        size_t index = GetIndex(node_id);
+        if (index == NO_INDEX) {
+            throw std::runtime_error("Unknown node id " + MakeString(node_id));
+        }
+        Node new_node(birth_order_[index], parent_ids.begin(), parent_ids.end());
+        size_t last_parent_index = 0;
+        for (const NodeId &parent_id : parent_ids) {
+            size_t parent_index = GetIndex(parent_id);
+            if (parent_index == NO_INDEX) {
+                throw std::runtime_error("Unknown parent id " + MakeString(parent_id));
+            }
+            last_parent_index = std::max(last_parent_index, parent_index);
+        }
+        // Descendants of node born up to the last new parent have to move after it.
+        // Descendants are born after node, so the search never leaves [index, last_parent_index]
+        std::vector<bool> moved(!parent_ids.empty() && index <= last_parent_index ? last_parent_index - index + 1 : 0);
+        if (!moved.empty()) {
+            moved[0] = true;
+            for (size_t suffix_index = index; suffix_index <= last_parent_index; ++suffix_index) {
+                if (!moved[suffix_index - index]) {
+                    continue;
+                }
+                for (size_t child_index : children_indices_[suffix_index]) {
+                    if (child_index <= last_parent_index) {
+                        moved[child_index - index] = true;
+                    }
+                }
+            }
+            for (const NodeId &parent_id : parent_ids) {
+                size_t parent_index = GetIndex(parent_id);
+                if (parent_index >= index && moved[parent_index - index]) {
+                    throw std::runtime_error("Node " + MakeString(node_id) + " can't be its own ancestor");
+                }
+            }
+        }
+        std::vector<size_t> rows;
+        for (bool moved_pass : {false, true}) {
+            for (size_t moved_i = 0; moved_i < moved.size(); ++moved_i) {
+                if (moved[moved_i] == moved_pass) {
+                    rows.push_back(index + moved_i);
+                }
+            }
+        }
+        for (size_t suffix_index = index + moved.size(); suffix_index < birth_order_.size(); ++suffix_index) {
+            rows.push_back(suffix_index);
+        }
+        std::vector<Node> nodes;
+        for (size_t row : rows) {
+            nodes.push_back(row == index ? new_node : nodes_.at(birth_order_[row]));
+        }
+        ReplaceSuffix(index, nodes, rows);
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    void Tree<NodeId, NParents>::Compact() {
+        PROFILE_OPERATION("Tree::Compact");
+        // Cuthill-McKee ranks: breadth-first search over parent and child links from a far node of every
+        // connected component places relatives near each other; generation-major order keeps parents first
+        std::vector<size_t> rank(GetSize(), NO_INDEX);
+        std::vector<size_t> queue;
+        queue.reserve(GetSize());
+        auto visit_component = [&](size_t start) {
+            // Returns the last visited node, one of the farthest from start
+            size_t head = queue.size();
+            rank[start] = queue.size();
+            queue.push_back(start);
+            auto visit = [&](size_t index) {
+                if (index != NO_INDEX && rank[index] == NO_INDEX) {
+                    rank[index] = queue.size();
+                    queue.push_back(index);
+                }
+            };
+            while (head < queue.size()) {
+                size_t index = queue[head++];
+                for (size_t parent_index : parent_indices_[index]) {
+                    visit(parent_index);
+                }
+                for (size_t child_index : children_indices_[index]) {
+                    visit(child_index);
+                }
+            }
+            return queue.back();
+        };
+        std::vector<size_t> far_nodes;
+        for (size_t index = 0; index < GetSize(); ++index) {
+            if (rank[index] == NO_INDEX) {
+                far_nodes.push_back(visit_component(index));
+            }
+        }
+        std::fill(rank.begin(), rank.end(), NO_INDEX);
+        queue.clear();
+        for (size_t far_node : far_nodes) {
+            visit_component(far_node);
+        }
+        std::vector<size_t> order;
+        order.reserve(GetSize());
+        for (const std::vector<size_t> &generation : generations_) {
+            size_t generation_begin = order.size();
+            order.insert(order.end(), generation.begin(), generation.end());
+            std::sort(order.begin() + generation_begin, order.end(), [&rank](size_t lhs, size_t rhs) {
+                return rank[lhs] < rank[rhs];
+            });
+        }
+        Tree compacted;
+        compacted.nodes_.reserve(GetSize());
+        compacted.birth_order_.reserve(GetSize());
+        compacted.birth_index_.reserve(GetSize());
+        compacted.parent_indices_.reserve(GetSize());
+        compacted.children_indices_.reserve(GetSize());
+        compacted.depth_.reserve(GetSize());
+        compacted.height_.reserve(GetSize());
+        for (size_t index : order) {
+            compacted.AddNodeUnchecked(nodes_.at(birth_order_[index]));
+        }
+        compacted.attributes_ = attributes_.SelectRows(order);
+        *this = std::move(compacted);
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    void Tree<NodeId, NParents>::UpdateHeights(size_t new_index) {
+        // Every height only grows and is bounded by the maximal depth,
+        // so total work over all insertions is O(size * max depth * NParents)
+        std::vector<size_t> stack = {new_index};
+        while (!stack.empty()) {
+            size_t node_index = stack.back();
+            stack.pop_back();
+            for (size_t parent_index : parent_indices_[node_index]) {
+                if (parent_index != NO_INDEX && height_[parent_index] < height_[node_index] + 1) {
+                    height_[parent_index] = height_[node_index] + 1;
+                    stack.push_back(parent_index);
+                }
+            }
+        }
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    size_t Tree<NodeId, NParents>::GetIndex(IdView node_id) const {
+        if (auto index_it = birth_index_.find(node_id); index_it != birth_index_.end()) {
+            return index_it->second;
+        } else {
+            return NO_INDEX;
+        }
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    size_t Tree<NodeId, NParents>::GetGeneration(IdView node_id) const {
+        size_t index = GetIndex(node_id);
+        if (index == NO_INDEX) {
+            throw std::runtime_error("Unknown node id " + MakeString(node_id));
+        }
+        return depth_[index];
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    size_t Tree<NodeId, NParents>::GetHeight(IdView node_id) const {
+        size_t index = GetIndex(node_id);
+        if (index == NO_INDEX) {
+            throw std::runtime_error("Unknown node id " + MakeString(node_id));
+        }
+        return height_[index];
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    const std::vector<size_t> &Tree<NodeId, NParents>::NodeIndicesInGeneration(size_t generation) const {
+        static const std::vector<size_t> empty_generation;
+        return generation < generations_.size() ? generations_[generation] : empty_generation;
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    std::vector<NodeId> Tree<NodeId, NParents>::NodesInGeneration(size_t generation) const {
+        std::vector<NodeId> nodes;
+        for (size_t index : NodeIndicesInGeneration(generation)) {
+            nodes.push_back(birth_order_[index]);
+        }
+        return nodes;
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    const Node<NodeId, NParents> *Tree<NodeId, NParents>::GetNode(IdView node_id) const {
         if (auto node_it = nodes_.find(node_id); node_it != nodes_.end()) {
             return &node_it->second;
         } else {
@@ -264,7 +912,7 @@ namespace FamilyTree {
 
     template<typename NodeId, size_t NParents>
     Svg::Color Tree<NodeId, NParents>::GenerateDefaultColor() {
-        static std::mt19937 rnd(time(nullptr) + 239);
+        thread_local std::mt19937 rnd(time(nullptr) + 239);
         auto gen_rand_channel = []() -> int {
             return rnd() % 256;
         };
@@ -303,18 +951,17 @@ namespace FamilyTree {
 
 
     template<typename NodeId, size_t NParents>
-    std::unordered_map<NodeId, Svg::Color> Tree<NodeId, NParents>::CalculateColors() const {
-        std::unordered_map<NodeId, Svg::Color> colors;
-        for (const Node &node: GetNodes()) {
-            if (!node.parent_ids) {
-                colors[node.id] = GenerateDefaultColor();
+    std::vector<Svg::Color> Tree<NodeId, NParents>::CalculateColors() const {
+        std::vector<Svg::Color> colors(GetSize());
+        for (size_t index = 0; index < GetSize(); ++index) {
+            if (parent_indices_[index][0] == NO_INDEX) {
+                colors[index] = GenerateDefaultColor();
             } else {
                 std::array<Svg::Color, NParents> parent_colors;
                 for (size_t parent_i = 0; parent_i < NParents; ++parent_i) {
-                    const NodeId &parent_id = (*node.parent_ids)[parent_i];
-                    parent_colors[parent_i] = colors[parent_id];
+                    parent_colors[parent_i] = colors[parent_indices_[index][parent_i]];
                 }
-                colors[node.id] = InheritColor(begin(parent_colors), end(parent_colors));
+                colors[index] = InheritColor(begin(parent_colors), end(parent_colors));
             }
         }
         return colors;
@@ -322,30 +969,26 @@ namespace FamilyTree {
 
 
     template<typename NodeId, size_t NParents>
-    std::vector<std::vector<NodeId>> Tree<NodeId, NParents>::DistributeNodesInLevels() const {
-        std::vector<std::vector<NodeId>> levels;
-        std::unordered_map<NodeId, size_t> level_by_node;
-        auto nodes = GetNodes();
-        std::reverse(nodes.begin(), nodes.end());
-        for (const Node &node : nodes) {
-            size_t node_level = level_by_node[node.id];
-            for (const NodeId &parent_id : node.GetParents()) {
-                level_by_node[parent_id] = std::max(level_by_node[parent_id], node_level + 1);
-            }
-            if (node_level >= levels.size()) {
-                levels.emplace_back();
-            }
-            levels[node_level].push_back(node.id);
+    std::vector<std::vector<size_t>> Tree<NodeId, NParents>::DistributeNodesInLevels() const {
+        // Levels are cached heights: the oldest nodes go first, youngest descendants go last
+        size_t n_levels = 0;
+        for (size_t height : height_) {
+            n_levels = std::max(n_levels, height + 1);
+        }
+        std::vector<std::vector<size_t>> levels(n_levels);
+        for (size_t index = birth_order_.size(); index-- > 0; ) {
+            levels[n_levels - 1 - height_[index]].push_back(index);
         }
-        std::reverse(levels.begin(), levels.end());
         return levels;
     }
 
 
     template<typename NodeId, size_t NParents>
-    std::unordered_map<NodeId, Svg::Point> Tree<NodeId, NParents>::CalculatePositions() const {
+    std::vector<Svg::Point> Tree<NodeId, NParents>::CalculatePositions() const {
+        PROFILE_OPERATION("Tree::CalculatePositions");
+        PROFILE_NODES_VISITED(GetSize());
         auto levels = DistributeNodesInLevels();
-        std::unordered_map<NodeId, Svg::Point> positions;
+        std::vector<Svg::Point> positions(GetSize());
         double level_y = levels.size() > 1 ? RENDER_PADDING : RENDER_HEIGHT / 2.0;
         for (size_t level = 0; level < levels.size(); ++level) {
             if (level) {
@@ -354,54 +997,445 @@ namespace FamilyTree {
             double x = RENDER_PADDING;
             for (size_t node_i = 0; node_i < levels[level].size(); ++node_i) {
                 x += (RENDER_WIDTH - RENDER_PADDING * 2) / (levels[level].size() + 1);
-                const NodeId &node_id = levels[level][node_i];
-                positions[node_id] = Svg::Point{x, level_y};
+                positions[levels[level][node_i]] = Svg::Point{x, level_y};
             }
         }
         return positions;
     }
 
 
+    template<typename NodeId, size_t NParents>
+    template<typename ObjectConsumer>
+    void Tree<NodeId, NParents>::RenderNode(size_t index, const std::vector<Svg::Color> &colors,
+                                            const std::vector<Svg::Point> &positions,
+                                            ObjectConsumer consume) const {
+        Svg::Point node_pos = positions[index];
+        for (size_t parent_index : parent_indices_[index]) {
+            if (parent_index != NO_INDEX) {
+                consume(Svg::Polyline{}.AddPoint(positions[parent_index])
+                                .AddPoint(node_pos)
+                                .SetStrokeColor(colors[parent_index]));
+            }
+        }
+        consume(Svg::Circle{}.SetRadius(RENDER_NODE_RADIUS)
+                        .SetCenter(node_pos)
+                        .SetStrokeColor("black")
+                        .SetFillColor(colors[index]));
+        consume(Svg::Text{}.SetData(MakeString(birth_order_[index]))
+                        .SetPoint({node_pos.x + RENDER_NODE_RADIUS, node_pos.y})
+                        .SetStrokeColor("black")
+                        .SetFillColor("black")
+                        .SetFontSize(RENDER_NODE_RADIUS));
+    }
+
+
     template<typename NodeId, size_t NParents>
     Svg::Document Tree<NodeId, NParents>::RenderSvg() const {
+        PROFILE_OPERATION("Tree::RenderSvg");
+        PROFILE_NODES_VISITED(GetSize());
         Svg::Document tree_doc;
         auto colors = CalculateColors();
         auto positions = CalculatePositions();
-        for (const Node &node: GetNodes()) {
-            Svg::Point node_pos = positions[node.id];
-            for (const NodeId &parent_id: node.GetParents()) {
-                tree_doc.Add(Svg::Polyline{}.AddPoint(positions[parent_id])
-                                     .AddPoint(node_pos)
-                                     .SetStrokeColor(colors[parent_id]));
+        for (size_t index = 0; index < GetSize(); ++index) {
+            RenderNode(index, colors, positions, [&tree_doc](auto &&object) {
+                tree_doc.Add(std::move(object));
+            });
+        }
+        return tree_doc;
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    Svg::Document Tree<NodeId, NParents>::RenderLodSvg(double zoom, size_t n_detail_levels) const {
+        PROFILE_OPERATION("Tree::RenderLodSvg");
+        PROFILE_NODES_VISITED(GetSize());
+        if (!(zoom > 0 && zoom <= MAX_LOD_ZOOM) || n_detail_levels == 0) {
+            throw std::runtime_error("Zoom should be in (0, " + std::to_string(static_cast<size_t>(MAX_LOD_ZOOM)) +
+                                     "] and number of detail levels positive");
+        }
+        Svg::Document tree_doc;
+        auto colors = CalculateColors();
+        auto positions = CalculatePositions();
+        auto levels = DistributeNodesInLevels();
+        std::vector<double> radii(GetSize());
+        for (const auto &level : levels) {
+            double spacing = static_cast<double>(RENDER_WIDTH - RENDER_PADDING * 2) / (level.size() + 1);
+            for (size_t index : level) {
+                radii[index] = std::min<double>(RENDER_NODE_RADIUS, spacing / 2);
+            }
+        }
+        for (size_t index = 0; index < GetSize(); ++index) {
+            for (size_t parent_index : parent_indices_[index]) {
+                if (parent_index != NO_INDEX) {
+                    tree_doc.Add(Svg::Polyline{}.AddPoint(positions[parent_index])
+                                         .AddPoint(positions[index])
+                                         .SetStrokeColor(colors[parent_index]));
+                }
+            }
+        }
+        for (size_t index = 0; index < GetSize(); ++index) {
+            tree_doc.Add(Svg::Circle{}.SetRadius(radii[index])
+                                 .SetCenter(positions[index])
+                                 .SetStrokeColor("black")
+                                 .SetFillColor(colors[index]));
+        }
+
+        // Labels are placed oldest first, boxes are in layout coordinates: baseline at node center
+        double base_font_size = RENDER_NODE_RADIUS / zoom;
+        Svg::BoxGrid placed_labels(base_font_size);
+        std::vector<bool> labeled(GetSize());
+        std::vector<Svg::Group> detail_groups(n_detail_levels);
+        auto try_place_label = [&](Svg::Point node_pos, double radius, std::string label, double font_size,
+                                   Svg::Group &group) {
+            Svg::Point label_pos = {node_pos.x + radius, node_pos.y};
+            double width = static_cast<double>(label.size()) * font_size * LABEL_CHAR_WIDTH;
+            if (!placed_labels.TryInsert({label_pos.x, label_pos.y - font_size, label_pos.x + width, label_pos.y})) {
+                return false;
+            }
+            group.Add(Svg::Text{}.SetData(label)
+                              .SetPoint(label_pos)
+                              .SetStrokeColor("black")
+                              .SetFillColor("black")
+                              .SetFontSize(font_size));
+            return true;
+        };
+        double font_size = base_font_size;
+        for (size_t detail_level = 0; detail_level < n_detail_levels; ++detail_level, font_size /= 2) {
+            for (size_t index = 0; index < GetSize(); ++index) {
+                if (!labeled[index]) {
+                    labeled[index] = try_place_label(positions[index], radii[index], MakeString(birth_order_[index]),
+                                                     font_size, detail_groups[detail_level]);
+                }
             }
+        }
+        double finest_font_size = font_size * 2;
+        for (const auto &level : levels) {
+            for (size_t run_begin = 0; run_begin < level.size(); ) {
+                if (labeled[level[run_begin]]) {
+                    ++run_begin;
+                    continue;
+                }
+                size_t run_end = run_begin;
+                while (run_end < level.size() && !labeled[level[run_end]]) {
+                    ++run_end;
+                }
+                if (run_end - run_begin > 1) {
+                    size_t middle = level[(run_begin + run_end) / 2];
+                    try_place_label(positions[middle], radii[middle], "+" + std::to_string(run_end - run_begin),
+                                    finest_font_size, detail_groups.back());
+                }
+                run_begin = run_end;
+            }
+        }
+        for (size_t detail_level = n_detail_levels; detail_level-- > 0; ) {
+            detail_groups[detail_level].SetClass("lod" + std::to_string(detail_level));
+            if (detail_level) {
+                detail_groups[detail_level - 1].Add(std::move(detail_groups[detail_level]));
+            }
+        }
+        tree_doc.Add(std::move(detail_groups[0]));
+        return tree_doc;
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    Svg::Document Tree<NodeId, NParents>::RenderBundledSvg() const {
+        PROFILE_OPERATION("Tree::RenderBundledSvg");
+        PROFILE_NODES_VISITED(GetSize());
+        Svg::Document tree_doc;
+        auto colors = CalculateColors();
+        auto positions = CalculatePositions();
+        // Unions in order of their first child, parents sorted so that the order of parents doesn't matter
+        std::map<std::array<size_t, NParents>, size_t> union_ids;
+        std::vector<std::array<size_t, NParents>> union_parents;
+        std::vector<std::vector<size_t>> union_children;
+        for (size_t index = 0; index < GetSize(); ++index) {
+            if (parent_indices_[index][0] == NO_INDEX) {
+                continue;
+            }
+            auto parents = parent_indices_[index];
+            std::sort(parents.begin(), parents.end());
+            auto [union_it, inserted] = union_ids.emplace(parents, union_parents.size());
+            if (inserted) {
+                union_parents.push_back(parents);
+                union_children.emplace_back();
+            }
+            union_children[union_it->second].push_back(index);
+        }
+        std::vector<double> bar_xs;
+        for (size_t union_id = 0; union_id < union_parents.size(); ++union_id) {
+            double parents_bottom = 0, children_top = std::numeric_limits<double>::max();
+            bar_xs.clear();
+            for (size_t parent_index : union_parents[union_id]) {
+                parents_bottom = std::max(parents_bottom, positions[parent_index].y);
+                bar_xs.push_back(positions[parent_index].x);
+            }
+            for (size_t child_index : union_children[union_id]) {
+                children_top = std::min(children_top, positions[child_index].y);
+                bar_xs.push_back(positions[child_index].x);
+            }
+            double bar_y = (parents_bottom + children_top) / 2;
+            std::sort(bar_xs.begin(), bar_xs.end());
+            Svg::Path connector;
+            connector.MoveTo({bar_xs.front(), bar_y});
+            for (double x : bar_xs) {
+                // Collinear points of the bar merge into one segment
+                connector.LineTo({x, bar_y});
+            }
+            for (size_t parent_index : union_parents[union_id]) {
+                connector.MoveTo(positions[parent_index]).LineTo({positions[parent_index].x, bar_y});
+            }
+            for (size_t child_index : union_children[union_id]) {
+                connector.MoveTo({positions[child_index].x, bar_y}).LineTo(positions[child_index]);
+            }
+            tree_doc.Add(std::move(connector.SetStrokeColor(colors[union_parents[union_id][0]])));
+        }
+        for (size_t index = 0; index < GetSize(); ++index) {
+            Svg::Point node_pos = positions[index];
             tree_doc.Add(Svg::Circle{}.SetRadius(RENDER_NODE_RADIUS)
                                  .SetCenter(node_pos)
                                  .SetStrokeColor("black")
-                                 .SetFillColor(colors[node.id]));
-            tree_doc.Add(Svg::Text{}.SetData(MakeString(node.id))
+                                 .SetFillColor(colors[index]));
+            tree_doc.Add(Svg::Text{}.SetData(MakeString(birth_order_[index]))
                                  .SetPoint({node_pos.x + RENDER_NODE_RADIUS, node_pos.y})
                                  .SetStrokeColor("black")
                                  .SetFillColor("black")
                                  .SetFontSize(RENDER_NODE_RADIUS));
+        }
+        return tree_doc;
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    Svg::FlatDocument Tree<NodeId, NParents>::RenderFlatSvg() const {
+        PROFILE_OPERATION("Tree::RenderFlatSvg");
+        PROFILE_NODES_VISITED(GetSize());
+        Svg::FlatDocument tree_doc;
+        auto colors = CalculateColors();
+        auto positions = CalculatePositions();
+        Svg::FlatDocument::StyleId label_style = tree_doc.AddStyle(
+                {.fill = Svg::Color("black"), .stroke = Svg::Color("black"), .font_size = RENDER_NODE_RADIUS});
+        // Every node gets its own random tint (see InheritColor), so styles would grow with the tree.
+        // Channels are rounded to 16 levels and styles interned by rounded color before their CSS rules
+        // are formatted: the palette stays within 2 * 16^3 + 1 styles, edge styles only for nodes with children
+        struct ColorStyles {
+            std::optional<Svg::FlatDocument::StyleId> edge, circle;
+            Svg::Rgb rounded;
+        };
+        std::unordered_map<uint32_t, ColorStyles> styles_by_rgb;
+        auto styles_of = [&](const Svg::Color &color) -> ColorStyles & {
+            // Colors of rendered trees are always rgb, see CalculateColors
+            const auto &rgb = std::get<Svg::Rgb>(color);
+            Svg::Rgb rounded{.red = rgb.red / 16 * 17, .green = rgb.green / 16 * 17, .blue = rgb.blue / 16 * 17};
+            ColorStyles &styles = styles_by_rgb[static_cast<uint32_t>(rounded.red) << 16 |
+                                                rounded.green << 8 | rounded.blue];
+            styles.rounded = rounded;
+            return styles;
         };
+        for (size_t index = 0; index < GetSize(); ++index) {
+            Svg::Point node_pos = positions[index];
+            for (size_t parent_index : parent_indices_[index]) {
+                if (parent_index != NO_INDEX) {
+                    ColorStyles &parent_styles = styles_of(colors[parent_index]);
+                    if (!parent_styles.edge) {
+                        parent_styles.edge = tree_doc.AddStyle({.stroke = parent_styles.rounded});
+                    }
+                    tree_doc.AddLine(positions[parent_index], node_pos, *parent_styles.edge);
+                }
+            }
+            ColorStyles &styles = styles_of(colors[index]);
+            if (!styles.circle) {
+                styles.circle = tree_doc.AddStyle({.fill = styles.rounded, .stroke = Svg::Color("black")});
+            }
+            tree_doc.AddCircle(node_pos, RENDER_NODE_RADIUS, *styles.circle);
+            tree_doc.AddText({node_pos.x + RENDER_NODE_RADIUS, node_pos.y},
+                             MakeString(birth_order_[index]), label_style);
+        }
         return tree_doc;
     }
 
 
     template<typename NodeId, size_t NParents>
-    std::unordered_set<NodeId> Tree<NodeId, NParents>::GetAncestors(const NodeId &node) const {
+    void Tree<NodeId, NParents>::ExportLayoutJson(std::ostream &output) const {
+        PROFILE_OPERATION("Tree::ExportLayoutJson");
+        PROFILE_NODES_VISITED(GetSize());
+        auto colors = CalculateColors();
+        auto positions = CalculatePositions();
+        output << "{\"width\":" << RENDER_WIDTH << ",\"height\":" << RENDER_HEIGHT
+               << ",\"radius\":" << RENDER_NODE_RADIUS << ",\"nodes\":[";
+        for (size_t index = 0; index < GetSize(); ++index) {
+            output << (index ? ",{\"id\":" : "{\"id\":");
+            WriteQuoted(output, MakeString(birth_order_[index]));
+            output << ",\"x\":" << positions[index].x << ",\"y\":" << positions[index].y << ",\"color\":\""
+                   << colors[index] << "\"}";
+        }
+        output << "],\"edges\":[";
+        bool first_edge = true;
+        for (size_t index = 0; index < GetSize(); ++index) {
+            for (size_t parent_index : parent_indices_[index]) {
+                if (parent_index != NO_INDEX) {
+                    output << (first_edge ? "[" : ",[") << parent_index << ',' << index << ']';
+                    first_edge = false;
+                }
+            }
+        }
+        output << "]}\n";
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    void Tree<NodeId, NParents>::ExportLayoutDot(std::ostream &output) const {
+        PROFILE_OPERATION("Tree::ExportLayoutDot");
+        PROFILE_NODES_VISITED(GetSize());
+        static const char HEX_DIGITS[] = "0123456789abcdef";
+        auto colors = CalculateColors();
+        auto positions = CalculatePositions();
+        output << "digraph FamilyTree {\n  node [shape=circle, style=filled];\n";
+        for (size_t index = 0; index < GetSize(); ++index) {
+            // Dot y axis points up, svg one points down
+            output << "  " << index << " [label=";
+            WriteQuoted(output, MakeString(birth_order_[index]));
+            output << ", pos=\"" << positions[index].x << ',' << RENDER_HEIGHT - positions[index].y << "!\"";
+            if (const auto *rgb = std::get_if<Svg::Rgb>(&colors[index])) {
+                output << ", fillcolor=\"#";
+                for (int component : {rgb->red, rgb->green, rgb->blue}) {
+                    output << HEX_DIGITS[(component >> 4) & 0xf] << HEX_DIGITS[component & 0xf];
+                }
+                output << '"';
+            }
+            output << "];\n";
+        }
+        for (size_t index = 0; index < GetSize(); ++index) {
+            for (size_t parent_index : parent_indices_[index]) {
+                if (parent_index != NO_INDEX) {
+                    output << "  " << parent_index << " -> " << index << ";\n";
+                }
+            }
+        }
+        output << "}\n";
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    void Tree<NodeId, NParents>::RenderSvgParallel(std::ostream &output, size_t n_threads) const {
+        PROFILE_OPERATION("Tree::RenderSvgParallel");
+        PROFILE_NODES_VISITED(GetSize());
+        // Colors depend on parents' colors, so they (and cheap positions) are computed sequentially
+        auto colors = CalculateColors();
+        auto positions = CalculatePositions();
+        if (n_threads == 0) {
+            n_threads = std::max(std::thread::hardware_concurrency(), 1u);
+        }
+        const size_t CHUNK_SIZE = 4096;
+        const size_t n_chunks = (GetSize() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        const size_t max_chunks_ahead = 4 * n_threads;
+        // Bounds memory: workers don't run further than that ahead of the writer
+        std::vector<std::string> buffers(n_chunks);
+        std::vector<char> ready(n_chunks, false);
+        size_t next_chunk = 0, n_written = 0;
+        std::mutex mutex;
+        std::condition_variable chunk_ready, chunk_written;
+        auto serialize_chunks = [&]() {
+            while (true) {
+                size_t chunk;
+                {
+                    std::unique_lock lock(mutex);
+                    chunk_written.wait(lock, [&] {
+                        return next_chunk >= n_chunks || next_chunk < n_written + max_chunks_ahead;
+                    });
+                    if (next_chunk >= n_chunks) {
+                        return;
+                    }
+                    chunk = next_chunk++;
+                }
+                std::string buffer;
+                size_t chunk_end = std::min(GetSize(), (chunk + 1) * CHUNK_SIZE);
+                for (size_t index = chunk * CHUNK_SIZE; index < chunk_end; ++index) {
+                    RenderNode(index, colors, positions, [&buffer](const auto &object) {
+                        object.Render(buffer);
+                    });
+                }
+                std::lock_guard guard(mutex);
+                buffers[chunk] = std::move(buffer);
+                ready[chunk] = true;
+                chunk_ready.notify_all();
+            }
+        };
+        std::vector<std::thread> workers;
+        for (size_t worker_i = 0; worker_i < n_threads; ++worker_i) {
+            workers.emplace_back(serialize_chunks);
+        }
+        output << Svg::Document::PROLOGUE;
+        for (size_t chunk = 0; chunk < n_chunks; ++chunk) {
+            std::string buffer;
+            {
+                std::unique_lock lock(mutex);
+                chunk_ready.wait(lock, [&] { return ready[chunk]; });
+                buffer = std::move(buffers[chunk]);
+                n_written = chunk + 1;
+                chunk_written.notify_all();
+            }
+            output.write(buffer.data(), buffer.size());
+        }
+        output << Svg::Document::EPILOGUE;
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    std::unordered_set<NodeId> Tree<NodeId, NParents>::GetAncestors(IdView node) const {
+        PROFILE_OPERATION("Tree::GetAncestors");
+        size_t node_index = GetIndex(node);
+        if (node_index == NO_INDEX) {
+            throw std::runtime_error("Unknown node id " + MakeString(node));
+        }
+        // Visited marks live in a per-thread scratch set cleared through the visited list,
+        // so work is proportional to ancestors, not to tree size
+        thread_local NodeSet visited;
+        if (visited.GetUniverseSize() < GetSize()) {
+            visited.Resize(std::max(GetSize(), 2 * visited.GetUniverseSize()));
+        }
+        std::vector<size_t> node_order = {node_index};
+        visited.Insert(node_index);
+        for (size_t order_i = 0; order_i < node_order.size(); ++order_i) {
+            for (size_t parent_index : parent_indices_[node_order[order_i]]) {
+                if (parent_index != NO_INDEX && !visited.Contains(parent_index)) {
+                    visited.Insert(parent_index);
+                    node_order.push_back(parent_index);
+                }
+            }
+        }
+        PROFILE_NODES_VISITED(node_order.size());
         std::unordered_set<NodeId> ancestors;
-        std::queue<NodeId> node_order;
-        node_order.push(node);
-        std::unordered_set<NodeId> considered_nodes = {node};
-        while (!node_order.empty()) {
-            NodeId node_id = node_order.front();
-            node_order.pop();
-            ancestors.insert(node_id);
-            for (const NodeId &parent: GetNode(node_id)->GetParents()) {
-                if (!considered_nodes.count(parent)) {
-                    node_order.push(parent);
-                    considered_nodes.insert(parent);
+        ancestors.reserve(node_order.size());
+        for (size_t index : node_order) {
+            visited.Erase(index);
+            ancestors.insert(birth_order_[index]);
+        }
+        return ancestors;
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    NodeSet Tree<NodeId, NParents>::GetAncestorSet(IdView node) const {
+        PROFILE_OPERATION("Tree::GetAncestorSet");
+        size_t node_index = GetIndex(node);
+        if (node_index == NO_INDEX) {
+            throw std::runtime_error("Unknown node id " + MakeString(node));
+        }
+        NodeSet ancestors(GetSize());
+        ancestors.Insert(node_index);
+        std::vector<size_t> stack = {node_index};
+        while (!stack.empty()) {
+            size_t index = stack.back();
+            stack.pop_back();
+            PROFILE_NODES_VISITED(1);
+            for (size_t parent_index : parent_indices_[index]) {
+                if (parent_index != NO_INDEX && !ancestors.Contains(parent_index)) {
+                    ancestors.Insert(parent_index);
+                    stack.push_back(parent_index);
                 }
             }
         }
@@ -410,12 +1444,170 @@ namespace FamilyTree {
 
 
     template<typename NodeId, size_t NParents>
-    std::unordered_set<NodeId> Tree<NodeId, NParents>::LowestCommonAncestors(
-            const NodeId &node1, const NodeId &node2) const {
+    std::vector<Relative<NodeId>> Tree<NodeId, NParents>::MostRelated(IdView node, size_t k) const {
+        PROFILE_OPERATION("Tree::MostRelated");
+        size_t node_index = GetIndex(node);
+        if (node_index == NO_INDEX) {
+            throw std::runtime_error("Unknown node id " + MakeString(node));
+        }
+        // States are node index * 2 + phase: going up (may still turn down) or going down only.
+        // Path counts are only summed over shortest paths, so a state is expanded once
+        static const size_t UP = 0, DOWN = 1;
+        std::unordered_set<size_t> reached_states = {node_index * 2 + UP, node_index * 2 + DOWN};
+        std::unordered_set<size_t> reached_nodes = {node_index};
+        std::vector<std::pair<size_t, double>> layer = {{node_index * 2 + UP, 1}};
+        std::unordered_map<size_t, double> next_layer;
+        std::vector<Relative<NodeId>> relatives;
+        std::vector<std::pair<size_t, double>> layer_relatives;
+        for (size_t distance = 1; relatives.size() < k && !layer.empty(); ++distance) {
+            next_layer.clear();
+            auto reach = [&](size_t state, double paths) {
+                if (!reached_states.count(state)) {
+                    next_layer[state] += paths;
+                }
+            };
+            for (auto [state, paths] : layer) {
+                size_t index = state / 2;
+                PROFILE_NODES_VISITED(1);
+                if (state % 2 == UP) {
+                    for (size_t parent_index : parent_indices_[index]) {
+                        if (parent_index != NO_INDEX) {
+                            reach(parent_index * 2 + UP, paths);
+                        }
+                    }
+                }
+                for (size_t child_index : children_indices_[index]) {
+                    reach(child_index * 2 + DOWN, paths);
+                }
+            }
+            layer.assign(next_layer.begin(), next_layer.end());
+            std::sort(layer.begin(), layer.end());
+            layer_relatives.clear();
+            for (auto [state, paths] : layer) {
+                reached_states.insert(state);
+                size_t index = state / 2;
+                if (!layer_relatives.empty() && layer_relatives.back().first == index) {
+                    // Reached both going up and going down
+                    layer_relatives.back().second += paths;
+                } else if (reached_nodes.insert(index).second) {
+                    layer_relatives.emplace_back(index, paths);
+                }
+            }
+            std::sort(layer_relatives.begin(), layer_relatives.end(), [](const auto &lhs, const auto &rhs) {
+                return lhs.second != rhs.second ? lhs.second > rhs.second : lhs.first < rhs.first;
+            });
+            for (auto [index, paths] : layer_relatives) {
+                if (relatives.size() == k) {
+                    break;
+                }
+                relatives.push_back({birth_order_[index], distance, paths});
+            }
+        }
+        return relatives;
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    PedigreeCollapse Tree<NodeId, NParents>::CalculatePedigreeCollapse(size_t index,
+                                                                       AncestorLevelScratch &scratch) const {
+        if (scratch.marks.size() < GetSize()) {
+            scratch.marks.resize(GetSize());
+            scratch.slots.resize(GetSize());
+        }
+        PedigreeCollapse collapse;
+        // Slots of level are copied out of scratch: a node may be both in level and a parent of its other node
+        std::vector<size_t> level = {index}, next_level;
+        std::vector<double> level_slots = {1};
+        while (!level.empty()) {
+            collapse.distinct_ancestors.push_back(level.size());
+            double slots_sum = 0;
+            uint64_t epoch = ++scratch.epoch;
+            next_level.clear();
+            for (size_t level_i = 0; level_i < level.size(); ++level_i) {
+                slots_sum += level_slots[level_i];
+                for (size_t parent_index : parent_indices_[level[level_i]]) {
+                    if (parent_index == NO_INDEX) {
+                        continue;
+                    }
+                    if (scratch.marks[parent_index] != epoch) {
+                        scratch.marks[parent_index] = epoch;
+                        scratch.slots[parent_index] = 0;
+                        next_level.push_back(parent_index);
+                    }
+                    scratch.slots[parent_index] += level_slots[level_i];
+                }
+            }
+            collapse.ancestor_slots.push_back(slots_sum);
+            level_slots.clear();
+            for (size_t parent_index : next_level) {
+                level_slots.push_back(scratch.slots[parent_index]);
+            }
+            std::swap(level, next_level);
+        }
+        return collapse;
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    PedigreeCollapse Tree<NodeId, NParents>::GetPedigreeCollapse(IdView node) const {
+        PROFILE_OPERATION("Tree::GetPedigreeCollapse");
+        size_t index = GetIndex(node);
+        if (index == NO_INDEX) {
+            throw std::runtime_error("Unknown node id " + MakeString(node));
+        }
+        AncestorLevelScratch scratch;
+        PedigreeCollapse collapse = CalculatePedigreeCollapse(index, scratch);
+        // Every distinct ancestor is expanded once per generation it appears in
+        PROFILE_NODES_VISITED(std::accumulate(collapse.distinct_ancestors.begin(),
+                                              collapse.distinct_ancestors.end(), size_t(0)));
+        return collapse;
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    std::vector<PedigreeCollapse> Tree<NodeId, NParents>::GetPedigreeCollapseAll(size_t n_threads) const {
+        PROFILE_OPERATION("Tree::GetPedigreeCollapseAll");
+        // Young nodes have much larger pedigrees than founders, so workers take small blocks in turn
+        static const size_t BLOCK_SIZE = 256;
+        std::vector<PedigreeCollapse> collapses(GetSize());
+        std::atomic<size_t> next_block = 0;
+        auto work = [&]() {
+            AncestorLevelScratch scratch;
+            for (size_t block_begin; (block_begin = next_block.fetch_add(BLOCK_SIZE)) < GetSize(); ) {
+                for (size_t index = block_begin; index < std::min(block_begin + BLOCK_SIZE, GetSize()); ++index) {
+                    collapses[index] = CalculatePedigreeCollapse(index, scratch);
+                }
+            }
+        };
+        if (n_threads == 0) {
+            n_threads = std::max(std::thread::hardware_concurrency(), 1u);
+        }
+        n_threads = std::max<size_t>(std::min(n_threads, (GetSize() + BLOCK_SIZE - 1) / BLOCK_SIZE), 1);
+        std::vector<std::thread> workers;
+        for (size_t worker_i = 1; worker_i < n_threads; ++worker_i) {
+            workers.emplace_back(work);
+        }
+        work();
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+        // Counted after workers are joined: the operation is only open in this thread
+        PROFILE_NODES_VISITED(std::accumulate(collapses.begin(), collapses.end(), size_t(0),
+                                              [](size_t sum, const PedigreeCollapse &collapse) {
+            return std::accumulate(collapse.distinct_ancestors.begin(), collapse.distinct_ancestors.end(), sum);
+        }));
+        return collapses;
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    std::unordered_set<NodeId> Tree<NodeId, NParents>::LowestCommonAncestors(IdView node1, IdView node2) const {
+        PROFILE_OPERATION("Tree::LowestCommonAncestors");
         auto ancestors1 = GetAncestors(node1);
         auto ancestors2 = GetAncestors(node2);
         auto common_ancestors = UnorderedSetIntersection(ancestors1, ancestors2);
         auto lowest_common_ancestors = common_ancestors;
+        PROFILE_NODES_VISITED(ancestors1.size() + ancestors2.size() + common_ancestors.size());
         for (const NodeId &node: common_ancestors) {
             for (const NodeId &parent: GetNode(node)->GetParents()) {
                 lowest_common_ancestors.erase(parent);
@@ -425,49 +1617,335 @@ namespace FamilyTree {
     }
 
 
+    template<typename NodeId, size_t NParents>
+    template<typename Consumer>
+    void Tree<NodeId, NParents>::SweepRelations(IdView node, Consumer consume) const {
+        PROFILE_OPERATION("Tree::SweepRelations");
+        size_t node_index = GetIndex(node);
+        if (node_index == NO_INDEX) {
+            throw std::runtime_error("Unknown node id " + MakeString(node));
+        }
+        // Shortest distance up from node, NO_INDEX for nodes which are not its ancestors
+        std::vector<size_t> up(GetSize(), NO_INDEX);
+        up[node_index] = 0;
+        std::vector<size_t> layer = {node_index}, next_layer;
+        for (size_t distance = 1; !layer.empty(); ++distance) {
+            next_layer.clear();
+            for (size_t index : layer) {
+                for (size_t parent_index : parent_indices_[index]) {
+                    if (parent_index != NO_INDEX && up[parent_index] == NO_INDEX) {
+                        up[parent_index] = distance;
+                        next_layer.push_back(parent_index);
+                    }
+                }
+            }
+            std::swap(layer, next_layer);
+        }
+        // Labels of all nodes are stored back to back: label of index is labels[label_begin[index]...]
+        std::vector<CommonAncestor> labels;
+        std::vector<size_t> label_begin(GetSize() + 1);
+        std::vector<CommonAncestor> nearest;
+        for (size_t index = 0; index < GetSize(); ++index) {
+            PROFILE_NODES_VISITED(1);
+            nearest.clear();
+            if (up[index] != NO_INDEX) {
+                nearest.push_back({index, up[index], 0});
+            } else if (parent_indices_[index].front() != NO_INDEX) {
+                size_t min_distance = NO_INDEX;
+                for (size_t parent_index : parent_indices_[index]) {
+                    size_t label_end = label_begin[parent_index + 1];
+                    for (size_t label_i = label_begin[parent_index]; label_i < label_end; ++label_i) {
+                        CommonAncestor ancestor = labels[label_i];
+                        ++ancestor.down;
+                        if (ancestor.up + ancestor.down < min_distance) {
+                            min_distance = ancestor.up + ancestor.down;
+                            nearest.clear();
+                        }
+                        if (ancestor.up + ancestor.down == min_distance) {
+                            nearest.push_back(ancestor);
+                        }
+                    }
+                }
+                // Up distance is fixed per ancestor, so equal totals of one ancestor are duplicates
+                std::sort(nearest.begin(), nearest.end(), [](const auto &lhs, const auto &rhs) {
+                    return lhs.index < rhs.index;
+                });
+                nearest.erase(std::unique(nearest.begin(), nearest.end(), [](const auto &lhs, const auto &rhs) {
+                    return lhs.index == rhs.index;
+                }), nearest.end());
+            }
+            labels.insert(labels.end(), nearest.begin(), nearest.end());
+            label_begin[index + 1] = labels.size();
+            consume(index, static_cast<const std::vector<CommonAncestor> &>(nearest));
+        }
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    template<typename IndexIt>
+    Tree<NodeId, NParents> Tree<NodeId, NParents>::ExtractIndices(IndexIt index_begin, IndexIt index_end) const {
+        // Parents precede children, so a parent is kept iff it was added to subtree before
+        Tree subtree;
+        for (IndexIt it = index_begin; it != index_end; ++it) {
+            Node node = *GetNode(birth_order_[*it]);
+            if (node.parent_ids) {
+                for (const NodeId &parent_id : *node.parent_ids) {
+                    if (subtree.GetIndex(parent_id) == NO_INDEX) {
+                        node.parent_ids.reset();
+                        break;
+                    }
+                }
+            }
+            subtree.AddNodeUnchecked(node);
+        }
+        // Rows are copied after nodes: every added node resizes attributes to tree size
+        subtree.attributes_ = attributes_.SelectRows(std::vector<size_t>(index_begin, index_end));
+        return subtree;
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    template<typename NeighboursFunc>
+    std::vector<size_t> Tree<NodeId, NParents>::CollectWithinDepth(
+            const std::vector<NodeId> &roots, size_t max_depth, NeighboursFunc neighbours) const {
+        std::unordered_map<size_t, size_t> distances;
+        std::queue<size_t> index_order;
+        for (const NodeId &root : roots) {
+            size_t root_index = GetIndex(root);
+            if (root_index == NO_INDEX) {
+                throw std::runtime_error("Unknown node id " + MakeString(root));
+            }
+            if (distances.emplace(root_index, 0).second) {
+                index_order.push(root_index);
+            }
+        }
+        while (!index_order.empty()) {
+            size_t index = index_order.front();
+            index_order.pop();
+            size_t distance = distances[index];
+            if (distance == max_depth) {
+                continue;
+            }
+            for (size_t neighbour_index : neighbours(index)) {
+                if (neighbour_index != NO_INDEX && distances.emplace(neighbour_index, distance + 1).second) {
+                    index_order.push(neighbour_index);
+                }
+            }
+        }
+        std::vector<size_t> indices;
+        indices.reserve(distances.size());
+        for (const auto &[index, distance] : distances) {
+            indices.push_back(index);
+        }
+        std::sort(indices.begin(), indices.end());
+        return indices;
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    Tree<NodeId, NParents> Tree<NodeId, NParents>::ExtractAncestry(
+            const std::vector<NodeId> &roots, size_t max_depth) const {
+        auto indices = CollectWithinDepth(roots, max_depth, [this](size_t index) -> const auto & {
+            return parent_indices_[index];
+        });
+        return ExtractIndices(indices.begin(), indices.end());
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    Tree<NodeId, NParents> Tree<NodeId, NParents>::ExtractDescendants(
+            const std::vector<NodeId> &roots, size_t max_depth) const {
+        auto indices = CollectWithinDepth(roots, max_depth, [this](size_t index) -> const auto & {
+            return children_indices_[index];
+        });
+        return ExtractIndices(indices.begin(), indices.end());
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    template<typename Predicate>
+    Tree<NodeId, NParents> Tree<NodeId, NParents>::ExtractInducedSubtree(Predicate predicate) const {
+        std::vector<size_t> indices;
+        for (size_t index = 0; index < birth_order_.size(); ++index) {
+            if (predicate(*GetNode(birth_order_[index]))) {
+                indices.push_back(index);
+            }
+        }
+        return ExtractIndices(indices.begin(), indices.end());
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    std::vector<NodeConflict<NodeId, NParents>> Tree<NodeId, NParents>::FindConflicts(
+            const Tree<NodeId, NParents> &lhs, const Tree<NodeId, NParents> &rhs) {
+        std::vector<NodeConflict<NodeId, NParents>> conflicts;
+        if (lhs.GetContentHash() == rhs.GetContentHash() && lhs == rhs) {
+            return conflicts;
+        }
+        for (const NodeId &node_id: lhs.birth_order_) {
+            const Node &node = *lhs.GetNode(node_id);
+            if (const Node *r_node = rhs.GetNode(node_id); r_node && node != *r_node) {
+                conflicts.push_back({node, *r_node});
+            }
+        }
+        return conflicts;
+    }
+
+
     template<typename NodeId, size_t NParents>
     Tree<NodeId, NParents> Tree<NodeId, NParents>::Merge(
             const Tree<NodeId, NParents> &lhs, const Tree<NodeId, NParents> &rhs) {
+        PROFILE_OPERATION("Tree::Merge");
+        PROFILE_NODES_VISITED(lhs.GetSize() + rhs.GetSize());
+        // Conflicts are found before any copying, so failing merge is cheap
+        if (auto conflicts = FindConflicts(lhs, rhs); !conflicts.empty()) {
+            throw std::runtime_error("Both trees have node " + MakeString(conflicts.front().lhs_version.id) +
+                                     " versions that cannot be merged (" +
+                                     std::to_string(conflicts.size()) + " conflicts in total)");
+        }
         Tree<NodeId, NParents> resulting_tree;
-        for (const Node &node: lhs.GetNodes()) {
-            if (rhs.GetNode(node.id) && node != *rhs.GetNode(node.id)) {
-                throw std::runtime_error("Both trees have node " + MakeString(node.id) +
-                                         " versions that cannot be merged");
-            }
-            resulting_tree.AddNode(node);
+        for (const NodeId &node_id: lhs.birth_order_) {
+            resulting_tree.AddNode(*lhs.GetNode(node_id));
         }
-        for (const Node &node: rhs.GetNodes()) {
-            if (!lhs.GetNode(node.id)) {
-                resulting_tree.AddNode(node);
+        // Rows are copied after nodes: every added node resizes attributes to tree size
+        resulting_tree.attributes_ = lhs.attributes_;
+        resulting_tree.attributes_.AddColumnsOf(rhs.attributes_);
+        for (size_t rhs_index = 0; rhs_index < rhs.GetSize(); ++rhs_index) {
+            if (!lhs.GetNode(rhs.birth_order_[rhs_index])) {
+                resulting_tree.AddNode(*rhs.GetNode(rhs.birth_order_[rhs_index]));
+                resulting_tree.attributes_.CopyRow(resulting_tree.GetSize() - 1, rhs.attributes_, rhs_index);
             }
         }
         return resulting_tree;
     }
 
 
+    template<typename NodeId, size_t NParents>
+    MergeResult<NodeId, NParents> Tree<NodeId, NParents>::Merge(
+            const Tree<NodeId, NParents> &lhs, const Tree<NodeId, NParents> &rhs, MergePolicy policy) {
+        PROFILE_OPERATION("Tree::Merge");
+        PROFILE_NODES_VISITED(lhs.GetSize() + rhs.GetSize());
+        MergeResult<NodeId, NParents> result{.conflicts = FindConflicts(lhs, rhs)};
+        if (policy == MergePolicy::CollectConflicts) {
+            return result;
+        }
+        AttributeStore attributes = lhs.attributes_.SelectRows({});
+        attributes.AddColumnsOf(rhs.attributes_);
+        std::vector<std::pair<const Tree *, size_t>> row_sources;
+        // Tree and row every emitted node (and its attributes) was taken from
+        std::unordered_set<NodeId, IdHash, IdEqual> conflicting_ids;
+        for (const auto &conflict : result.conflicts) {
+            conflicting_ids.insert(conflict.lhs_version.id);
+        }
+        auto resolve = [&](const NodeId &node_id) -> const Node * {
+            const Node *l_node = lhs.GetNode(node_id);
+            if (!l_node || (policy == MergePolicy::PreferRight && conflicting_ids.count(node_id))) {
+                return rhs.GetNode(node_id);
+            }
+            return l_node;
+        };
+        // Nodes are emitted in lhs then rhs birth order, but a node taking rhs parents may need
+        // them emitted first. Resolved versions can't form a cycle: rhs versions only refer to rhs nodes.
+        enum class Mark : char { InProgress, Emitted, Skipped };
+        std::unordered_map<NodeId, Mark, IdHash, IdEqual> marks;
+        auto emit = [&](const NodeId &root_id) {
+            if (marks.count(root_id)) {
+                return;
+            }
+            std::vector<std::pair<const Node *, bool>> stack = {{resolve(root_id), false}};
+            // Second element: parents are pushed, InProgress nodes are exactly the expanded ones on stack
+            while (!stack.empty()) {
+                auto [node, expanded] = stack.back();
+                if (!expanded) {
+                    if (auto mark_it = marks.find(node->id); mark_it != marks.end()) {
+                        if (mark_it->second == Mark::InProgress) {
+                            throw std::runtime_error("Merged versions of node " + MakeString(node->id) +
+                                                     " form a cycle");
+                        }
+                        stack.pop_back();
+                        continue;
+                    }
+                    marks[node->id] = Mark::InProgress;
+                    stack.back().second = true;
+                    for (const NodeId &parent_id : node->GetParents()) {
+                        if (!marks.count(parent_id) || marks[parent_id] == Mark::InProgress) {
+                            stack.push_back({resolve(parent_id), false});
+                        }
+                    }
+                    continue;
+                }
+                stack.pop_back();
+                bool skip = policy == MergePolicy::SkipConflicts && conflicting_ids.count(node->id);
+                for (const NodeId &parent_id : node->GetParents()) {
+                    skip = skip || marks[parent_id] == Mark::Skipped;
+                }
+                if (skip) {
+                    marks[node->id] = Mark::Skipped;
+                } else {
+                    marks[node->id] = Mark::Emitted;
+                    result.tree.AddNode(*node);
+                    const Tree *source = lhs.GetNode(node->id) == node ? &lhs : &rhs;
+                    row_sources.emplace_back(source, source->GetIndex(node->id));
+                }
+            }
+        };
+        for (const NodeId &node_id: lhs.birth_order_) {
+            emit(node_id);
+        }
+        for (const NodeId &node_id: rhs.birth_order_) {
+            emit(node_id);
+        }
+        attributes.Resize(result.tree.GetSize());
+        for (size_t index = 0; index < row_sources.size(); ++index) {
+            attributes.CopyRow(index, row_sources[index].first->attributes_, row_sources[index].second);
+        }
+        result.tree.attributes_ = std::move(attributes);
+        return result;
+    }
+
+
     template<typename NodeId, size_t NParents>
     Tree<NodeId, NParents> Tree<NodeId, NParents>::ParseFrom(const std::string &input) {
+        PROFILE_OPERATION("Tree::ParseFrom");
         std::stringstream input_stream(input);
         std::vector<Node> nodes;
+        AttributeStore attributes;
+        std::vector<std::pair<size_t, std::string>> attribute_rows;
         for (std::string line; std::getline(input_stream, line);) {
             if (line.empty()) {
                 continue;
             }
+            if (line.starts_with(AttributeStore::SCHEMA_PREFIX)) {
+                attributes.ParseSchemaLine(line);
+                continue;
+            }
+            if (size_t separator_pos = line.find(AttributeStore::ROW_SEPARATOR); separator_pos != std::string::npos) {
+                attribute_rows.emplace_back(nodes.size(), line.substr(separator_pos + AttributeStore::ROW_SEPARATOR.size()));
+                line.resize(separator_pos);
+            }
             nodes.push_back(Node::ParseFrom(line));
         }
-        return Tree<NodeId, NParents>(nodes.begin(), nodes.end());
+        PROFILE_NODES_VISITED(nodes.size());
+        Tree<NodeId, NParents> tree(nodes.begin(), nodes.end());
+        attributes.Resize(tree.GetSize());
+        for (const auto &[row, assignments] : attribute_rows) {
+            attributes.ParseRow(row, assignments);
+        }
+        tree.attributes_ = std::move(attributes);
+        return tree;
     }
 
 
     template<typename NodeId, size_t NParents>
     bool operator==(const Tree<NodeId, NParents> &lhs,
                     const Tree<NodeId, NParents> &rhs) {
-        if (lhs.GetSize() != rhs.GetSize()) {
+        if (lhs.GetSize() != rhs.GetSize() || lhs.GetContentHash() != rhs.GetContentHash()) {
             return false;
         }
-        for (const Node<NodeId, NParents> &node: lhs.GetNodes()) {
-            auto r_node_ptr = rhs.GetNode(node.id);
-            if (!r_node_ptr || *r_node_ptr != node) {
+        for (size_t index = 0; index < lhs.GetSize(); ++index) {
+            const NodeId &node_id = lhs.GetIdByIndex(index);
+            auto r_node_ptr = rhs.GetNode(node_id);
+            if (!r_node_ptr || *r_node_ptr != *lhs.GetNode(node_id)) {
                 return false;
             }
         }
@@ -485,13 +1963,27 @@ namespace FamilyTree {
     template<typename NodeId, size_t NParents>
     std::ostream &operator<<(std::ostream &output,
                              const Tree<NodeId, NParents> &tree) {
-        for (const Node<NodeId, NParents>& node : tree.GetNodes()) {
-            output << node.id;
-            for (const NodeId &parent_id: node.GetParents()) {
-                output << " " << parent_id;
+        // Lines are formatted into a buffer written in large chunks instead of flushing every line
+        static const size_t FLUSH_SIZE = 1 << 16;
+        tree.GetAttributes().WriteSchema(output);
+        std::string buffer;
+        for (size_t index = 0; index < tree.GetSize(); ++index) {
+            const Node<NodeId, NParents> &node = *tree.GetNode(tree.GetIdByIndex(index));
+            IdTraits<NodeId>::Format(buffer, node.id);
+            if (node.parent_ids) {
+                for (const NodeId &parent_id : *node.parent_ids) {
+                    buffer += ' ';
+                    IdTraits<NodeId>::Format(buffer, parent_id);
+                }
             }
-            output << std::endl;
-        };
-        return output;
+            tree.GetAttributes().FormatRow(buffer, index);
+            buffer += '\n';
+            if (buffer.size() >= FLUSH_SIZE) {
+                output.write(buffer.data(), buffer.size());
+                buffer.clear();
+            }
+        }
+        output.write(buffer.data(), buffer.size());
+        return output.flush();
     }
 }
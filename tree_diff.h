@@ -0,0 +1,164 @@
+#pragma once
+
+#include "tree.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace FamilyTree {
+    template<typename NodeId, size_t NParents>
+    struct TreePatch {
+        // Changes that turn one tree into another one
+        using Node = FamilyTree::Node<NodeId, NParents>;
+
+        std::vector<Node> added_nodes;
+        // In valid birth order: every parent is either in the patched tree or added earlier
+        std::vector<NodeConflict<NodeId, NParents>> conflicts;
+
+        bool IsEmpty() const { return added_nodes.empty() && conflicts.empty(); }
+
+        static TreePatch ParseFrom(const std::string &input);
+    };
+
+    template<typename NodeId, size_t NParents>
+    std::ostream &operator <<(std::ostream &output, const TreePatch<NodeId, NParents> &patch);
+    // Text format, one record per line:
+    // "+ node_id [parent_ids...]" - added node,
+    // "< node_id [parent_ids...]" followed by "> node_id [parent_ids...]" - conflict (lhs and rhs versions)
+
+    template<typename NodeId, size_t NParents>
+    TreePatch<NodeId, NParents> Diff(const Tree<NodeId, NParents> &lhs, const Tree<NodeId, NParents> &rhs,
+                                     size_t n_threads = 0);
+    // Nodes of rhs that are missing or different in lhs, n_threads = 0 - hardware concurrency.
+    // Nodes present only in lhs are not reported.
+
+    template<typename NodeId, size_t NParents>
+    void Apply(Tree<NodeId, NParents> &tree, const TreePatch<NodeId, NParents> &patch);
+    // Adds patch nodes to tree. Throws (leaving tree untouched) if the patch has conflicts
+    // or doesn't fit the tree: added node already exists or has unknown parent.
+}
+
+
+// Implementations
+namespace FamilyTree {
+    template<typename NodeId, size_t NParents>
+    TreePatch<NodeId, NParents> TreePatch<NodeId, NParents>::ParseFrom(const std::string &input) {
+        TreePatch patch;
+        std::stringstream input_stream(input);
+        std::optional<Node> lhs_version;
+        for (std::string line; std::getline(input_stream, line);) {
+            if (line.empty()) {
+                continue;
+            }
+            if (line.size() < 2 || line[1] != ' ' || (lhs_version.has_value() != (line[0] == '>'))) {
+                throw std::runtime_error("Bad patch record: " + line);
+            }
+            Node node = Node::ParseFrom(line.substr(2));
+            if (line[0] == '+') {
+                patch.added_nodes.push_back(std::move(node));
+            } else if (line[0] == '<') {
+                lhs_version = std::move(node);
+            } else if (line[0] == '>' && node.id == lhs_version->id) {
+                patch.conflicts.push_back({std::move(*lhs_version), std::move(node)});
+                lhs_version.reset();
+            } else {
+                throw std::runtime_error("Bad patch record: " + line);
+            }
+        }
+        if (lhs_version) {
+            throw std::runtime_error("Patch conflict without rhs version");
+        }
+        return patch;
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    std::ostream &operator <<(std::ostream &output, const TreePatch<NodeId, NParents> &patch) {
+        for (const auto &node : patch.added_nodes) {
+            output << "+ " << node << '\n';
+        }
+        for (const auto &conflict : patch.conflicts) {
+            output << "< " << conflict.lhs_version << '\n';
+            output << "> " << conflict.rhs_version << '\n';
+        }
+        return output;
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    TreePatch<NodeId, NParents> Diff(const Tree<NodeId, NParents> &lhs, const Tree<NodeId, NParents> &rhs,
+                                     size_t n_threads) {
+        TreePatch<NodeId, NParents> patch;
+        if (lhs.GetContentHash() == rhs.GetContentHash() && lhs == rhs) {
+            return patch;
+        }
+        enum class NodeStatus : char { Same, Added, Conflict };
+        std::vector<NodeStatus> statuses(rhs.GetSize());
+        // Threads classify contiguous chunks of rhs birth order, so collecting
+        // statuses in index order gives added nodes in valid birth order without sorting
+        auto classify_chunk = [&lhs, &rhs, &statuses](size_t chunk_begin, size_t chunk_end) {
+            for (size_t index = chunk_begin; index < chunk_end; ++index) {
+                const NodeId &node_id = rhs.GetIdByIndex(index);
+                const auto *l_node = lhs.GetNode(node_id);
+                if (!l_node) {
+                    statuses[index] = NodeStatus::Added;
+                } else if (*l_node != *rhs.GetNode(node_id)) {
+                    statuses[index] = NodeStatus::Conflict;
+                } else {
+                    statuses[index] = NodeStatus::Same;
+                }
+            }
+        };
+        if (n_threads == 0) {
+            n_threads = std::max(std::thread::hardware_concurrency(), 1u);
+        }
+        const size_t MIN_CHUNK_SIZE = 1 << 14;
+        n_threads = std::max<size_t>(std::min(n_threads, rhs.GetSize() / MIN_CHUNK_SIZE), 1);
+        std::vector<std::thread> workers;
+        size_t chunk_size = (rhs.GetSize() + n_threads - 1) / n_threads;
+        for (size_t chunk_begin = chunk_size; chunk_begin < rhs.GetSize(); chunk_begin += chunk_size) {
+            workers.emplace_back(classify_chunk, chunk_begin, std::min(chunk_begin + chunk_size, rhs.GetSize()));
+        }
+        classify_chunk(0, std::min(chunk_size, rhs.GetSize()));
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+        for (size_t index = 0; index < rhs.GetSize(); ++index) {
+            const NodeId &node_id = rhs.GetIdByIndex(index);
+            if (statuses[index] == NodeStatus::Added) {
+                patch.added_nodes.push_back(*rhs.GetNode(node_id));
+            } else if (statuses[index] == NodeStatus::Conflict) {
+                patch.conflicts.push_back({*lhs.GetNode(node_id), *rhs.GetNode(node_id)});
+            }
+        }
+        return patch;
+    }
+
+
+    template<typename NodeId, size_t NParents>
+    void Apply(Tree<NodeId, NParents> &tree, const TreePatch<NodeId, NParents> &patch) {
+        if (!patch.conflicts.empty()) {
+            std::string conflict_id;
+            IdTraits<NodeId>::Format(conflict_id, patch.conflicts.front().lhs_version.id);
+            throw std::runtime_error("Patch has " + std::to_string(patch.conflicts.size()) +
+                                     " conflicts, first is node " + conflict_id);
+        }
+        std::unordered_set<NodeId, typename IdTraits<NodeId>::Hash, typename IdTraits<NodeId>::KeyEqual> patch_ids;
+        for (const auto &node : patch.added_nodes) {
+            if (tree.GetNode(node.id) || patch_ids.count(node.id)) {
+                throw std::runtime_error("Patch adds node that already exists");
+            }
+            for (const NodeId &parent_id : node.GetParents()) {
+                if (!tree.GetNode(parent_id) && !patch_ids.count(parent_id)) {
+                    throw std::runtime_error("Patch adds node with unknown parent id");
+                }
+            }
+            patch_ids.insert(node.id);
+        }
+        for (const auto &node : patch.added_nodes) {
+            tree.AddNode(node);
+        }
+    }
+}
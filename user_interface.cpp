@@ -1,75 +1,824 @@
 #include "user_interface.h"
+#include "contribution.h"
+#include "journal.h"
+#include "query.h"
+#include "server.h"
 #include "tree.h"
+#include "tree_diff.h"
+#include "Libs/gzip/gzip_stream.h"
+
+#include <csignal>
+#include <functional>
+#include <iomanip>
+#include <shared_mutex>
 
 using namespace std;
 
 
 FamilyTree::Tree<string, 2> OpenFrom(const string& filename) {
-    return FamilyTree::Tree<string, 2>::ParseFrom(ReadEverythingFromFile(filename));
+    return FamilyTree::Journal<string, 2>::Load(filename);
 }
 
 
-void RunInteraction(const string& start_filename, istream& command_stream, ostream& output) {
+namespace {
     using Tree = FamilyTree::Tree<string, 2>;
-    Tree family_tree;
-    if (!start_filename.empty()) {
-        family_tree = OpenFrom(start_filename);
-    }
-    for (string command; getline(command_stream, command); ) {
-        vector<string> tokens = Split(command);
-        if (tokens.empty()) {
-            continue;
+    using Journal = FamilyTree::Journal<string, 2>;
+
+    struct Workspace {
+        using Edit = FamilyTree::TreeSuffix<string, 2>;
+        // Undo record: suffix of the other version, the part an edit changed. Appending edits record
+        // an empty suffix, so history costs memory proportional to changes, not to tree size
+
+        Tree family_tree;
+        optional<Journal> journal;
+        // Journal of the snapshot file tree was opened from or saved to, records every edit
+        vector<Edit> undo_history;
+        vector<Edit> redo_history;
+        unordered_map<string, size_t> checkpoints;
+        // Checkpoint name -> undo_history size when it was taken
+        FamilyTree::ContributionEngine contributions;
+        // Memoized founder contributions stay valid while nodes are only appended
+
+        void Open(const string& filename) {
+            Journal opened_journal(filename);
+            family_tree = opened_journal.Open();
+            journal = std::move(opened_journal);
+            // History belongs to the previous file
+            contributions.Clear();
+            undo_history.clear();
+            redo_history.clear();
+            checkpoints.clear();
+        }
+
+        void RecordAppended(size_t first_index, size_t first_column) {
+            // Nodes from birth position first_index and attribute columns from first_column were appended,
+            // previous ones are untouched
+            if (first_index == family_tree.GetSize() && first_column == family_tree.GetAttributes().GetColumnCount()) {
+                return;
+            }
+            StartEdit();
+            undo_history.push_back({.first_index = first_index, .first_column = first_column});
+            if (journal) {
+                journal->AppendSuffix(family_tree, first_index, first_column);
+            }
+        }
+
+        size_t RemoveNode(const string& node_id, FamilyTree::RemovalPolicy policy) {
+            // Edited in place, undo record is the old tree from position of node on
+            Edit edit = family_tree.GetSuffix(GetEditedIndex(node_id), family_tree.GetAttributes().GetColumnCount());
+            size_t n_removed = family_tree.RemoveNode(node_id, policy);
+            RecordEdited(std::move(edit));
+            if (journal) {
+                journal->AppendRemoval(node_id, policy);
+            }
+            return n_removed;
+        }
+
+        void SetParents(const string& node_id, const vector<string>& parent_ids) {
+            Edit edit = family_tree.GetSuffix(GetEditedIndex(node_id), family_tree.GetAttributes().GetColumnCount());
+            family_tree.SetParents(node_id, parent_ids);
+            RecordEdited(std::move(edit));
+            if (journal) {
+                journal->AppendParents(Tree::Node(node_id, parent_ids));
+            }
+        }
+
+        size_t GetEditedIndex(const string& node_id) const {
+            size_t index = family_tree.GetIndex(node_id);
+            if (index == Tree::NO_INDEX) {
+                throw runtime_error("Unknown node id " + node_id);
+            }
+            return index;
+        }
+
+        void RecordEdited(Edit edit) {
+            StartEdit();
+            undo_history.push_back(std::move(edit));
+            contributions.Clear();
+        }
+
+        void ReplaceTree(Tree new_tree) {
+            // Edit can't be expressed as appended nodes, previous tree is kept for undo from the first
+            // node or attribute column that differs
+            const auto& old_attributes = family_tree.GetAttributes();
+            const auto& new_attributes = new_tree.GetAttributes();
+            size_t first_column = 0;
+            while (first_column < min(old_attributes.GetColumnCount(), new_attributes.GetColumnCount()) &&
+                   old_attributes.GetColumnName(first_column) == new_attributes.GetColumnName(first_column) &&
+                   old_attributes.GetColumnType(old_attributes.GetColumnName(first_column)) ==
+                   new_attributes.GetColumnType(new_attributes.GetColumnName(first_column))) {
+                ++first_column;
+            }
+            size_t first_index = 0;
+            string old_row, new_row;
+            for (; first_index < min(family_tree.GetSize(), new_tree.GetSize()); ++first_index) {
+                const string& id = family_tree.GetIdByIndex(first_index);
+                if (id != new_tree.GetIdByIndex(first_index) || *family_tree.GetNode(id) != *new_tree.GetNode(id)) {
+                    break;
+                }
+                old_row.clear();
+                new_row.clear();
+                old_attributes.FormatRow(old_row, first_index);
+                new_attributes.FormatRow(new_row, first_index);
+                if (old_row != new_row) {
+                    break;
+                }
+            }
+            StartEdit();
+            undo_history.push_back(family_tree.GetSuffix(first_index, first_column));
+            family_tree = std::move(new_tree);
+            contributions.Clear();
+            RecordRewritten();
+        }
+
+        void RecordRewritten() {
+            // Snapshot is rewritten with the current tree
+            if (journal) {
+                journal->Compact(family_tree);
+            }
+        }
+
+        void StartEdit() {
+            // New edit forks history: redo records and checkpoints taken after current version are lost
+            redo_history.clear();
+            erase_if(checkpoints, [this](const auto& checkpoint) {
+                return checkpoint.second > undo_history.size();
+            });
+        }
+
+        size_t Undo(size_t n_steps) {
+            // Returns number of undone edits, snapshot is rewritten once for all of them
+            size_t n_undone = 0;
+            for (; n_undone < n_steps && !undo_history.empty(); ++n_undone) {
+                redo_history.push_back(family_tree.SwapSuffix(std::move(undo_history.back())));
+                undo_history.pop_back();
+            }
+            if (n_undone > 0) {
+                contributions.Clear();
+                RecordRewritten();
+            }
+            return n_undone;
         }
-        string command_name = MakeLower(tokens[0]);
-        vector<string> arguments(make_move_iterator(tokens.begin() + 1),
-                                 make_move_iterator(tokens.end()));
-        if (command_name == "exit") {
-            break;
-        } else if (command_name == "add" || command_name == "addnode") {
-            family_tree.AddNode(Tree::Node(arguments[0], arguments.begin() + 1, arguments.end()));
-        } else if (command_name == "open") {
-            family_tree = OpenFrom(arguments[0]);
-        } else if (command_name == "save") {
-            ofstream f_output(arguments[0]);
-            f_output << family_tree;
-        } else if (command_name == "print") {
-            output << family_tree;
-        } else if (command_name == "render") {
-            auto svg_doc = family_tree.RenderSvg();
-            if (arguments.empty()) {
-                svg_doc.Render(output);
-            } else {
-                ofstream f_output(arguments[0]);
-                svg_doc.Render(f_output);
+
+        size_t Redo(size_t n_steps) {
+            // Returns number of redone edits. Redone appending edits go to journal
+            // until the first other edit, which makes snapshot rewritten once at the end
+            size_t n_redone = 0;
+            bool rewrite = false;
+            for (; n_redone < n_steps && !redo_history.empty(); ++n_redone) {
+                Edit& edit = redo_history.back();
+                bool appending = edit.first_index == family_tree.GetSize() &&
+                                 edit.first_column == family_tree.GetAttributes().GetColumnCount();
+                size_t first_index = edit.first_index, first_column = edit.first_column;
+                undo_history.push_back(family_tree.SwapSuffix(std::move(edit)));
+                redo_history.pop_back();
+                rewrite |= !appending;
+                if (!rewrite && journal) {
+                    journal->AppendSuffix(family_tree, first_index, first_column);
+                }
             }
-        } else if (command_name == "lowestcommonancestors" || command_name == "lca") {
-            auto common_ancestors = family_tree.LowestCommonAncestors(arguments[0], arguments[1]);
-            if (common_ancestors.empty()) {
-                output << "No common ancestors";
-            } else {
-                PrintSequenceWithDelimiter(output, begin(common_ancestors), end(common_ancestors));
+            if (rewrite) {
+                contributions.Clear();
+                RecordRewritten();
             }
-            output << endl;
-        } else if (command_name == "merge") {
-          Tree other_tree = OpenFrom(arguments[0]);
-          family_tree = Tree::Merge(family_tree, other_tree);
-        } else if (command_name == "help") {
-            output << R"(Every command consists of command_name and arguments separated by whitespaces:
+            return n_redone;
+        }
+    };
+
+    struct Session {
+        Workspace& workspace;
+        ostream& output;
+        bool exit_requested = false;
+    };
+
+    using CommandHandler = function<void(Session&, const vector<string>&)>;
+
+    struct Command {
+        CommandHandler handler;
+        bool modifies_tree = false;
+        // Server mode runs modifying commands exclusively, others share the tree
+    };
+
+
+    void RequireArguments(const vector<string>& arguments, size_t n_arguments, const string& usage) {
+        if (arguments.size() < n_arguments) {
+            throw invalid_argument("Too few arguments, usage: " + usage);
+        }
+    }
+
+
+    const char* const HELP_MESSAGE = R"(Every command consists of command_name and arguments separated by whitespaces:
 command_name argument1 argument2 ...
 command_name is case insensitive
 Valid commands:
 1) Exit
 2) Add or AddNode node_name [parent1_name parent2_name]
-3) Open family_tree_filename - loads family tree from file family_tree_filename
-4) Save family_tree filename - saves family tree to file family_tree_filename
+3) Open family_tree_filename - loads family tree from file family_tree_filename and replays its journal,
+   further edits are appended to journal family_tree_filename.journal
+4) Save family_tree filename - saves family tree to file family_tree_filename and starts a new empty journal for it
 5) Print - prints tree in output stream (console by default)
-6) Render render_filename - renders svg document to file render_filename (most browsers support svg document rendering)
+6) Render [render_filename [Plain|Parallel|Flat|Bundled|Lod [zoom]]] - renders svg document to file render_filename
+   (most browsers support svg document rendering), Parallel serializes nodes on all cores,
+   Flat shares styles between shapes as css classes and gives a smaller document,
+   Bundled draws children of the same parents with one connector, Lod keeps only labels that don't overlap
+   at given zoom (1 by default, at most 10000) and puts the rest into nested groups lod1, lod2, ... for deeper zoom.
+   Format follows extension of render_filename: .svgz - gzip-compressed svg, .json and .dot - node positions,
+   colors and edges for external viewers (mode is ignored)
 7) LowestCommonAncestors or LCA node1_name node2_name - finds lowest common ancestors for given nodes,
    "lowest" means that this ancestor doesn't have common ancestors in offspring
-8) Merge other_family_tree_filename - merges tree from file other_family_tree_filename to current family tree
-9) Help)" << endl;
+8) Merge other_family_tree_filename [Left|Right|Skip|Collect] - merges tree from file other_family_tree_filename
+   to current family tree. Without policy any conflicting node (same name, different parents) aborts merge,
+   otherwise all conflicts are reported and resolved: Left/Right - take current/other parents,
+   Skip - leave out conflicting nodes with their descendants, Collect - only report conflicts
+9) Stats [reset] - prints (or resets) per-operation profiling counters, needs -DFAMILY_TREE_PROFILING build
+10) Compact [Layout] - folds journal into a new snapshot of the opened (or saved) family tree file,
+    Layout also reorders nodes so that relatives are stored close to each other (faster ancestor queries)
+11) Diff other_family_tree_filename [patch_filename] - prints (or saves to patch_filename) nodes that
+    other family tree adds to current one and nodes whose parents differ
+12) Patch patch_filename - adds nodes of patch to current family tree, patch with conflicts is rejected
+13) Extract Ancestors|Descendants node_name [max_depth] filename - saves node with its ancestors (descendants)
+    at most max_depth generations away to file filename
+14) Filter attribute value [high_value] [Of node_name] - prints nodes whose attribute equals value (lies between
+    value and high_value), only among ancestors of node_name if given. Attributes are declared in family tree
+    file by lines "@ column name integer|date|string|enum enum_values..." and set by node line suffix
+    " | name=value ...", dates are YYYY[-MM[-DD]] and partial dates match whole years and months
+15) Collapse [node_name] - pedigree collapse of node: distinct ancestors of every generation versus
+    ancestor slots filled by known ancestors (2^generation for a complete pedigree without collapse);
+    without node_name - average and maximal collapse over all nodes
+16) Related node_name [k] - k (20 by default) closest blood relatives of node with their distance
+    (generations up to common ancestor plus generations down) and number of shortest paths
+17) Query [Explain] expression - prints nodes of set expression over family tree, for example
+    minus(intersect(ancestors(A), ancestors(B), generation(5)), ancestors(C)). Operators: ancestors, descendants,
+    parents, children, union, intersect, minus, generation(n[, max]), attribute(name, value[, high_value]), all;
+    other words are node names. Explain prints compiled plan instead
+18) Undo [n|checkpoint_name] - undoes last n edits (Add, Merge, Patch, Remove, Reparent, 1 by default)
+    or all edits after checkpoint (redoes undone edits up to checkpoint), opened snapshot file is rewritten
+    once with the resulting tree. History keeps only nodes from the first one an edit changed
+    (Compact Layout changes all of them)
+19) Redo [n] - redoes last n undone edits, a new edit drops undone ones
+20) Checkpoint [checkpoint_name] - names current version for Undo (cheap: appended nodes are only counted),
+    without checkpoint_name - lists checkpoints
+21) Remove node_name [Reject|Cascade|Orphan] - removes node: Reject (default) refuses if node has children,
+    Cascade removes all its descendants too, Orphan makes its children founders
+22) Reparent node_name [parent1_name parent2_name] - replaces parents of node (no parents - node becomes a founder),
+    edits making node its own ancestor are rejected
+23) Contribution [node_name [k]] - k (20 by default) founders with the largest expected share of their genome
+    in node (every child gets half of each parent); without node_name - calculates contributions of all nodes
+    in parallel for later queries
+24) Relations node_name [filename] - relation of node to every other node in one pass: nearest common ancestors
+    with generations up from node_name and down to the other node, streamed to file filename if given
+25) Help
+)";
+
+
+    const unordered_map<string, Command>& GetCommandTable() {
+        static const unordered_map<string, Command> command_table = [] {
+            unordered_map<string, Command> table;
+            table["exit"].handler = [](Session& session, const vector<string>&) {
+                session.exit_requested = true;
+            };
+            table["add"] = table["addnode"] = {[](Session& session, const vector<string>& arguments) {
+                RequireArguments(arguments, 1, "add node_name [parent1_name parent2_name]");
+                Workspace& workspace = session.workspace;
+                workspace.family_tree.AddNode(Tree::Node(arguments[0], arguments.begin() + 1, arguments.end()));
+                workspace.RecordAppended(workspace.family_tree.GetSize() - 1,
+                                         workspace.family_tree.GetAttributes().GetColumnCount());
+            }, true};
+            table["remove"] = {[](Session& session, const vector<string>& arguments) {
+                RequireArguments(arguments, 1, "remove node_name [reject|cascade|orphan]");
+                static const unordered_map<string, FamilyTree::RemovalPolicy> policies = {
+                        {"reject", FamilyTree::RemovalPolicy::RejectParents},
+                        {"cascade", FamilyTree::RemovalPolicy::Cascade},
+                        {"orphan", FamilyTree::RemovalPolicy::Orphan},
+                };
+                auto policy_it = policies.find(arguments.size() > 1 ? MakeLower(arguments[1]) : "reject");
+                if (policy_it == policies.end()) {
+                    throw invalid_argument("Unknown removal policy " + arguments[1]);
+                }
+                size_t n_removed = session.workspace.RemoveNode(arguments[0], policy_it->second);
+                session.output << n_removed << " nodes removed\n";
+            }, true};
+            table["reparent"] = {[](Session& session, const vector<string>& arguments) {
+                RequireArguments(arguments, 1, "reparent node_name [parent1_name parent2_name]");
+                session.workspace.SetParents(arguments[0], vector<string>(arguments.begin() + 1, arguments.end()));
+            }, true};
+            table["open"] = {[](Session& session, const vector<string>& arguments) {
+                RequireArguments(arguments, 1, "open family_tree_filename");
+                session.workspace.Open(arguments[0]);
+            }, true};
+            table["save"] = {[](Session& session, const vector<string>& arguments) {
+                RequireArguments(arguments, 1, "save family_tree_filename");
+                Workspace& workspace = session.workspace;
+                if (!workspace.journal || workspace.journal->GetSnapshotFilename() != arguments[0]) {
+                    workspace.journal.emplace(arguments[0]);
+                }
+                workspace.journal->Compact(workspace.family_tree);
+            }, true};
+            table["compact"] = {[](Session& session, const vector<string>& arguments) {
+                Workspace& workspace = session.workspace;
+                if (!workspace.journal) {
+                    throw runtime_error("Tree has no snapshot file yet, use save family_tree_filename");
+                }
+                if (!arguments.empty() && MakeLower(arguments[0]) == "layout") {
+                    Tree compacted_tree = workspace.family_tree;
+                    compacted_tree.Compact();
+                    // Snapshot is rewritten in the new order
+                    workspace.ReplaceTree(std::move(compacted_tree));
+                    return;
+                }
+                workspace.journal->Compact(workspace.family_tree);
+            }, true};
+            table["undo"] = {[](Session& session, const vector<string>& arguments) {
+                Workspace& workspace = session.workspace;
+                size_t n_steps = 1;
+                if (!arguments.empty()) {
+                    if (auto checkpoint_it = workspace.checkpoints.find(arguments[0]);
+                            checkpoint_it != workspace.checkpoints.end()) {
+                        if (checkpoint_it->second > workspace.undo_history.size()) {
+                            // Checkpoint was taken after current version, its edits are still in redo history
+                            size_t n_ahead = checkpoint_it->second - workspace.undo_history.size();
+                            session.output << workspace.Redo(n_ahead) << " edits redone\n";
+                            return;
+                        }
+                        n_steps = workspace.undo_history.size() - checkpoint_it->second;
+                    } else if (arguments[0].find_first_not_of("0123456789") == string::npos) {
+                        n_steps = stoul(arguments[0]);
+                    } else {
+                        throw invalid_argument("Unknown checkpoint " + arguments[0]);
+                    }
+                }
+                session.output << workspace.Undo(n_steps) << " edits undone\n";
+            }, true};
+            table["redo"] = {[](Session& session, const vector<string>& arguments) {
+                size_t n_steps = arguments.empty() ? 1 : stoul(arguments[0]);
+                session.output << session.workspace.Redo(n_steps) << " edits redone\n";
+            }, true};
+            table["checkpoint"] = {[](Session& session, const vector<string>& arguments) {
+                Workspace& workspace = session.workspace;
+                if (!arguments.empty()) {
+                    workspace.checkpoints[arguments[0]] = workspace.undo_history.size();
+                    return;
+                }
+                vector<pair<size_t, string>> checkpoints;
+                for (const auto& [name, depth] : workspace.checkpoints) {
+                    checkpoints.emplace_back(depth, name);
+                }
+                sort(checkpoints.begin(), checkpoints.end());
+                for (const auto& [depth, name] : checkpoints) {
+                    if (depth > workspace.undo_history.size()) {
+                        session.output << name << ": " << depth - workspace.undo_history.size() << " edits ahead\n";
+                    } else {
+                        session.output << name << ": " << workspace.undo_history.size() - depth << " edits ago\n";
+                    }
+                }
+            }, true};
+            table["print"].handler = [](Session& session, const vector<string>&) {
+                session.output << session.workspace.family_tree;
+            };
+            table["render"].handler = [](Session& session, const vector<string>& arguments) {
+                const auto& tree = session.workspace.family_tree;
+                string mode = arguments.size() > 1 ? MakeLower(arguments[1]) : "plain";
+                if (mode != "plain" && mode != "parallel" && mode != "flat" && mode != "bundled" && mode != "lod") {
+                    throw runtime_error("Unknown render mode " + arguments[1] +
+                                        ", should be plain, parallel, flat, bundled or lod");
+                }
+                ofstream f_output;
+                if (!arguments.empty()) {
+                    f_output.open(arguments[0]);
+                }
+                ostream& output = arguments.empty() ? session.output : f_output;
+                auto has_extension = [&arguments](string_view extension) {
+                    return !arguments.empty() && arguments[0].size() >= extension.size() &&
+                           MakeLower(arguments[0].substr(arguments[0].size() - extension.size())) == extension;
+                };
+                if (has_extension(".json")) {
+                    tree.ExportLayoutJson(output);
+                    return;
+                }
+                if (has_extension(".dot")) {
+                    tree.ExportLayoutDot(output);
+                    return;
+                }
+                optional<Gzip::OStream> compressed;
+                if (has_extension(".svgz")) {
+                    compressed.emplace(output);
+                }
+                ostream& svg_output = compressed ? *compressed : output;
+                if (mode == "parallel") {
+                    tree.RenderSvgParallel(svg_output);
+                } else if (mode == "flat") {
+                    tree.RenderFlatSvg().Render(svg_output);
+                } else if (mode == "bundled") {
+                    tree.RenderBundledSvg().Render(svg_output);
+                } else if (mode == "lod") {
+                    tree.RenderLodSvg(arguments.size() > 2 ? stod(arguments[2]) : 1.0).Render(svg_output);
+                } else {
+                    tree.RenderSvg().Render(svg_output);
+                }
+                if (compressed) {
+                    compressed->Finish();
+                }
+            };
+            table["lca"].handler = table["lowestcommonancestors"].handler = [](Session& session, const vector<string>& arguments) {
+                RequireArguments(arguments, 2, "lca node1_name node2_name");
+                auto common_ancestors = session.workspace.family_tree.LowestCommonAncestors(arguments[0], arguments[1]);
+                if (common_ancestors.empty()) {
+                    session.output << "No common ancestors";
+                } else {
+                    PrintSequenceWithDelimiter(session.output, begin(common_ancestors), end(common_ancestors));
+                }
+                session.output << '\n';
+            };
+            table["merge"] = {[](Session& session, const vector<string>& arguments) {
+                RequireArguments(arguments, 1, "merge other_family_tree_filename [left|right|skip|collect]");
+                Workspace& workspace = session.workspace;
+                Tree other_tree = OpenFrom(arguments[0]);
+                size_t old_size = workspace.family_tree.GetSize();
+                size_t old_columns = workspace.family_tree.GetAttributes().GetColumnCount();
+                if (arguments.size() == 1) {
+                    workspace.family_tree = Tree::Merge(workspace.family_tree, other_tree);
+                    // Merge keeps current nodes as prefix, only appended nodes go to journal
+                    workspace.RecordAppended(old_size, old_columns);
+                    return;
+                }
+                static const unordered_map<string, FamilyTree::MergePolicy> policies = {
+                        {"left", FamilyTree::MergePolicy::PreferLeft},
+                        {"right", FamilyTree::MergePolicy::PreferRight},
+                        {"skip", FamilyTree::MergePolicy::SkipConflicts},
+                        {"collect", FamilyTree::MergePolicy::CollectConflicts},
+                };
+                auto policy_it = policies.find(MakeLower(arguments[1]));
+                if (policy_it == policies.end()) {
+                    throw invalid_argument("Unknown merge policy " + arguments[1]);
+                }
+                auto result = Tree::Merge(workspace.family_tree, other_tree, policy_it->second);
+                for (const auto& conflict : result.conflicts) {
+                    session.output << "< " << conflict.lhs_version << "\n> " << conflict.rhs_version << '\n';
+                }
+                session.output << result.conflicts.size() << " conflicts\n";
+                if (policy_it->second == FamilyTree::MergePolicy::CollectConflicts) {
+                    return;
+                }
+                if (policy_it->second == FamilyTree::MergePolicy::PreferLeft || result.conflicts.empty()) {
+                    workspace.family_tree = std::move(result.tree);
+                    workspace.RecordAppended(old_size, old_columns);
+                } else {
+                    workspace.ReplaceTree(std::move(result.tree));
+                }
+            }, true};
+            table["diff"].handler = [](Session& session, const vector<string>& arguments) {
+                RequireArguments(arguments, 1, "diff other_family_tree_filename [patch_filename]");
+                auto patch = FamilyTree::Diff(session.workspace.family_tree, OpenFrom(arguments[0]));
+                if (arguments.size() == 1) {
+                    session.output << patch;
+                } else {
+                    ofstream f_output(arguments[1]);
+                    f_output << patch;
+                }
+            };
+            table["patch"] = {[](Session& session, const vector<string>& arguments) {
+                RequireArguments(arguments, 1, "patch patch_filename");
+                Workspace& workspace = session.workspace;
+                auto patch = FamilyTree::TreePatch<string, 2>::ParseFrom(ReadEverythingFromFile(arguments[0]));
+                size_t old_size = workspace.family_tree.GetSize();
+                FamilyTree::Apply(workspace.family_tree, patch);
+                workspace.RecordAppended(old_size, workspace.family_tree.GetAttributes().GetColumnCount());
+            }, true};
+            table["extract"].handler = [](Session& session, const vector<string>& arguments) {
+                const string usage = "extract ancestors|descendants node_name [max_depth] filename";
+                RequireArguments(arguments, 3, usage);
+                const Tree& family_tree = session.workspace.family_tree;
+                size_t max_depth = arguments.size() > 3 ? stoul(arguments[2]) : Tree::UNLIMITED_DEPTH;
+                string direction = MakeLower(arguments[0]);
+                Tree subtree;
+                if (direction == "ancestors") {
+                    subtree = family_tree.ExtractAncestry({arguments[1]}, max_depth);
+                } else if (direction == "descendants") {
+                    subtree = family_tree.ExtractDescendants({arguments[1]}, max_depth);
+                } else {
+                    throw invalid_argument("Usage: " + usage);
+                }
+                ofstream f_output(arguments.back());
+                f_output << subtree;
+            };
+            table["filter"].handler = [](Session& session, const vector<string>& arguments) {
+                const string usage = "filter attribute value [high_value] [of node_name]";
+                const Tree& family_tree = session.workspace.family_tree;
+                size_t n_filter_arguments = arguments.size();
+                optional<FamilyTree::NodeSet> ancestors;
+                if (n_filter_arguments >= 4 && MakeLower(arguments[n_filter_arguments - 2]) == "of") {
+                    ancestors = family_tree.GetAncestorSet(arguments.back());
+                    n_filter_arguments -= 2;
+                }
+                if (n_filter_arguments != 2 && n_filter_arguments != 3) {
+                    throw invalid_argument("Usage: " + usage);
+                }
+                const auto& attributes = family_tree.GetAttributes();
+                auto matching = n_filter_arguments == 2 ? attributes.FilterEqual(arguments[0], arguments[1])
+                                                        : attributes.FilterRange(arguments[0], arguments[1], arguments[2]);
+                if (ancestors) {
+                    matching &= *ancestors;
+                }
+                if (matching.IsEmpty()) {
+                    session.output << "No nodes";
+                }
+                bool first = true;
+                matching.ForEach([&](size_t index) {
+                    session.output << (first ? "" : " ") << family_tree.GetIdByIndex(index);
+                    first = false;
+                });
+                session.output << '\n';
+            };
+            table["collapse"].handler = [](Session& session, const vector<string>& arguments) {
+                const Tree& family_tree = session.workspace.family_tree;
+                auto& output = session.output;
+                auto print_percent = [&output](double ratio) {
+                    output << fixed << setprecision(2) << ratio * 100 << defaultfloat << setprecision(6) << '%';
+                };
+                if (arguments.empty()) {
+                    auto collapses = family_tree.GetPedigreeCollapseAll();
+                    if (collapses.empty()) {
+                        output << "Family tree is empty\n";
+                        return;
+                    }
+                    double ratio_sum = 0;
+                    size_t max_index = 0;
+                    for (size_t index = 0; index < collapses.size(); ++index) {
+                        ratio_sum += collapses[index].GetCollapseRatio();
+                        if (collapses[index].GetCollapseRatio() > collapses[max_index].GetCollapseRatio()) {
+                            max_index = index;
+                        }
+                    }
+                    output << "average collapse ";
+                    print_percent(ratio_sum / collapses.size());
+                    output << ", maximal collapse ";
+                    print_percent(collapses[max_index].GetCollapseRatio());
+                    output << " at " << family_tree.GetIdByIndex(max_index) << '\n';
+                    return;
+                }
+                auto collapse = family_tree.GetPedigreeCollapse(arguments[0]);
+                for (size_t generation = 1; generation < collapse.distinct_ancestors.size(); ++generation) {
+                    output << "generation " << generation << ": " << collapse.distinct_ancestors[generation]
+                           << " distinct of " << collapse.ancestor_slots[generation] << " ancestor slots, collapse ";
+                    print_percent(collapse.GetCollapseRatio(generation));
+                    output << '\n';
+                }
+                output << "total collapse ";
+                print_percent(collapse.GetCollapseRatio());
+                output << '\n';
+            };
+            table["related"].handler = [](Session& session, const vector<string>& arguments) {
+                RequireArguments(arguments, 1, "related node_name [k]");
+                size_t k = arguments.size() > 1 ? stoul(arguments[1]) : 20;
+                for (const auto& relative : session.workspace.family_tree.MostRelated(arguments[0], k)) {
+                    session.output << relative.id << " distance " << relative.distance
+                                   << " paths " << relative.paths << '\n';
+                }
+            };
+            table["query"].handler = [](Session& session, const vector<string>& arguments) {
+                const string usage = "query [explain] expression";
+                RequireArguments(arguments, 1, usage);
+                bool explain = MakeLower(arguments[0]) == "explain";
+                string expression;
+                for (size_t argument_i = explain; argument_i < arguments.size(); ++argument_i) {
+                    expression += (argument_i > explain ? " " : "") + arguments[argument_i];
+                }
+                if (expression.empty()) {
+                    throw invalid_argument("Usage: " + usage);
+                }
+                auto query = FamilyTree::Query::Compile(expression);
+                if (explain) {
+                    query.Explain(session.output);
+                    return;
+                }
+                const Tree& family_tree = session.workspace.family_tree;
+                auto matching = query.Evaluate(family_tree);
+                if (matching.IsEmpty()) {
+                    session.output << "No nodes";
+                }
+                bool first = true;
+                matching.ForEach([&](size_t index) {
+                    session.output << (first ? "" : " ") << family_tree.GetIdByIndex(index);
+                    first = false;
+                });
+                session.output << '\n';
+            };
+            table["contribution"] = {[](Session& session, const vector<string>& arguments) {
+                Workspace& workspace = session.workspace;
+                const Tree& family_tree = workspace.family_tree;
+                auto& output = session.output;
+                if (arguments.empty()) {
+                    workspace.contributions.CalculateAll(family_tree);
+                    size_t n_shares = 0;
+                    for (size_t index = 0; index < family_tree.GetSize(); ++index) {
+                        n_shares += workspace.contributions.Get(family_tree, index).size();
+                    }
+                    output << "contributions of " << family_tree.GetSize() << " nodes calculated, "
+                           << n_shares << " founder shares\n";
+                    return;
+                }
+                size_t index = family_tree.GetIndex(arguments[0]);
+                if (index == Tree::NO_INDEX) {
+                    throw invalid_argument("Unknown node " + arguments[0]);
+                }
+                size_t k = arguments.size() > 1 ? stoul(arguments[1]) : 20;
+                auto shares = workspace.contributions.Get(family_tree, index);
+                sort(shares.begin(), shares.end(), [](const auto& lhs, const auto& rhs) {
+                    return lhs.share > rhs.share || (lhs.share == rhs.share && lhs.founder_index < rhs.founder_index);
+                });
+                for (size_t share_i = 0; share_i < min(k, shares.size()); ++share_i) {
+                    output << family_tree.GetIdByIndex(shares[share_i].founder_index) << ' '
+                           << fixed << setprecision(4) << shares[share_i].share * 100 << defaultfloat
+                           << setprecision(6) << "%\n";
+                }
+            }, true};
+            table["relations"].handler = [](Session& session, const vector<string>& arguments) {
+                RequireArguments(arguments, 1, "relations node_name [filename]");
+                const Tree& family_tree = session.workspace.family_tree;
+                ofstream f_output;
+                if (arguments.size() > 1) {
+                    f_output.open(arguments[1]);
+                }
+                ostream& output = arguments.size() > 1 ? f_output : session.output;
+                size_t n_related = 0;
+                family_tree.SweepRelations(arguments[0], [&](size_t index, const auto& nearest) {
+                    if (nearest.empty()) {
+                        return;
+                    }
+                    ++n_related;
+                    output << family_tree.GetIdByIndex(index) << ':';
+                    for (size_t ancestor_i = 0; ancestor_i < nearest.size(); ++ancestor_i) {
+                        output << (ancestor_i ? ", " : " ") << family_tree.GetIdByIndex(nearest[ancestor_i].index)
+                               << " up " << nearest[ancestor_i].up << " down " << nearest[ancestor_i].down;
+                    }
+                    output << '\n';
+                });
+                if (arguments.size() > 1) {
+                    session.output << n_related << " related nodes\n";
+                }
+            };
+            table["stats"].handler = [](Session& session, const vector<string>& arguments) {
+                if (!Profiling::IsEnabled()) {
+                    session.output << "Profiling is disabled, rebuild with -DFAMILY_TREE_PROFILING\n";
+                } else if (!arguments.empty() && MakeLower(arguments[0]) == "reset") {
+                    Profiling::Registry::Instance().Reset();
+                } else {
+                    Profiling::Registry::Instance().Print(session.output);
+                }
+            };
+            table["help"].handler = [](Session& session, const vector<string>&) {
+                session.output << HELP_MESSAGE;
+            };
+            return table;
+        }();
+        return command_table;
+    }
+
+
+    const Command* FindCommand(const string& command_name) {
+        const auto& command_table = GetCommandTable();
+        auto command_it = command_table.find(command_name);
+        if (command_it == command_table.end()) {
+            // Command names are case insensitive, lowercase only when exact lookup misses
+            command_it = command_table.find(MakeLower(command_name));
+        }
+        return command_it != command_table.end() ? &command_it->second : nullptr;
+    }
+
+
+    bool SplitCommand(const string& command, string& command_name, vector<string>& arguments) {
+        vector<string> tokens = Split(command);
+        if (tokens.empty()) {
+            return false;
+        }
+        command_name = std::move(tokens[0]);
+        arguments.assign(make_move_iterator(tokens.begin() + 1), make_move_iterator(tokens.end()));
+        return true;
+    }
+}
+
+
+void RunInteraction(const string& start_filename, istream& command_stream, ostream& output) {
+    Workspace workspace;
+    Session session{.workspace = workspace, .output = output};
+    if (!start_filename.empty()) {
+        workspace.Open(start_filename);
+    }
+    string command_name;
+    vector<string> arguments;
+    for (string command; !session.exit_requested && getline(command_stream, command); ) {
+        if (!SplitCommand(command, command_name, arguments)) {
+            continue;
+        }
+        if (const Command* command = FindCommand(command_name)) {
+            command->handler(session, arguments);
         } else {
             output << "Unknown command" << endl;
         }
+        output.flush();
+    }
+}
+
+
+int RunBatch(istream& script, const string& start_filename, ostream& output, ostream& log) {
+    using Clock = chrono::steady_clock;
+    Workspace workspace;
+    Session session{.workspace = workspace, .output = output};
+    auto report_error = [&log](size_t line_number, const string& command_name, const string& message) {
+        log << "Error at line " << line_number << " (" << command_name << "): " << message << '\n';
+    };
+    try {
+        if (!start_filename.empty()) {
+            workspace.Open(start_filename);
+        }
+    } catch (const exception& e) {
+        report_error(0, "open " + start_filename, e.what());
+        return 1;
+    }
+    string command_name;
+    vector<string> arguments;
+    size_t line_number = 0;
+    for (string line; !session.exit_requested && getline(script, line); ) {
+        ++line_number;
+        if (!SplitCommand(line, command_name, arguments)) {
+            continue;
+        }
+        const Command* command = FindCommand(command_name);
+        if (!command) {
+            report_error(line_number, command_name, "Unknown command");
+            output.flush();
+            return 1;
+        }
+        auto start = Clock::now();
+        try {
+            command->handler(session, arguments);
+        } catch (const exception& e) {
+            report_error(line_number, command_name, e.what());
+            output.flush();
+            return 1;
+        }
+        chrono::duration<double, milli> elapsed = Clock::now() - start;
+        log << "line " << line_number << " " << command_name << ": "
+            << fixed << setprecision(3) << elapsed.count() << defaultfloat << " ms\n";
+    }
+    output.flush();
+    return 0;
+}
+
+
+namespace {
+    LineServer* running_server = nullptr;
+
+    void StopRunningServer(int) {
+        if (running_server) {
+            running_server->Stop();
+        }
+    }
+}
+
+
+int RunServer(const string& socket_path, const string& start_filename, size_t n_workers) {
+    Workspace workspace;
+    if (!start_filename.empty()) {
+        workspace.Open(start_filename);
+    }
+    shared_mutex tree_mutex;
+    auto handle_request = [&workspace, &tree_mutex](const string& request) {
+        LineServer::Response response;
+        string command_name;
+        vector<string> arguments;
+        if (!SplitCommand(request, command_name, arguments)) {
+            return response;
+        }
+        const Command* command = FindCommand(command_name);
+        if (!command) {
+            return LineServer::Response{.ok = false, .payload = "Unknown command"};
+        }
+        ostringstream output;
+        Session session{.workspace = workspace, .output = output};
+        if (command->modifies_tree) {
+            unique_lock lock(tree_mutex);
+            command->handler(session, arguments);
+        } else {
+            shared_lock lock(tree_mutex);
+            command->handler(session, arguments);
+        }
+        response.payload = std::move(output).str();
+        response.close_connection = session.exit_requested;
+        return response;
+    };
+    if (n_workers == 0) {
+        n_workers = max(thread::hardware_concurrency(), 1u);
     }
+    LineServer server(socket_path, n_workers, handle_request);
+    running_server = &server;
+    struct sigaction stop_action{};
+    stop_action.sa_handler = StopRunningServer;
+    sigaction(SIGINT, &stop_action, nullptr);
+    sigaction(SIGTERM, &stop_action, nullptr);
+    cerr << "Serving " << workspace.family_tree.GetSize() << " nodes on " << socket_path
+         << " with " << n_workers << " workers" << endl;
+    server.Run();
+    running_server = nullptr;
+    return 0;
 }
@@ -5,3 +5,12 @@
 
 void RunInteraction(const std::string& start_filename = "",
                     std::istream& command_stream = std::cin, std::ostream& output = std::cout);
+
+int RunBatch(std::istream& script, const std::string& start_filename = "",
+             std::ostream& output = std::cout, std::ostream& log = std::cerr);
+// Executes script commands with buffered output until exit or the first error,
+// reports per-command timing to log; returns process exit status (0 - success)
+
+int RunServer(const std::string& socket_path, const std::string& start_filename = "", size_t n_workers = 0);
+// Loads tree once and serves interaction commands over unix domain socket socket_path
+// (see LineServer for the protocol) with n_workers threads (0 - hardware concurrency)
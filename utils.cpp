@@ -43,3 +43,19 @@ std::string MakeLower(std::string str) {
               [](char ch) { return tolower(ch); });
     return str;
 }
+
+
+void WriteQuoted(std::ostream& output, std::string_view str) {
+    static const char HEX_DIGITS[] = "0123456789abcdef";
+    output << '"';
+    for (char ch : str) {
+        if (ch == '"' || ch == '\\') {
+            output << '\\' << ch;
+        } else if (static_cast<unsigned char>(ch) < 0x20) {
+            output << "\\u00" << HEX_DIGITS[ch >> 4] << HEX_DIGITS[ch & 0xf];
+        } else {
+            output << ch;
+        }
+    }
+    output << '"';
+}
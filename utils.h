@@ -8,6 +8,7 @@
 #include <chrono>
 #include <unordered_set>
 #include <sstream>
+#include <cstdint>
 
 
 std::vector<std::string> Split(std::string_view sv, const std::string& delimiter=" ");
@@ -49,3 +50,16 @@ void PrintSequenceWithDelimiter(std::ostream& output, InputIterator begin,
 
 
 std::string MakeLower(std::string);
+
+
+void WriteQuoted(std::ostream& output, std::string_view str);
+// Writes str in double quotes escaping quotes, backslashes and control characters (JSON string syntax)
+
+
+inline uint64_t MixHash(uint64_t hash) {
+    // splitmix64 finalizer: spreads bits so that sums of mixed hashes rarely collide
+    hash += 0x9e3779b97f4a7c15ULL;
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    return hash ^ (hash >> 31);
+}